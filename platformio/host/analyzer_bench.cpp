@@ -0,0 +1,766 @@
+// Host replay of the acquisition pipeline. Feeds a recorded (or
+// synthesized) stream of raw ADC DMA values through the analyzer,
+// the same way adc_task does it on the device, and reports the
+// processing throughput and the resulting state and histogram.
+//
+// Usage: analyzer_bench [-s] [-c] [-f pairs] [-d divider] [-e]
+//                       [-D items] [-W decimation] [-T trigger]
+//                       [-S segments] [-H histogram] [-R slices]
+//                       [-p passes] [-w out.bin] [recording.bin]
+//
+// -s replays one sample at a time through isr_handle_one_sample()
+// instead of a frame at a time through isr_handle_frame().
+// -f sets the pairs per frame, as with the adc_task frame profiles.
+// -c copies each frame to a buffer before processing it, as the copy
+// acquisition mode does, and profiles the copy as the acquire stage.
+// Otherwise the frames are processed in place, as the zero copy mode
+// (ADC_ZERO_COPY) does.
+// -d sets the signal capture divider and -e the envelope capture mode.
+// -D arms a deep capture of the given number of items.
+// -T sets the capture trigger as comma separated
+// source,mode,channel,falling,level,hysteresis,pre_trigger,holdoff
+// values, see analyzer::TriggerSettings. Its per item cost is the
+// trigger stage of the profiler.
+// -S sets the number of capture segments.
+// -H sets the histogram layout as comma separated layout,param1,param2
+// values, see analyzer::HistogramLayoutSettings.
+// -R also prints the histogram of the last slices, see
+// analyzer::set_histogram_window().
+// -W starts the waveform stream with the given decimation, and decodes
+// the blocks after each frame, as the BLE task does.
+//
+// A recording is the raw DMA output, a sequence of little endian
+// 16 bit adc_digi_output_data_t TYPE1 words, alternating channels
+// 6 and 7. Without a recording, a synthetic stepper move is used.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "acquisition/acq_consts.h"
+#include "acquisition/analyzer.h"
+#include "acquisition/analyzer_private.h"
+#include "acquisition/profiler.h"
+#include "acquisition/spectrum.h"
+#include "esp_adc/adc_continuous.h"
+#include "misc/zigzag_varint.h"
+
+// Same as in adc_task.cpp.
+static constexpr uint32_t kPairsPerSnapshot = 800;
+
+// Set by the -f flag. The default frame profile.
+static uint32_t pairs_per_frame = 50;
+
+// Zero current ADC reading of the synthetic signal.
+static constexpr int kSynthOffset = 1800;
+// Peak coil current of the synthetic signal, in ADC ticks.
+static constexpr int kSynthAmplitude = 600;
+// The synthetic stream repeats a DMA value about every this number
+// of values, causing one bad pair and a channel order swap.
+static constexpr int kSynthGlitchInterval = 9973;
+
+struct ReplayStats {
+  uint64_t good_67_pairs = 0;
+  uint64_t good_76_pairs = 0;
+  uint64_t bad_pairs = 0;
+  // Step events, drained after each frame as the BLE task does.
+  uint64_t step_events = 0;
+  int64_t step_events_increments = 0;
+  uint64_t step_events_seq_gaps = 0;
+  uint32_t next_step_event_seq = 0;
+  // Stall events, drained after each frame as the BLE task does.
+  uint64_t stall_events = 0;
+  uint64_t stall_events_seq_gaps = 0;
+  uint32_t next_stall_event_seq = 1;
+  // Spectrum captures, released after each frame. Keeps the one with
+  // the most v1 cycles, at full speed, for the analysis.
+  uint64_t spectrum_captures = 0;
+  int spectrum_capture_cycles = -1;
+  analyzer::SpectrumCapture spectrum_capture;
+  uint64_t snapshots = 0;
+  // Waveform blocks, drained after each frame as the BLE task does.
+  uint64_t waveform_blocks = 0;
+  uint64_t waveform_samples = 0;
+  uint64_t waveform_bytes = 0;
+  uint64_t waveform_seq_gaps = 0;
+  uint64_t waveform_decode_errors = 0;
+  uint32_t next_waveform_seq = 0;
+  int waveform_min_v1 = INT16_MAX;
+  int waveform_max_v1 = INT16_MIN;
+};
+
+// Set by the -s flag.
+static bool per_sample_replay = false;
+
+// Set by the -c flag.
+static bool copy_frames = false;
+
+// A small deterministic PRNG such that runs are repeatable.
+static uint32_t rand_state = 12345;
+static int noise(int amplitude) {
+  rand_state = rand_state * 1103515245 + 12345;
+  return (int)((rand_state >> 16) % (2 * amplitude + 1)) - amplitude;
+}
+
+static uint16_t encode_value(uint8_t channel, int adc_value) {
+  adc_value = adc_value < 0 ? 0 : adc_value > 4095 ? 4095 : adc_value;
+  adc_digi_output_data_t result;
+  result.val = 0;
+  result.type1.channel = channel;
+  result.type1.data = adc_value;
+  return result.val;
+}
+
+// Appends the ADC values of a move segment. Speed changes linearly
+// from start to end steps/sec. If not energized, the coil currents
+// are zero and the position is ignored.
+static void add_segment(std::vector<uint16_t>* values, double secs,
+    double start_speed, double end_speed, bool energized, double* steps) {
+  const int n = (int)(secs * acq_consts::kTimeTicksPerSec);
+  for (int i = 0; i < n; i++) {
+    const double speed = start_speed + (end_speed - start_speed) * i / n;
+    *steps += speed / acq_consts::kTimeTicksPerSec;
+    // Each full step is a quarter of an electrical cycle. Holding
+    // positions are at the middle of a quadrant.
+    const double phase = (M_PI / 4) + (*steps * M_PI / 2);
+    const int amplitude = energized ? kSynthAmplitude : 0;
+    const int i1 = (int)(amplitude * cos(phase));
+    const int i2 = (int)(amplitude * sin(phase));
+    values->push_back(encode_value(6, kSynthOffset + i1 + noise(8)));
+    values->push_back(encode_value(7, kSynthOffset + i2 + noise(8)));
+  }
+}
+
+// A forward acceleration ramp, a short backward move and idle
+// periods. Starts and ends de-energized so it can be looped.
+static void synthesize_recording(std::vector<uint16_t>* values) {
+  std::vector<uint16_t> clean;
+  double steps = 0;
+  add_segment(&clean, 0.10, 0, 0, false, &steps);
+  add_segment(&clean, 0.10, 0, 0, true, &steps);
+  add_segment(&clean, 0.30, 0, 3000, true, &steps);
+  add_segment(&clean, 0.30, 3000, 3000, true, &steps);
+  add_segment(&clean, 0.30, 3000, 0, true, &steps);
+  add_segment(&clean, 0.05, 0, 0, true, &steps);
+  add_segment(&clean, 0.20, -800, -800, true, &steps);
+  add_segment(&clean, 0.05, 0, 0, true, &steps);
+  add_segment(&clean, 0.10, 0, 0, false, &steps);
+
+  // Emulate DMA glitches. Repeating the first value of a pair
+  // makes that pair bad and swaps the channel order of the
+  // pairs that follow.
+  values->clear();
+  for (size_t i = 0; i < clean.size(); i++) {
+    values->push_back(clean[i]);
+    if (i % kSynthGlitchInterval == 0 && (values->size() & 1)) {
+      values->push_back(clean[i]);
+    }
+  }
+  if (values->size() & 1) {
+    values->pop_back();
+  }
+}
+
+static bool load_recording(const char* path, std::vector<uint16_t>* values) {
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "Can't open recording %s\n", path);
+    return false;
+  }
+  values->clear();
+  uint8_t bytes[2];
+  while (fread(bytes, 1, 2, f) == 2) {
+    values->push_back(bytes[0] | (bytes[1] << 8));
+  }
+  fclose(f);
+  if (values->size() & 1) {
+    values->pop_back();
+  }
+  return !values->empty();
+}
+
+static bool save_recording(
+    const char* path, const std::vector<uint16_t>& values) {
+  FILE* f = fopen(path, "wb");
+  if (!f) {
+    fprintf(stderr, "Can't create %s\n", path);
+    return false;
+  }
+  for (const uint16_t v : values) {
+    const uint8_t bytes[2] = {(uint8_t)v, (uint8_t)(v >> 8)};
+    fwrite(bytes, 1, 2, f);
+  }
+  fclose(f);
+  return true;
+}
+
+// Same as mutex_condition_sample_pair() in adc_task.cpp.
+static inline bool sort_sample_pair(const adc_digi_output_data_t& data1,
+    const adc_digi_output_data_t& data2, uint16_t* v1, uint16_t* v2,
+    ReplayStats* stats) {
+  if (data1.type1.channel == 6 && data2.type1.channel == 7) {
+    *v1 = data1.type1.data;
+    *v2 = data2.type1.data;
+    stats->good_67_pairs++;
+    return true;
+  }
+
+  if (data1.type1.channel == 7 && data2.type1.channel == 6) {
+    *v1 = data2.type1.data;
+    *v2 = data1.type1.data;
+    stats->good_76_pairs++;
+    return true;
+  }
+
+  stats->bad_pairs++;
+  return false;
+}
+
+// Replays a frame with one call per pair.
+static void replay_frame_per_sample(const adc_digi_output_data_t* buffer_values,
+    uint32_t num_pairs, ReplayStats* stats) {
+  for (uint32_t i = 0; i < 2 * num_pairs; i += 2) {
+    uint16_t v1;
+    uint16_t v2;
+    if (!sort_sample_pair(
+            buffer_values[i], buffer_values[i + 1], &v1, &v2, stats)) {
+      // A single pair frame, such that the bad pair advances the tick
+      // count as it does in the frame replay.
+      analyzer::FrameStats ignored = {};
+      analyzer::isr_handle_frame(&buffer_values[i], 1, &ignored);
+      continue;
+    }
+    analyzer::isr_handle_one_sample(v1, v2);
+  }
+}
+
+// Number of full v1 cycles of a spectrum capture. Counts the rising
+// crossings of half the synthetic amplitude, such that the noise of a
+// de-energized motor doesn't count.
+static int count_cycles(const int16_t* v1) {
+  constexpr int kLevel = kSynthAmplitude / 2;
+  int cycles = 0;
+  bool is_high = v1[0] > 0;
+  for (int i = 1; i < analyzer::kSpectrumCaptureItems; i++) {
+    if (!is_high && v1[i] > kLevel) {
+      is_high = true;
+      cycles++;
+    } else if (is_high && v1[i] < -kLevel) {
+      is_high = false;
+    }
+  }
+  return cycles;
+}
+
+// Replays a frame with a single call, as adc_task does.
+static void replay_frame(const adc_digi_output_data_t* buffer_values,
+    uint32_t num_pairs, ReplayStats* stats) {
+  analyzer::FrameStats frame_stats = {};
+  analyzer::isr_handle_frame(buffer_values, num_pairs, &frame_stats);
+  stats->good_67_pairs += frame_stats.good_67_pairs;
+  stats->good_76_pairs += frame_stats.good_76_pairs;
+  stats->bad_pairs += frame_stats.bad_pairs;
+}
+
+// Replays the values in frames of pairs_per_frame pairs, as adc_task
+// does, including the splitting of frames at the snapshot points. A
+// trailing partial frame is ignored.
+// Decodes a waveform block, as the host does, and checks that it has
+// exactly the advertised number of samples.
+static void decode_waveform_block(
+    const analyzer::WaveformBlock& block, ReplayStats* stats) {
+  if (block.seq_number != stats->next_waveform_seq) {
+    stats->waveform_seq_gaps++;
+  }
+  stats->next_waveform_seq = block.seq_number + 1;
+  stats->waveform_blocks++;
+  stats->waveform_bytes += block.num_bytes;
+
+  const uint8_t* p = block.bytes;
+  const uint8_t* const end = block.bytes + block.num_bytes;
+  int32_t v1 = 0;
+  int32_t v2 = 0;
+  for (int i = 0; i < block.num_samples; i++) {
+    int32_t delta1;
+    int32_t delta2;
+    p = zigzag_varint::parse(p, end, &delta1);
+    p = p ? zigzag_varint::parse(p, end, &delta2) : nullptr;
+    if (!p) {
+      stats->waveform_decode_errors++;
+      return;
+    }
+    v1 += delta1;
+    v2 += delta2;
+    stats->waveform_min_v1 = std::min<int>(stats->waveform_min_v1, v1);
+    stats->waveform_max_v1 = std::max<int>(stats->waveform_max_v1, v1);
+  }
+  if (p != end) {
+    stats->waveform_decode_errors++;
+    return;
+  }
+  stats->waveform_samples += block.num_samples;
+}
+
+static void replay(const std::vector<uint16_t>& values, ReplayStats* stats) {
+  const adc_digi_output_data_t* all_values =
+      (const adc_digi_output_data_t*)values.data();
+  const size_t num_frames = values.size() / (2 * pairs_per_frame);
+  static uint32_t pairs_since_snapshot = 0;
+  static std::vector<adc_digi_output_data_t> frame_buffer;
+  frame_buffer.resize(2 * pairs_per_frame);
+
+  for (size_t frame = 0; frame < num_frames; frame++) {
+    const adc_digi_output_data_t* buffer_values =
+        &all_values[frame * 2 * pairs_per_frame];
+    if (copy_frames) {
+      PROFILER_START(acquire_start);
+      memcpy(frame_buffer.data(), buffer_values,
+          frame_buffer.size() * sizeof(adc_digi_output_data_t));
+      buffer_values = frame_buffer.data();
+      PROFILER_ADD(profiler::STAGE_ACQUIRE, acquire_start);
+    }
+    PROFILER_START(frame_start);
+    uint32_t start = 0;
+    while (start < pairs_per_frame) {
+      const uint32_t n = std::min(
+          pairs_per_frame - start, kPairsPerSnapshot - pairs_since_snapshot);
+      if (per_sample_replay) {
+        replay_frame_per_sample(&buffer_values[2 * start], n, stats);
+      } else {
+        replay_frame(&buffer_values[2 * start], n, stats);
+      }
+      start += n;
+      pairs_since_snapshot += n;
+      if (pairs_since_snapshot >= kPairsPerSnapshot) {
+        PROFILER_START(snapshot_start);
+        analyzer::isr_snapshot_state();
+        stats->snapshots++;
+        pairs_since_snapshot = 0;
+        PROFILER_ADD(profiler::STAGE_SNAPSHOT, snapshot_start);
+      }
+    }
+    PROFILER_START(publish_start);
+    analyzer::isr_publish_data();
+    PROFILER_ADD(profiler::STAGE_SNAPSHOT, publish_start);
+
+    analyzer::StepEvent event;
+    while (analyzer::pop_step_event(&event)) {
+      if (event.seq_number != stats->next_step_event_seq) {
+        stats->step_events_seq_gaps++;
+      }
+      stats->next_step_event_seq = event.seq_number + 1;
+      stats->step_events++;
+      stats->step_events_increments += event.increment;
+    }
+
+    analyzer::StallEvent stall_event;
+    while (analyzer::pop_stall_event(&stall_event)) {
+      if (stall_event.seq_number != stats->next_stall_event_seq) {
+        stats->stall_events_seq_gaps++;
+      }
+      stats->next_stall_event_seq = stall_event.seq_number + 1;
+      stats->stall_events++;
+    }
+
+    const analyzer::SpectrumCapture* spectrum_capture =
+        analyzer::peek_spectrum_capture();
+    if (spectrum_capture) {
+      const int cycles = count_cycles(spectrum_capture->v1);
+      if (cycles > stats->spectrum_capture_cycles) {
+        stats->spectrum_capture_cycles = cycles;
+        stats->spectrum_capture = *spectrum_capture;
+      }
+      stats->spectrum_captures++;
+      analyzer::release_spectrum_capture();
+    }
+
+    const analyzer::WaveformBlock* block;
+    while ((block = analyzer::peek_waveform_block())) {
+      decode_waveform_block(*block, stats);
+      analyzer::release_waveform_block();
+    }
+
+#if ANALYZER_PROFILER
+    PROFILER_ADD(profiler::STAGE_FRAME, frame_start);
+    profiler::isr_end_frame();
+#endif
+  }
+}
+
+// Per frame cycles of each stage, in the host's cycle counter units.
+static void print_profiler() {
+  printf("Profiler:        cycles per frame\n");
+  printf("  stage                 min      mean       max   max bucket\n");
+  for (int i = 0; i < profiler::kNumStages; i++) {
+    profiler::StageStats stats;
+    profiler::get_stage_stats((profiler::Stage)i, &stats);
+    int max_bucket = 0;
+    for (int j = 0; j < profiler::kNumBuckets; j++) {
+      if (stats.buckets[j]) {
+        max_bucket = j;
+      }
+    }
+    printf("  %-16s %8lu  %8llu  %8lu   2^%d\n",
+        profiler::stage_name((profiler::Stage)i),
+        (unsigned long)stats.min_cycles,
+        (unsigned long long)(stats.count ? stats.total_cycles / stats.count : 0),
+        (unsigned long)stats.max_cycles, max_bucket);
+  }
+}
+
+static void print_state(const analyzer::State& state) {
+  printf("State:\n");
+  printf("  tick_count:           %llu\n",
+      (unsigned long long)state.tick_count);
+  printf("  v1, v2:               %d, %d\n", state.v1, state.v2);
+  printf("  is_energized:         %d\n", state.is_energized);
+  printf("  non_energized_count:  %u\n", (unsigned)state.non_energized_count);
+  printf("  quadrant:             %u\n", (unsigned)state.quadrant);
+  printf("  full_steps:           %d\n", state.full_steps);
+  printf("  step_fraction:        %d/256\n", state.step_fraction);
+  printf("  max_full_steps:       %d\n", state.max_full_steps);
+  printf("  max_retraction_steps: %d\n", state.max_retraction_steps);
+  printf("  quadrature_errors:    %u\n", (unsigned)state.quadrature_errors);
+  printf("  stall_suspects:       %u (last at %llu)\n",
+      (unsigned)state.stall_suspects,
+      (unsigned long long)state.last_stall_suspect_tick_count);
+}
+
+static void print_histogram_buckets(const analyzer::HistogramBucket* buckets,
+    const uint16_t* min_speeds) {
+  constexpr int n = acq_consts::kNumHistogramBuckets;
+  printf("  %-12s %12s %12s %12s\n", "steps/sec", "steps", "ticks",
+      "avg_peak");
+  for (int i = 0; i < n; i++) {
+    const analyzer::HistogramBucket& bucket = buckets[i];
+    if (!bucket.total_steps) {
+      continue;
+    }
+    // The last bucket is open ended, shown as wide as the one before it.
+    const int max_speed =
+        i + 1 < n ? min_speeds[i + 1] : 2 * min_speeds[i] - min_speeds[i - 1];
+    printf("  %5d-%-6d %12u %12llu %12llu\n", min_speeds[i], max_speed,
+        (unsigned)bucket.total_steps,
+        (unsigned long long)bucket.total_ticks_in_steps,
+        (unsigned long long)(bucket.total_step_peak_currents /
+                             bucket.total_steps));
+  }
+}
+
+static void print_histogram(const analyzer::Histogram& histogram) {
+  constexpr int n = acq_consts::kNumHistogramBuckets;
+  analyzer::HistogramLayoutSettings layout;
+  uint16_t min_speeds[n];
+  analyzer::get_histogram_layout(&layout, min_speeds);
+  printf("Histogram:\n");
+  print_histogram_buckets(histogram.buckets, min_speeds);
+
+  // The speed x peak current histogram, as bin:steps of the non empty
+  // bins of each speed bucket.
+  printf("Peak current steps (bins of %d ADC counts):\n",
+      1 << acq_consts::kPeakCurrentBinShift);
+  for (int i = 0; i < n; i++) {
+    if (!histogram.buckets[i].total_steps) {
+      continue;
+    }
+    printf("  %5d-", min_speeds[i]);
+    for (int j = 0; j < acq_consts::kNumPeakCurrentBins; j++) {
+      const uint16_t steps = histogram.peak_current_steps[i][j];
+      if (steps) {
+        printf(" %d:%u", j, (unsigned)steps);
+      }
+    }
+    printf("\n");
+  }
+
+  analyzer::StepQuantilesTable step_quantiles;
+  analyzer::sample_step_quantiles(&step_quantiles);
+  printf("Step quantiles (p50/p90/p99):\n");
+  printf("  %-12s %20s %20s\n", "steps/sec", "ticks_in_step", "peak_current");
+  for (int i = 0; i < n; i++) {
+    if (!histogram.buckets[i].total_steps) {
+      continue;
+    }
+    const analyzer::StepQuantiles& q = step_quantiles.buckets[i];
+    printf("  %5d-       %6u/%6u/%6u %6u/%6u/%6u\n", min_speeds[i],
+        q.ticks_in_step[0], q.ticks_in_step[1], q.ticks_in_step[2],
+        q.peak_current[0], q.peak_current[1], q.peak_current[2]);
+  }
+}
+
+static void print_histogram_window(const analyzer::HistogramWindow& window) {
+  analyzer::HistogramLayoutSettings layout;
+  uint16_t min_speeds[acq_consts::kNumHistogramBuckets];
+  analyzer::get_histogram_layout(&layout, min_speeds);
+  printf("Histogram of the last %hhu slices:\n", window.num_slices);
+  print_histogram_buckets(window.buckets, min_speeds);
+}
+
+int main(int argc, char** argv) {
+  int passes = 200;
+  int capture_divider = 1;
+  bool envelope_capture = false;
+  uint32_t deep_capture_items = 0;
+  int waveform_decimation = 0;
+  analyzer::TriggerSettings trigger = analyzer::kDefaultTriggerSettings;
+  int capture_segments = 1;
+  analyzer::HistogramLayoutSettings histogram_layout =
+      analyzer::kDefaultHistogramLayout;
+  int histogram_window_slices = 0;
+  const char* recording_path = nullptr;
+  const char* output_path = nullptr;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-s")) {
+      per_sample_replay = true;
+    } else if (!strcmp(argv[i], "-c")) {
+      copy_frames = true;
+    } else if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+      pairs_per_frame = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+      capture_divider = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-e")) {
+      envelope_capture = true;
+    } else if (!strcmp(argv[i], "-D") && i + 1 < argc) {
+      deep_capture_items = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-T") && i + 1 < argc) {
+      int source, mode, channel, falling, level, hysteresis, pre, holdoff;
+      if (sscanf(argv[++i], "%d,%d,%d,%d,%d,%d,%d,%d", &source, &mode,
+              &channel, &falling, &level, &hysteresis, &pre, &holdoff) != 8) {
+        fprintf(stderr, "Invalid trigger: %s\n", argv[i]);
+        return 1;
+      }
+      trigger = {
+          .source = (analyzer::TriggerSource)source,
+          .mode = (analyzer::TriggerMode)mode,
+          .channel = (uint8_t)channel,
+          .is_falling_edge = falling != 0,
+          .level = (int16_t)level,
+          .hysteresis = (uint16_t)hysteresis,
+          .pre_trigger_items = (uint16_t)pre,
+          .holdoff_items = (uint16_t)holdoff,
+      };
+    } else if (!strcmp(argv[i], "-S") && i + 1 < argc) {
+      capture_segments = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-H") && i + 1 < argc) {
+      int layout, param1, param2;
+      if (sscanf(argv[++i], "%d,%d,%d", &layout, &param1, &param2) != 3) {
+        fprintf(stderr, "Invalid histogram layout: %s\n", argv[i]);
+        return 1;
+      }
+      histogram_layout = {
+          .layout = (analyzer::HistogramLayout)layout,
+          .param1 = (uint16_t)param1,
+          .param2 = (uint16_t)param2,
+      };
+    } else if (!strcmp(argv[i], "-R") && i + 1 < argc) {
+      histogram_window_slices = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-W") && i + 1 < argc) {
+      waveform_decimation = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-p") && i + 1 < argc) {
+      passes = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+      output_path = argv[++i];
+    } else if (argv[i][0] != '-' && !recording_path) {
+      recording_path = argv[i];
+    } else {
+      fprintf(stderr,
+          "Usage: %s [-s] [-c] [-f pairs] [-d divider] [-e] [-D items] "
+          "[-W decimation] [-T trigger] [-S segments] [-H histogram] "
+          "[-R slices] [-p passes] [-w out.bin] [recording.bin]\n",
+          argv[0]);
+      return 1;
+    }
+  }
+  if (passes < 1) {
+    passes = 1;
+  }
+  if (pairs_per_frame < 1) {
+    pairs_per_frame = 1;
+  }
+
+  std::vector<uint16_t> values;
+  if (recording_path) {
+    if (!load_recording(recording_path, &values)) {
+      return 1;
+    }
+  } else {
+    synthesize_recording(&values);
+  }
+  if (output_path && !save_recording(output_path, values)) {
+    return 1;
+  }
+
+  profiler::setup();
+  analyzer::setup(nvs_config::AcquistionSettings{
+      .offset1 = kSynthOffset, .offset2 = kSynthOffset,
+      .is_reverse_direction = false});
+  analyzer::set_signal_capture_divider(capture_divider);
+  analyzer::set_signal_capture_mode(
+      envelope_capture ? analyzer::CAPTURE_MODE_ENVELOPE
+                       : analyzer::CAPTURE_MODE_DECIMATE);
+  if (!analyzer::set_capture_trigger(trigger)) {
+    fprintf(stderr, "Invalid trigger settings\n");
+    return 1;
+  }
+  if (!analyzer::set_capture_segments(capture_segments)) {
+    fprintf(stderr, "Invalid capture segments\n");
+    return 1;
+  }
+  if (!analyzer::set_histogram_layout(histogram_layout)) {
+    fprintf(stderr, "Invalid histogram layout\n");
+    return 1;
+  }
+  if (histogram_window_slices &&
+      !analyzer::set_histogram_window(histogram_window_slices)) {
+    fprintf(stderr, "Invalid histogram window\n");
+    return 1;
+  }
+  if (deep_capture_items) {
+    analyzer::arm_deep_capture(deep_capture_items);
+  }
+  if (waveform_decimation) {
+    analyzer::set_waveform_stream(
+        waveform_decimation, analyzer::kWaveformBlockMaxBytes);
+  }
+
+  ReplayStats stats;
+  const auto start = std::chrono::steady_clock::now();
+  for (int pass = 0; pass < passes; pass++) {
+    replay(values, &stats);
+  }
+  const auto end = std::chrono::steady_clock::now();
+
+  const double secs = std::chrono::duration<double>(end - start).count();
+  const uint64_t total_pairs =
+      stats.good_67_pairs + stats.good_76_pairs + stats.bad_pairs;
+  const double pairs_per_sec = total_pairs / secs;
+
+  printf("Recording:       %s\n",
+      recording_path ? recording_path : "synthetic");
+  printf("Replay:          %s\n",
+      per_sample_replay ? "per sample" : "per frame");
+  printf("Frames:          %s\n", copy_frames ? "copied" : "in place");
+  printf("Pairs per frame: %u\n", (unsigned)pairs_per_frame);
+  printf("Pairs per pass:  %zu\n", values.size() / 2);
+  printf("Passes:          %d\n", passes);
+  printf("Pairs:           %llu (good: %llu, good_swap: %llu, bad: %llu)\n",
+      (unsigned long long)total_pairs, (unsigned long long)stats.good_67_pairs,
+      (unsigned long long)stats.good_76_pairs,
+      (unsigned long long)stats.bad_pairs);
+  printf("Time:            %.3f sec\n", secs);
+  printf("ns/sample:       %.2f\n", 1e9 * secs / total_pairs);
+  printf("Samples/sec:     %.0f (%.0fx realtime)\n", pairs_per_sec,
+      pairs_per_sec / acq_consts::kTimeTicksPerSec);
+
+#if ANALYZER_PROFILER
+  print_profiler();
+#endif
+
+  analyzer::State state;
+  analyzer::sample_state(&state);
+  print_state(state);
+
+  printf("Snapshots:       %llu\n", (unsigned long long)stats.snapshots);
+  printf("Step events:     %llu (sum of increments: %lld, gaps: %llu)\n",
+      (unsigned long long)stats.step_events,
+      (long long)stats.step_events_increments,
+      (unsigned long long)stats.step_events_seq_gaps);
+  printf("Stall events:    %llu (gaps: %llu)\n",
+      (unsigned long long)stats.stall_events,
+      (unsigned long long)stats.stall_events_seq_gaps);
+
+  analyzer::Histogram histogram;
+  analyzer::sample_histogram(&histogram);
+  print_histogram(histogram);
+  if (histogram_window_slices) {
+    analyzer::HistogramWindow window;
+    analyzer::sample_histogram_window(&window);
+    print_histogram_window(window);
+  }
+
+  const analyzer::AdcCaptureBuffer* capture =
+      analyzer::take_last_capture_snapshot();
+  printf("Last capture:    seq %u, divider %u, mode %u, %u items\n",
+      (unsigned)capture->seq_number, (unsigned)capture->divider,
+      (unsigned)capture->mode, (unsigned)capture->items.size());
+  if (capture->items.size()) {
+    // The span of the capture, e.g. to compare the envelope to the
+    // decimated samples.
+    int min_v1 = INT16_MAX;
+    int max_v1 = INT16_MIN;
+    for (int i = 0; i < capture->items.size(); i++) {
+      const analyzer::AdcCaptureItem* item = capture->items.get(i);
+      min_v1 = std::min<int>(min_v1, item->min_v1);
+      max_v1 = std::max<int>(max_v1, item->v1);
+    }
+    printf("Capture v1:      [%d, %d]\n", min_v1, max_v1);
+  }
+  if (capture->num_segments > 1) {
+    // The v1 of each segment's trigger item, to check its position.
+    printf("Segments:        %u x %u items, trigger at item %u\n",
+        (unsigned)capture->num_segments, (unsigned)capture->segment_items,
+        (unsigned)capture->pre_trigger_items - 1);
+    for (int i = 0; i < capture->num_segments; i++) {
+      const uint16_t index =
+          i * capture->segment_items + capture->pre_trigger_items - 1;
+      printf("  segment %d:     trigger tick %llu, v1 %d\n", i,
+          (unsigned long long)capture->trigger_tick_counts[i],
+          index < capture->items.size() ? capture->items.get(index)->v1 : 0);
+    }
+  }
+
+  // The analysis of the spectrum task, on the kept capture.
+  if (stats.spectrum_captures) {
+    const analyzer::SpectrumCapture& spectrum_capture =
+        stats.spectrum_capture;
+    int16_t re[spectrum::kFftSize];
+    int16_t im[spectrum::kFftSize];
+    const int16_t* channels[] = {spectrum_capture.v1, spectrum_capture.v2};
+    printf("Capture spectrum: %llu captures, seq %u, divider %u\n",
+        (unsigned long long)stats.spectrum_captures,
+        (unsigned)spectrum_capture.seq_number,
+        (unsigned)spectrum_capture.divider);
+    for (int i = 0; i < 2; i++) {
+      spectrum::ChannelSpectrum result;
+      spectrum::analyze(channels[i],
+          acq_consts::kTimeTicksPerSec / spectrum_capture.divider, re, im,
+          &result);
+      printf("  v%d: %8.1f Hz, THD %4u/1000, harmonics", i + 1,
+          result.fundamental_millihz / 1000.0, (unsigned)result.thd_per_mille);
+      for (int h = 0; h < spectrum::kNumHarmonics; h++) {
+        printf(" %u", (unsigned)result.harmonic_amplitudes[h]);
+      }
+      printf("\n");
+    }
+  }
+
+  if (deep_capture_items) {
+    analyzer::DeepCaptureInfo deep;
+    analyzer::sample_deep_capture(&deep);
+    printf("Deep capture:    state %u, %u/%u items, trigger at tick %llu\n",
+        (unsigned)deep.state, (unsigned)deep.size, (unsigned)deep.capacity,
+        (unsigned long long)deep.trigger_tick_count);
+  }
+
+  if (waveform_decimation) {
+    // Dropped blocks show as sequence gaps.
+    printf("Waveform:        %llu blocks, %llu samples, %.2f bytes/sample, "
+           "gaps %llu, decode errors %llu\n",
+        (unsigned long long)stats.waveform_blocks,
+        (unsigned long long)stats.waveform_samples,
+        stats.waveform_samples
+            ? (double)stats.waveform_bytes / stats.waveform_samples
+            : 0.0,
+        (unsigned long long)stats.waveform_seq_gaps,
+        (unsigned long long)stats.waveform_decode_errors);
+    printf("Waveform v1:     [%d, %d]\n", stats.waveform_min_v1,
+        stats.waveform_max_v1);
+  }
+
+  return 0;
+}
@@ -0,0 +1,217 @@
+// Compares the cost and the noise reduction of the signal filters in
+// acquisition/filters.h, to help choosing ANALYZER_FILTER per
+// deployment.
+//
+// Usage: filter_bench [-p passes]
+//
+// For each filter it reports:
+//   ns/pair  - time to filter a pair of samples, one at a time with
+//              update() and a frame at a time with update_block().
+//   noise    - RMS of the output for a constant input with uniform
+//              +/-32 noise (RMS 18.8 at the input).
+//   gain     - amplitude gain of a 1kHz and a 4kHz sine. At 40k samples
+//              per second, 1kHz is a full step rate of 4k steps/sec.
+//   delay    - step response 50% delay, in samples.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <vector>
+
+#include "acquisition/filters.h"
+
+// Same as in adc_task.cpp and analyzer.cpp.
+static constexpr uint32_t kValuePairsPerBuffer = 50;
+static constexpr uint32_t kSamplesPerSec = 40000;
+static constexpr uint16_t kFilterFactor = 700;
+
+static constexpr int kNoiseAmplitude = 32;
+static constexpr int kNumTestSamples = 40000;
+
+static uint32_t rand_state = 12345;
+static int noise(int amplitude) {
+  rand_state = rand_state * 1103515245 + 12345;
+  return (int)((rand_state >> 16) % (2 * amplitude + 1)) - amplitude;
+}
+
+// Filters a copy of the input, one sample at a time.
+template <class F>
+static std::vector<uint16_t> filter(const std::vector<uint16_t>& input) {
+  F f;
+  std::vector<uint16_t> result(input.size());
+  for (size_t i = 0; i < input.size(); i++) {
+    result[i] = f.update(input[i]);
+  }
+  return result;
+}
+
+static double rms_around_mean(const std::vector<uint16_t>& values) {
+  double sum = 0;
+  for (auto v : values) {
+    sum += v;
+  }
+  const double mean = sum / values.size();
+  double sum_sq = 0;
+  for (auto v : values) {
+    sum_sq += (v - mean) * (v - mean);
+  }
+  return sqrt(sum_sq / values.size());
+}
+
+template <class F>
+static double noise_rms() {
+  std::vector<uint16_t> input;
+  for (int i = 0; i < kNumTestSamples; i++) {
+    input.push_back(2048 + noise(kNoiseAmplitude));
+  }
+  std::vector<uint16_t> output = filter<F>(input);
+  // Skip the settling time.
+  output.erase(output.begin(), output.begin() + 1000);
+  return rms_around_mean(output);
+}
+
+template <class F>
+static double sine_gain(double freq) {
+  constexpr double kAmplitude = 1000;
+  std::vector<uint16_t> input;
+  for (int i = 0; i < kNumTestSamples; i++) {
+    input.push_back(
+        lround(2048 + kAmplitude * sin(2 * M_PI * freq * i / kSamplesPerSec)));
+  }
+  std::vector<uint16_t> output = filter<F>(input);
+  output.erase(output.begin(), output.begin() + 1000);
+  // RMS of a sine is amplitude / sqrt(2).
+  return rms_around_mean(output) * sqrt(2) / kAmplitude;
+}
+
+template <class F>
+static int step_delay() {
+  std::vector<uint16_t> input(1000, 1000);
+  input.resize(2000, 3000);
+  const std::vector<uint16_t> output = filter<F>(input);
+  for (int i = 1000; i < 2000; i++) {
+    if (output[i] >= 2000) {
+      return i - 1000;
+    }
+  }
+  return -1;
+}
+
+// Returns ns per pair. The samples array is interleaved v1, v2.
+template <class F>
+static double time_per_sample(
+    const std::vector<uint16_t>& samples, int passes) {
+  filters::DualChannelFilter<F> f;
+  const size_t num_pairs = samples.size() / 2;
+  volatile uint32_t sink = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (int pass = 0; pass < passes; pass++) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i < num_pairs; i++) {
+      uint16_t v1 = samples[2 * i];
+      uint16_t v2 = samples[2 * i + 1];
+      f.update(&v1, &v2);
+      sum += v1 + v2;
+    }
+    sink = sink + sum;
+  }
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() * 1e9 / (num_pairs * passes);
+}
+
+// Same as time_per_sample() but a DMA frame at a time, the way
+// analyzer::isr_handle_frame() does it.
+template <class F>
+static double time_per_block(const std::vector<uint16_t>& samples, int passes) {
+  filters::DualChannelFilter<F> f;
+  const size_t num_frames = samples.size() / 2 / kValuePairsPerBuffer;
+  volatile uint32_t sink = 0;
+  uint16_t v1[kValuePairsPerBuffer];
+  uint16_t v2[kValuePairsPerBuffer];
+  const auto start = std::chrono::steady_clock::now();
+  for (int pass = 0; pass < passes; pass++) {
+    uint32_t sum = 0;
+    for (size_t frame = 0; frame < num_frames; frame++) {
+      const uint16_t* p = &samples[frame * 2 * kValuePairsPerBuffer];
+      for (uint32_t i = 0; i < kValuePairsPerBuffer; i++) {
+        v1[i] = p[2 * i];
+        v2[i] = p[2 * i + 1];
+      }
+      f.update_block(v1, v2, kValuePairsPerBuffer);
+      for (uint32_t i = 0; i < kValuePairsPerBuffer; i++) {
+        sum += v1[i] + v2[i];
+      }
+    }
+    sink = sink + sum;
+  }
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() * 1e9 / (num_frames * kValuePairsPerBuffer * passes);
+}
+
+// Verifies that update_block() matches update().
+template <class F>
+static bool block_matches(const std::vector<uint16_t>& samples) {
+  F f1;
+  F f2;
+  std::vector<uint16_t> block(samples);
+  for (size_t i = 0; i < samples.size(); i += kValuePairsPerBuffer) {
+    f2.update_block(&block[i], kValuePairsPerBuffer);
+  }
+  for (size_t i = 0; i < samples.size(); i++) {
+    if (f1.update(samples[i]) != block[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <class F>
+static bool report(
+    int id, const char* name, const std::vector<uint16_t>& samples,
+    int passes) {
+  const bool ok = block_matches<F>(samples);
+  printf("%d  %-16s %6.2f %6.2f   %5.1f   %5.3f  %5.3f   %3d   %s\n", id, name,
+      time_per_sample<F>(samples, passes), time_per_block<F>(samples, passes),
+      noise_rms<F>(), sine_gain<F>(1000), sine_gain<F>(4000), step_delay<F>(),
+      ok ? "" : "BLOCK MISMATCH");
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  int passes = 200;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:")) != -1) {
+    switch (opt) {
+      case 'p':
+        passes = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-p passes]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  // One second of interleaved noisy sine samples.
+  std::vector<uint16_t> samples;
+  for (uint32_t i = 0; i < kSamplesPerSec; i++) {
+    const double a = 2 * M_PI * 500 * i / kSamplesPerSec;
+    samples.push_back(lround(1800 + 600 * sin(a)) + noise(8));
+    samples.push_back(lround(1800 + 600 * cos(a)) + noise(8));
+  }
+
+  printf("ANALYZER_FILTER  ns/pair        noise   gain           delay\n");
+  printf("                 sample  block          1kHz   4kHz\n");
+  bool ok = true;
+  ok &= report<filters::BypassFilter>(0, "bypass", samples, passes);
+  ok &= report<filters::Adc12BitsLowPassFilter<kFilterFactor>>(
+      1, "iir", samples, passes);
+  ok &= report<filters::Adc12BitsBoxcar2Filter>(2, "boxcar2", samples, passes);
+  ok &= report<filters::Adc12BitsButterworthFilter>(
+      3, "butterworth", samples, passes);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,164 @@
+// Multithreaded stress test of SpscRing. A producer thread and a
+// consumer thread exchange numbered items through rings of the sizes
+// used by the firmware, using both the copying (push/pop) and the in
+// place (slot) APIs, and verify that every item arrives exactly once,
+// in order and intact.
+//
+// Usage: ring_stress [-n items_per_run]
+//
+// Exits with a non zero status on the first mismatch.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <initializer_list>
+#include <thread>
+
+#include "misc/spsc_ring.h"
+
+// About the sizes of analyzer::State and adc_task's AdcFrame.
+struct SmallItem {
+  uint32_t seq;
+  uint32_t payload[15];
+};
+
+struct FrameItem {
+  uint32_t seq;
+  uint16_t payload[99];
+};
+
+template <class T>
+static constexpr uint32_t payload_size() {
+  return sizeof(T::payload) / sizeof(T::payload[0]);
+}
+
+template <class T>
+static void fill_item(T* item, uint32_t seq) {
+  item->seq = seq;
+  for (uint32_t i = 0; i < payload_size<T>(); i++) {
+    item->payload[i] = seq * 31 + i;
+  }
+}
+
+template <class T>
+static bool check_item(const T& item, uint32_t expected_seq) {
+  if (item.seq != expected_seq) {
+    printf("  Expected item %u, got %u\n", expected_seq, item.seq);
+    return false;
+  }
+  T expected;
+  fill_item(&expected, expected_seq);
+  if (memcmp(item.payload, expected.payload, sizeof(expected.payload))) {
+    printf("  Item %u has a corrupted payload\n", expected_seq);
+    return false;
+  }
+  return true;
+}
+
+// Passes num_items items from a producer thread to a consumer thread.
+// Returns true if all arrived intact and in order.
+template <class T, uint16_t n>
+static bool run(const char* name, bool in_place, uint32_t num_items) {
+  static SpscRing<T, n> ring;
+  // The ring is reused by successive runs, with the same type and size,
+  // which is fine since it's empty at the end of each run.
+  // Cleared by the consumer on a mismatch, to stop the producer.
+  std::atomic<bool> ok = true;
+  uint64_t producer_full = 0;
+  uint64_t consumer_empty = 0;
+
+  const auto start = std::chrono::steady_clock::now();
+
+  std::thread producer([&]() {
+    T item;
+    for (uint32_t seq = 0; seq < num_items && ok;) {
+      if (in_place) {
+        T* slot = ring.producer_slot();
+        if (slot) {
+          fill_item(slot, seq++);
+          ring.producer_commit();
+          continue;
+        }
+      } else {
+        fill_item(&item, seq);
+        if (ring.push(item)) {
+          seq++;
+          continue;
+        }
+      }
+      producer_full++;
+      std::this_thread::yield();
+    }
+  });
+
+  std::thread consumer([&]() {
+    T item;
+    for (uint32_t seq = 0; seq < num_items && ok;) {
+      if (in_place) {
+        const T* slot = ring.consumer_slot();
+        if (slot) {
+          ok = check_item(*slot, seq++);
+          ring.consumer_release();
+          continue;
+        }
+      } else if (ring.pop(&item)) {
+        ok = check_item(item, seq++);
+        continue;
+      }
+      consumer_empty++;
+      std::this_thread::yield();
+    }
+  });
+
+  producer.join();
+  consumer.join();
+
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  const double secs = elapsed.count();
+
+  if (ok && ring.size() != 0) {
+    printf("  Ring not empty at the end: %u\n", ring.size());
+    ok = false;
+  }
+
+  printf("%-26s %-8s %9u items  %6.1f M items/s  full: %-9llu empty: %llu  "
+         "%s\n",
+      name, in_place ? "in-place" : "copy", num_items, num_items / secs / 1e6,
+      (unsigned long long)producer_full, (unsigned long long)consumer_empty,
+      ok ? "OK" : "FAILED");
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  uint32_t num_items = 10 * 1000 * 1000;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    switch (opt) {
+      case 'n':
+        num_items = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-n items_per_run]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  bool all_ok = true;
+  for (bool in_place : {false, true}) {
+    all_ok &=
+        run<SmallItem, 16>("state sized, capacity 16", in_place, num_items);
+    all_ok &=
+        run<FrameItem, 16>("frame sized, capacity 16", in_place, num_items);
+    // A minimal ring, to maximize the full/empty transitions.
+    all_ok &=
+        run<SmallItem, 2>("state sized, capacity 2", in_place, num_items);
+  }
+
+  printf("%s\n", all_ok ? "PASSED" : "FAILED");
+  return all_ok ? 0 : 1;
+}
@@ -0,0 +1,22 @@
+// Host build shim of the ESP-IDF continuous ADC output format. Same
+// layout as the ESP32 DMA output so recorded buffers can be replayed
+// as is.
+
+#pragma once
+
+#include <stdint.h>
+
+typedef struct {
+  union {
+    struct {
+      uint16_t data : 12;
+      uint16_t channel : 4;
+    } type1;
+    struct {
+      uint16_t data : 11;
+      uint16_t channel : 4;
+      uint16_t unit : 1;
+    } type2;
+    uint16_t val;
+  };
+} adc_digi_output_data_t;
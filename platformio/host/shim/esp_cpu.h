@@ -0,0 +1,19 @@
+// Host build shim of the ESP32 CPU cycle counter. Uses the time stamp
+// counter on x86 and nanoseconds elsewhere, so the host profiler
+// numbers are comparable only between host runs.
+
+#pragma once
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+
+inline uint32_t esp_cpu_get_cycle_count() { return (uint32_t)__rdtsc(); }
+#else
+#include <chrono>
+
+inline uint32_t esp_cpu_get_cycle_count() {
+  return (uint32_t)std::chrono::steady_clock::now().time_since_epoch().count();
+}
+#endif
@@ -0,0 +1,20 @@
+// Host build shim of the ESP-IDF heap capabilities allocator.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define MALLOC_CAP_8BIT (1 << 2)
+
+inline void* heap_caps_malloc(size_t size, uint32_t caps) {
+  return malloc(size);
+}
+
+inline void heap_caps_free(void* ptr) { free(ptr); }
+
+// The host has plenty. Similar to an ESP32 without BLE.
+inline size_t heap_caps_get_largest_free_block(uint32_t caps) {
+  return 256 * 1024;
+}
@@ -0,0 +1,19 @@
+// Host build shim of the ESP-IDF logging macros. Debug and verbose
+// messages are dropped.
+
+#pragma once
+
+#include <stdio.h>
+
+#define ESP_LOGE(tag, format, ...) \
+  printf("E (%s) " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) \
+  printf("W (%s) " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) \
+  printf("I (%s) " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) \
+  do {                             \
+  } while (0)
+#define ESP_LOGV(tag, format, ...) \
+  do {                             \
+  } while (0)
@@ -0,0 +1,16 @@
+// Host build shim of the FreeRTOS types used by the acquisition
+// module. The host replay is single threaded so the primitives
+// here are no-ops that always succeed.
+
+#pragma once
+
+#include <assert.h>
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef void* SemaphoreHandle_t;
+
+#define pdFALSE ((BaseType_t)0)
+#define pdTRUE ((BaseType_t)1)
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
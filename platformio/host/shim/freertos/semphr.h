@@ -0,0 +1,26 @@
+// Host build shim of the FreeRTOS semaphore API. Semaphores are
+// never contended in the single threaded host replay.
+
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+namespace host_shim {
+// Any non null handle will do.
+inline int semaphore_dummy = 0;
+}  // namespace host_shim
+
+inline SemaphoreHandle_t xSemaphoreCreateMutex() {
+  return &host_shim::semaphore_dummy;
+}
+
+inline SemaphoreHandle_t xSemaphoreCreateCounting(
+    uint32_t max_count, uint32_t initial_count) {
+  return &host_shim::semaphore_dummy;
+}
+
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks) {
+  return pdTRUE;
+}
+
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t sem) { return pdTRUE; }
@@ -0,0 +1,9 @@
+// Host build shim of the FreeRTOS task API.
+
+#pragma once
+
+#include <thread>
+
+#include "freertos/FreeRTOS.h"
+
+inline void vTaskDelay(TickType_t ticks) { std::this_thread::yield(); }
@@ -0,0 +1,20 @@
+// Host build shim of the board io. Test pins are no-ops.
+
+#pragma once
+
+#include <stdint.h>
+
+namespace io {
+
+class OutputPin {
+ public:
+  inline void set() { }
+  inline void clr() { }
+  inline void toggle() { }
+  inline void write(bool val) { }
+};
+
+inline OutputPin TEST1;
+inline OutputPin TEST2;
+
+}  // namespace io
@@ -0,0 +1,6 @@
+// Host build shim of the ESP-IDF configuration. The host replay is
+// single threaded, as the single core firmware.
+
+#pragma once
+
+#define CONFIG_FREERTOS_UNICORE 1
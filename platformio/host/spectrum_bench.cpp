@@ -0,0 +1,191 @@
+// Cost and accuracy of the fixed point spectrum analysis in
+// acquisition/spectrum.h, which the spectrum task runs on each
+// captured signal.
+//
+// Usage: spectrum_bench [-p passes]
+//
+// It reports:
+//   fft error  - max error of fft() vs. a floating point DFT of the
+//                same input, in output LSBs.
+//   us/fft     - time of a single fft() call.
+//   us/channel - time of analyze(), a channel of a capture.
+//   analysis   - for test signals of known fundamental, harmonic
+//                amplitudes and noise, the reported fundamental,
+//                amplitudes and THD. The test fails if they are not
+//                within a few percent of the expected values.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <complex>
+#include <vector>
+
+#include "acquisition/spectrum.h"
+
+using spectrum::kFftSize;
+using spectrum::kNumHarmonics;
+
+// Same as acq_consts::kTimeTicksPerSec, a capture with divider 1.
+static constexpr uint32_t kSamplesPerSec = 40000;
+
+static uint32_t rand_state = 12345;
+static int noise(int amplitude) {
+  rand_state = rand_state * 1103515245 + 12345;
+  return (int)((rand_state >> 16) % (2 * amplitude + 1)) - amplitude;
+}
+
+// A test signal, in ADC counts.
+struct TestSignal {
+  double freq;
+  // Of the fundamental and its harmonics.
+  double amplitudes[kNumHarmonics];
+  int offset;
+  int noise;
+};
+
+static std::vector<int16_t> synthesize(const TestSignal& signal) {
+  std::vector<int16_t> samples;
+  for (int i = 0; i < kFftSize; i++) {
+    double value = signal.offset;
+    for (int h = 0; h < kNumHarmonics; h++) {
+      value += signal.amplitudes[h] *
+          sin(2 * M_PI * (h + 1) * signal.freq * i / kSamplesPerSec);
+    }
+    samples.push_back(lround(value) + noise(signal.noise));
+  }
+  return samples;
+}
+
+// Max error of fft() in LSBs vs. the scaled floating point DFT.
+static double fft_error() {
+  std::vector<int16_t> re(kFftSize);
+  std::vector<int16_t> im(kFftSize);
+  for (int i = 0; i < kFftSize; i++) {
+    re[i] = noise(16000);
+    im[i] = 0;
+  }
+  std::vector<std::complex<double>> expected(kFftSize);
+  for (int k = 0; k < kFftSize; k++) {
+    for (int i = 0; i < kFftSize; i++) {
+      expected[k] +=
+          (double)re[i] * std::polar(1.0, -2 * M_PI * k * i / kFftSize);
+    }
+    expected[k] /= kFftSize;
+  }
+  spectrum::fft(re.data(), im.data());
+  double max_error = 0;
+  for (int k = 0; k < kFftSize; k++) {
+    const std::complex<double> actual(re[k], im[k]);
+    max_error = std::max(max_error, std::abs(expected[k] - actual));
+  }
+  return max_error;
+}
+
+template <class F>
+static double time_us(int passes, F f) {
+  const auto start = std::chrono::steady_clock::now();
+  for (int pass = 0; pass < passes; pass++) {
+    f();
+  }
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() * 1e6 / passes;
+}
+
+static bool within(double value, double expected, double tolerance) {
+  return fabs(value - expected) <= tolerance;
+}
+
+// Analyzes a test signal and verifies the summary. Amplitudes of 0
+// are expected to be below the noise.
+static bool report(const char* name, const TestSignal& signal) {
+  const std::vector<int16_t> samples = synthesize(signal);
+  int16_t re[kFftSize];
+  int16_t im[kFftSize];
+  spectrum::ChannelSpectrum result;
+  spectrum::analyze(samples.data(), kSamplesPerSec, re, im, &result);
+
+  double harmonics_power = 0;
+  for (int h = 1; h < kNumHarmonics; h++) {
+    harmonics_power += signal.amplitudes[h] * signal.amplitudes[h];
+  }
+  const double thd = sqrt(harmonics_power) * 1000 / signal.amplitudes[0];
+
+  // Half a bin for the frequency, and a few percent of the fundamental
+  // for the amplitudes, which includes the noise.
+  const double bin_hz = (double)kSamplesPerSec / kFftSize;
+  bool ok =
+      within(result.fundamental_millihz / 1000.0, signal.freq, bin_hz / 2);
+  const double tolerance = 0.03 * signal.amplitudes[0] + signal.noise;
+  for (int h = 0; h < kNumHarmonics; h++) {
+    if ((h + 1) * signal.freq + 2 * bin_hz < kSamplesPerSec / 2) {
+      ok &= within(
+          result.harmonic_amplitudes[h], signal.amplitudes[h], tolerance);
+    }
+  }
+  ok &= within(
+      result.thd_per_mille, thd, 1000 * tolerance / signal.amplitudes[0]);
+
+  printf("  %-16s %8.1f Hz %8.1f Hz", name, signal.freq,
+      result.fundamental_millihz / 1000.0);
+  for (int h = 0; h < 3; h++) {
+    printf("  %4d/%4.0f", result.harmonic_amplitudes[h], signal.amplitudes[h]);
+  }
+  printf("   %4d/%4.0f  %s\n", result.thd_per_mille, thd, ok ? "" : "MISMATCH");
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  int passes = 20000;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:")) != -1) {
+    switch (opt) {
+      case 'p':
+        passes = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-p passes]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  const TestSignal kTypical = {
+      .freq = 625, .amplitudes = {600, 0, 30}, .offset = 40, .noise = 8};
+  const std::vector<int16_t> samples = synthesize(kTypical);
+  int16_t re[kFftSize];
+  int16_t im[kFftSize];
+  spectrum::ChannelSpectrum result;
+  const double fft_us = time_us(passes, [&]() {
+    for (int i = 0; i < kFftSize; i++) {
+      re[i] = samples[i];
+      im[i] = 0;
+    }
+    spectrum::fft(re, im);
+  });
+  const double analyze_us = time_us(passes, [&]() {
+    spectrum::analyze(samples.data(), kSamplesPerSec, re, im, &result);
+  });
+
+  printf("FFT size:      %d\n", kFftSize);
+  printf("fft error:     %.2f LSB\n", fft_error());
+  printf("us/fft:        %.2f\n", fft_us);
+  printf("us/channel:    %.2f\n", analyze_us);
+  printf("Analysis:        expected     reported    h1         h2         h3"
+         "          THD\n");
+  bool ok = true;
+  ok &= report("on bin", kTypical);
+  ok &= report("between bins",
+      {.freq = 703.125, .amplitudes = {600, 0, 30}, .offset = 0, .noise = 8});
+  // 5 cycles of the samples, the lowest supported.
+  ok &= report("low frequency",
+      {.freq = 781.25, .amplitudes = {1000}, .offset = -20, .noise = 4});
+  ok &= report("distorted",
+      {.freq = 1250, .amplitudes = {400, 40, 80, 0, 20}, .offset = 0,
+          .noise = 4});
+  ok &= report("high frequency",
+      {.freq = 4100, .amplitudes = {800, 0, 50}, .offset = 0, .noise = 8});
+  return ok ? 0 : 1;
+}
@@ -22,9 +22,18 @@ constexpr uint32_t kTimeTicksPerSec = 40000;
 // a band of step speeds.
 constexpr int kNumHistogramBuckets = 25;
 
-// Each histogram bucket represents a speed range of 100
-// steps/sec, starting from zero. Overflow speeds are
-// aggregated in the last bucket.
+// Number of peak current bins of the 2D speed x peak current
+// histogram. Overflow currents are aggregated in the last bin.
+constexpr int kNumPeakCurrentBins = 16;
+
+// Each peak current bin represents a range of 1 << kPeakCurrentBinShift
+// ADC counts, starting from zero, such that the bin is a shift.
+constexpr int kPeakCurrentBinShift = 7;
+
+// The bucket width of the default, linear, histogram layout. Each
+// bucket represents a speed range of 200 steps/sec, starting from
+// zero. Overflow speeds are aggregated in the last bucket. See
+// analyzer::HistogramLayout for the other layouts.
 const int kBucketStepsPerSecond = 200;
 
 }  // namespace acq_consts
\ No newline at end of file
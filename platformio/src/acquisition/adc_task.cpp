@@ -4,15 +4,23 @@
 
 #include <stdio.h>
 
+#include <algorithm>
+#include <atomic>
+
+#include "acq_consts.h"
 #include "analyzer_private.h"
 #include "esp_adc/adc_continuous.h"
 #include "esp_assert.h"
+#include "esp_attr.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
 #include "freertos/task.h"
 #include "io/io.h"
 #include "misc/elapsed.h"
+#include "misc/spsc_ring.h"
+#include "profiler.h"
 #include "sdkconfig.h"
 
 namespace adc_task {
@@ -20,20 +28,37 @@ namespace adc_task {
 static constexpr auto TAG = "adc_task";
 
 constexpr uint32_t kBytesPerValue = sizeof(adc_digi_output_data_t);
-constexpr uint32_t kValuePairsPerBuffer = 50;
-constexpr uint32_t kValuesPerBuffer = 2 * kValuePairsPerBuffer;
-constexpr uint32_t kBytesPerBuffer = kValuesPerBuffer * kBytesPerValue;
-constexpr uint32_t kNumBuffers = 2000 / kValuePairsPerBuffer;
+constexpr uint32_t kBytesPerPair = 2 * kBytesPerValue;
+
+// The state is snapshotted every this number of pairs (20ms),
+// regardless of the frame size.
+constexpr uint32_t kPairsPerSnapshot = 800;
+
+struct FrameProfile {
+  uint16_t pairs_per_frame;
+  uint16_t num_frames;
+};
+
+// Indexed by the profile number. See adc_task.h. All the profiles have
+// a pool of 2000 pairs (50ms).
+static constexpr FrameProfile kFrameProfiles[kNumFrameProfiles] = {
+    {.pairs_per_frame = 10, .num_frames = 200},
+    {.pairs_per_frame = 50, .num_frames = 40},
+    {.pairs_per_frame = 250, .num_frames = 8},
+};
+
+constexpr uint32_t kMaxPairsPerFrame = 250;
+
+// Number of DMA buffers of the IDF 5.0 continuous driver
+// (INTERNAL_BUF_NUM). The DMA writes the frames to the buffers
+// round robin, so in zero copy mode a frame is valid until this number
+// of frames later.
+constexpr uint32_t kDriverDmaBuffers = 5;
 
 #if !CONFIG_IDF_TARGET_ESP32
 #error "Unexpected target CPU."
 #endif
 
-static adc_continuous_handle_cfg_t continious_config = {
-    .max_store_buf_size = kNumBuffers * kBytesPerBuffer,
-    .conv_frame_size = kBytesPerBuffer,
-};
-
 static adc_continuous_handle_t handle = nullptr;
 
 // TODO: Ok to have only two entries in this array instead
@@ -65,115 +90,528 @@ static const adc_continuous_config_t dig_cfg = {
     .format = ADC_DIGI_OUTPUT_FORMAT_TYPE1,
 };
 
-static uint8_t buffer_bytes[kBytesPerBuffer] = {0};
+// A single DMA frame.
+struct AdcFrame {
+  adc_digi_output_data_t values[2 * kMaxPairsPerFrame];
+  // Number of pairs in values. Less than the profile's pairs per frame
+  // after a short read.
+  uint16_t num_pairs;
+  // Number of pairs that were lost just before this frame, e.g. due to
+  // a DMA pool overflow.
+  uint32_t lost_pairs;
+  // For the profiler's acquire stage.
+  uint32_t acquire_cycles;
+};
 
-struct AdcTaskStats {
-  uint64_t good_67_pairs;
-  uint64_t good_76_pairs;
-  uint32_t bad_pairs;
+// The adc task, notified by the driver on each frame.
+static TaskHandle_t adc_task_handle = nullptr;
+
+#if ADC_ZERO_COPY
+// A DMA frame in the driver's DMA buffers, passed in place from the
+// conversion done callback to the adc task.
+struct DmaFrameRef {
+  const adc_digi_output_data_t* values;
+  uint16_t num_pairs;
+  // The frame's index since the driver was started.
+  uint32_t seq;
 };
 
+// Zero copy mode. A frame is overwritten kDriverDmaBuffers frames
+// after it was produced, so there is no point in queuing more.
+static SpscRing<DmaFrameRef, kDriverDmaBuffers - 1> dma_frame_refs;
+#elif CONFIG_FREERTOS_UNICORE
+// Single core mode. The adc task reads the frames into this buffer and
+// processes them.
+static AdcFrame frame_buffer;
+#else
+// Dual core mode. The adc task reads frames into this ring and the
+// analyzer task processes them. Both run on the APP CPU, while the
+// BLE stack and the main loop run on the PRO CPU.
+static SpscRing<AdcFrame, 16> frame_ring;
+// The adc task reads here frames that don't fit in the ring.
+static AdcFrame overflow_frame;
+static TaskHandle_t analyzer_task_handle = nullptr;
+#endif
+
 static SemaphoreHandle_t stats_mutex;
 static AdcTaskStats stats = {};
 
+// Updated by the ADC driver callbacks, in ISR context. The driver
+// calls on_conv_done for each frame it produces, and then
+// on_pool_ovf if the frame didn't fit in its pool and was dropped. In
+// zero copy mode, isr_overflow_frames counts the frames that didn't fit
+// in dma_frame_refs instead.
+static std::atomic<uint32_t> isr_produced_frames = 0;
+static std::atomic<uint32_t> isr_overflow_frames = 0;
+
+// Set by set_frame_profile(), applied by the adc task.
+static std::atomic<uint8_t> requested_frame_profile = kDefaultFrameProfile;
+
+// Accessed by the adc task only, except in setup().
+static struct {
+  // The profile of the running driver.
+  uint8_t frame_profile = kDefaultFrameProfile;
+  uint32_t bytes_per_frame = 0;
+  // Since the driver was started.
+  uint64_t read_bytes = 0;
+  // The value of isr_overflow_frames at the previous read.
+  uint32_t overflow_frames = 0;
+} reader;
+
+static bool IRAM_ATTR on_conv_done(adc_continuous_handle_t handle,
+    const adc_continuous_evt_data_t* edata, void* user_data) {
+  const uint32_t seq =
+      isr_produced_frames.fetch_add(1, std::memory_order_relaxed);
+#if ADC_ZERO_COPY
+  const DmaFrameRef ref = {
+      .values = (const adc_digi_output_data_t*)edata->conv_frame_buffer,
+      .num_pairs = (uint16_t)(edata->size / kBytesPerPair),
+      .seq = seq,
+  };
+  if (!dma_frame_refs.push(ref)) {
+    isr_overflow_frames.fetch_add(1, std::memory_order_relaxed);
+  }
+#else
+  (void)seq;
+#endif
+  BaseType_t task_woken = pdFALSE;
+  if (adc_task_handle) {
+    vTaskNotifyGiveFromISR(adc_task_handle, &task_woken);
+  }
+  return task_woken == pdTRUE;
+}
+
+static bool IRAM_ATTR on_pool_ovf(adc_continuous_handle_t handle,
+    const adc_continuous_evt_data_t* edata, void* user_data) {
+  isr_overflow_frames.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+void get_stats(AdcTaskStats* stats_out) {
+  xSemaphoreTake(stats_mutex, portMAX_DELAY);
+  { *stats_out = stats; }
+  xSemaphoreGive(stats_mutex);
+}
+
 void dump_stats() {
   AdcTaskStats snapshot;
+  get_stats(&snapshot);
+  ESP_LOGI(TAG, "bad: %lu, good: %llu, good_swap: %llu, dropped frames: %lu",
+      snapshot.bad_pairs, snapshot.good_67_pairs, snapshot.good_76_pairs,
+      snapshot.dropped_frames);
+  ESP_LOGI(TAG,
+      "pool overflows: %lu, short reads: %lu, read errors: %lu, backlog: "
+      "%hu/%hu (max %hu)",
+      snapshot.pool_overflow_frames, snapshot.short_reads,
+      snapshot.read_errors, snapshot.backlog_frames, snapshot.pool_frames,
+      snapshot.max_backlog_frames);
+  ESP_LOGI(TAG,
+      "frame profile: %hhu (%hu pairs), restarts: %lu, zero copy: %d, "
+      "overwritten frames: %lu",
+      snapshot.frame_profile, snapshot.pairs_per_frame,
+      snapshot.driver_restarts, ADC_ZERO_COPY, snapshot.overwritten_frames);
+}
+
+bool set_frame_profile(uint8_t frame_profile) {
+  if (frame_profile >= kNumFrameProfiles) {
+    return false;
+  }
+  requested_frame_profile.store(frame_profile, std::memory_order_relaxed);
+  return true;
+}
+
+// Creates and starts the ADC driver with the given profile.
+static void start_driver(uint8_t frame_profile) {
+  const FrameProfile& profile = kFrameProfiles[frame_profile];
+  reader.frame_profile = frame_profile;
+  reader.bytes_per_frame = profile.pairs_per_frame * kBytesPerPair;
+  reader.read_bytes = 0;
+  reader.overflow_frames = 0;
+  isr_produced_frames.store(0, std::memory_order_relaxed);
+  isr_overflow_frames.store(0, std::memory_order_relaxed);
+
+#if ADC_ZERO_COPY
+  // The driver's pool is not read. It fills up with the first frame and
+  // from then on the driver skips the copy to it.
+  const uint32_t pool_frames = 1;
+#else
+  const uint32_t pool_frames = profile.num_frames;
+#endif
+  const adc_continuous_handle_cfg_t handle_config = {
+      .max_store_buf_size = pool_frames * reader.bytes_per_frame,
+      .conv_frame_size = reader.bytes_per_frame,
+  };
+  ESP_ERROR_CHECK(adc_continuous_new_handle(&handle_config, &handle));
+  ESP_ERROR_CHECK(adc_continuous_config(handle, &dig_cfg));
+  const adc_continuous_evt_cbs_t callbacks = {
+      .on_conv_done = on_conv_done,
+      .on_pool_ovf = ADC_ZERO_COPY ? nullptr : on_pool_ovf,
+  };
+  ESP_ERROR_CHECK(
+      adc_continuous_register_event_callbacks(handle, &callbacks, nullptr));
+  ESP_ERROR_CHECK(adc_continuous_start(handle));
+
   xSemaphoreTake(stats_mutex, portMAX_DELAY);
-  { snapshot = stats; }
+  {
+    stats.frame_profile = frame_profile;
+    stats.pairs_per_frame = profile.pairs_per_frame;
+#if ADC_ZERO_COPY
+    stats.pool_frames = dma_frame_refs.capacity;
+#else
+    stats.pool_frames = profile.num_frames;
+#endif
+    stats.backlog_frames = 0;
+    stats.max_backlog_frames = 0;
+  }
   xSemaphoreGive(stats_mutex);
-  ESP_LOGI(TAG, "bad: %lu, good: %llu, good_swap: %llu", snapshot.bad_pairs,
-      stats.good_67_pairs, stats.good_76_pairs);
 }
 
-// Accepts a pair of samples, sort them to v1 and v2 and return true,
-// or returns false, if can't.
-// Called within stats mutex.
-inline bool mutex_condition_sample_pair(const adc_digi_output_data_t& data1,
-    const adc_digi_output_data_t& data2, uint16_t* v1, uint16_t* v2) {
-  if (data1.type1.channel == 6 && data2.type1.channel == 7) {
-    *v1 = data1.type1.data;
-    *v2 = data2.type1.data;
-    stats.good_67_pairs++;
-    return true;
+// Frames that the driver produced and the adc task didn't get yet.
+// Modulo 2^32 arithmetic, so it survives the counters' wrap around.
+static inline uint32_t pending_frames(uint32_t overflow_frames) {
+#if ADC_ZERO_COPY
+  return dma_frame_refs.size();
+#else
+  return isr_produced_frames.load(std::memory_order_relaxed) -
+      overflow_frames - (uint32_t)(reader.read_bytes / reader.bytes_per_frame);
+#endif
+}
+
+// Restarts the driver if a different frame profile was requested.
+// Returns the number of pairs that were lost, the frames that were
+// still in the pool plus the time the driver was stopped. Called by the
+// adc task between reads.
+static uint32_t maybe_restart_driver() {
+  const uint8_t frame_profile =
+      requested_frame_profile.load(std::memory_order_relaxed);
+  if (frame_profile == reader.frame_profile) {
+    return 0;
   }
 
-  if (data1.type1.channel == 7 && data2.type1.channel == 6) {
-    *v1 = data2.type1.data;
-    *v2 = data1.type1.data;
-    stats.good_76_pairs++;
-    return true;
+  ESP_ERROR_CHECK(adc_continuous_stop(handle));
+  const int64_t stop_time_us = esp_timer_get_time();
+  // The callbacks are quiet now.
+  const uint32_t overflow_frames =
+      isr_overflow_frames.load(std::memory_order_relaxed);
+  const uint32_t new_overflow_frames = overflow_frames - reader.overflow_frames;
+  const uint32_t pool_frames = pending_frames(overflow_frames);
+  const uint32_t pairs_per_frame = reader.bytes_per_frame / kBytesPerPair;
+#if ADC_ZERO_COPY
+  // The DMA buffers are freed with the driver.
+  while (dma_frame_refs.consumer_slot()) {
+    dma_frame_refs.consumer_release();
   }
+#endif
+  ESP_ERROR_CHECK(adc_continuous_deinit(handle));
+  handle = nullptr;
 
-  stats.bad_pairs++;
-  return false;
+  start_driver(frame_profile);
+  const int64_t stopped_us = esp_timer_get_time() - stop_time_us;
+
+  xSemaphoreTake(stats_mutex, portMAX_DELAY);
+  {
+    stats.pool_overflow_frames += new_overflow_frames;
+    stats.driver_restarts++;
+  }
+  xSemaphoreGive(stats_mutex);
+
+  ESP_LOGI(TAG, "Switched to frame profile %hhu in %lldus", frame_profile,
+      stopped_us);
+  return (new_overflow_frames + pool_frames) * pairs_per_frame +
+      (uint32_t)((stopped_us * acq_consts::kTimeTicksPerSec) / 1000000);
+}
+
+// Returns the pairs of the frames the driver dropped since the
+// previous call, and updates the pool stats. The dropped frames may be
+// newer than the ones that are still pending, but they are accounted
+// here, which is close enough for the time base.
+static uint32_t update_pool_stats() {
+  const uint32_t overflow_frames =
+      isr_overflow_frames.load(std::memory_order_relaxed);
+  const uint32_t new_overflow_frames = overflow_frames - reader.overflow_frames;
+  reader.overflow_frames = overflow_frames;
+  const uint32_t backlog_frames = pending_frames(overflow_frames);
+
+  xSemaphoreTake(stats_mutex, portMAX_DELAY);
+  {
+    stats.pool_overflow_frames += new_overflow_frames;
+    stats.backlog_frames =
+        std::min(backlog_frames, (uint32_t)stats.pool_frames);
+    stats.max_backlog_frames =
+        std::max(stats.max_backlog_frames, stats.backlog_frames);
+  }
+  xSemaphoreGive(stats_mutex);
+
+  return new_overflow_frames * (reader.bytes_per_frame / kBytesPerPair);
+}
+
+#if !ADC_ZERO_COPY
+
+// Reads the next DMA frame. Blocking. Sets frame->num_pairs to the
+// number of pairs read, possibly zero, and frame->lost_pairs to the
+// pairs the driver dropped since the previous read.
+static void read_frame(AdcFrame* frame) {
+  // TEST1 pin is high during processing and low during waiting for new
+  // data.
+  io::TEST1.clr();
+  // Wait for a frame, such that the read doesn't block and the profiler
+  // measures only its copy.
+  while (!pending_frames(isr_overflow_frames.load(std::memory_order_relaxed))) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  }
+  io::TEST1.set();
+
+  PROFILER_START(acquire_start);
+  uint32_t num_ret_bytes = 0;
+  esp_err_t err_code = adc_continuous_read(handle, (uint8_t*)frame->values,
+      reader.bytes_per_frame, &num_ret_bytes, ADC_MAX_DELAY);
+  frame->acquire_cycles = PROFILER_ELAPSED(acquire_start);
+
+  if (err_code != ESP_OK) {
+    num_ret_bytes = 0;
+  }
+  reader.read_bytes += num_ret_bytes;
+  frame->num_pairs = num_ret_bytes / kBytesPerPair;
+  frame->lost_pairs = update_pool_stats();
+
+  if (err_code != ESP_OK || num_ret_bytes != reader.bytes_per_frame) {
+    xSemaphoreTake(stats_mutex, portMAX_DELAY);
+    {
+      if (err_code != ESP_OK) {
+        stats.read_errors++;
+      } else {
+        stats.short_reads++;
+      }
+    }
+    xSemaphoreGive(stats_mutex);
+  }
+
+  if (err_code != ESP_OK) {
+    ESP_LOGE(TAG, "ADC read failed: %0x", err_code);
+  }
+}
+
+#endif
+
+// Advances the caller's snapshot counter by num_pairs, and snapshots
+// the state when it reaches kPairsPerSnapshot. num_pairs should not
+// cross the snapshot point.
+static inline void isr_advance_snapshot_counter(
+    uint32_t num_pairs, uint32_t* pairs_since_snapshot) {
+  *pairs_since_snapshot += num_pairs;
+  if (*pairs_since_snapshot >= kPairsPerSnapshot) {
+    PROFILER_START(snapshot_start);
+    analyzer::isr_snapshot_state();
+    *pairs_since_snapshot = 0;
+    PROFILER_ADD(profiler::STAGE_SNAPSHOT, snapshot_start);
+  }
+}
+
+// Passes a frame to the analyzer. lost_pairs are the pairs that were
+// lost just before the frame. pairs_since_snapshot is the caller's
+// state snapshot counter. The frame is split at the snapshot points
+// such that the snapshots are exactly kPairsPerSnapshot apart,
+// regardless of the frame size.
+static void process_frame(const adc_digi_output_data_t* values,
+    uint16_t num_pairs, uint32_t lost_pairs, uint32_t* pairs_since_snapshot) {
+  PROFILER_START(frame_start);
+  // We expect the buffer to have the same order of pairs.
+  analyzer::FrameStats frame_stats = {};
+  analyzer::enter_mutex();
+  {
+    // Advance the time base over the lost pairs, if any.
+    while (lost_pairs) {
+      const uint32_t n =
+          std::min(lost_pairs, kPairsPerSnapshot - *pairs_since_snapshot);
+      analyzer::isr_handle_lost_pairs(n);
+      lost_pairs -= n;
+      isr_advance_snapshot_counter(n, pairs_since_snapshot);
+    }
+
+    uint16_t start = 0;
+    while (start < num_pairs) {
+      const uint16_t n = std::min<uint32_t>(
+          num_pairs - start, kPairsPerSnapshot - *pairs_since_snapshot);
+      analyzer::isr_handle_frame(&values[2 * start], n, &frame_stats);
+      start += n;
+      isr_advance_snapshot_counter(n, pairs_since_snapshot);
+    }
+
+    PROFILER_START(publish_start);
+    analyzer::isr_publish_data();
+    PROFILER_ADD(profiler::STAGE_SNAPSHOT, publish_start);
+  }
+  analyzer::exit_mutex();
+
+  xSemaphoreTake(stats_mutex, portMAX_DELAY);
+  {
+    stats.good_67_pairs += frame_stats.good_67_pairs;
+    stats.good_76_pairs += frame_stats.good_76_pairs;
+    stats.bad_pairs += frame_stats.bad_pairs;
+  }
+  xSemaphoreGive(stats_mutex);
+
+#if ANALYZER_PROFILER
+  PROFILER_ADD(profiler::STAGE_FRAME, frame_start);
+  profiler::isr_end_frame();
+#endif
 }
 
+// Passes a frame of the copy mode to the analyzer.
+static inline void process_frame(
+    const AdcFrame& frame, uint32_t* pairs_since_snapshot) {
+  PROFILER_ADD_CYCLES(profiler::STAGE_ACQUIRE, frame.acquire_cycles);
+  process_frame(
+      frame.values, frame.num_pairs, frame.lost_pairs, pairs_since_snapshot);
+}
+
+#if ADC_ZERO_COPY
+
+// Processes the frames in place, in the DMA buffers. Single task in
+// both single and dual core modes since there is no blocking read to
+// decouple from the analysis.
 void adc_task(void* ignored) {
-  uint32_t buffers_count = 0;
-  uint32_t samples_to_snapshot = 0;
+  uint32_t pairs_since_snapshot = 0;
+  // Pairs of skipped frames, not passed yet to the analyzer.
+  uint32_t pending_lost_pairs = 0;
 
   for (;;) {
-    // TEST1 pin is high during processing and low during waiting for new
-    // data.
+    pending_lost_pairs += maybe_restart_driver();
+
+    // TEST1 pin is high during processing and low during waiting for
+    // new data.
     io::TEST1.clr();
-    uint32_t num_ret_bytes = 0;
-    esp_err_t err_code = adc_continuous_read(
-        handle, buffer_bytes, kBytesPerBuffer, &num_ret_bytes, ADC_MAX_DELAY);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
     io::TEST1.set();
 
-    // Sanity check the results.
-    if (err_code != ESP_OK || num_ret_bytes != kBytesPerBuffer) {
-      ESP_LOGE(TAG, "ADC read failed: %0x %lu", err_code, num_ret_bytes);
-      assert(false);
+    const DmaFrameRef* ref;
+    while ((ref = dma_frame_refs.consumer_slot())) {
+      pending_lost_pairs += update_pool_stats();
+      PROFILER_START(acquire_start);
+      // Frames produced since this one. The DMA is already writing
+      // the next frame.
+      uint32_t age = isr_produced_frames.load(std::memory_order_relaxed) -
+          ref->seq;
+      if (age >= kDriverDmaBuffers) {
+        // Already overwritten.
+        pending_lost_pairs += ref->num_pairs;
+        dma_frame_refs.consumer_release();
+        xSemaphoreTake(stats_mutex, portMAX_DELAY);
+        { stats.dropped_frames++; }
+        xSemaphoreGive(stats_mutex);
+        continue;
+      }
+      PROFILER_ADD(profiler::STAGE_ACQUIRE, acquire_start);
+
+      process_frame(ref->values, ref->num_pairs, pending_lost_pairs,
+          &pairs_since_snapshot);
+      pending_lost_pairs = 0;
+
+      age = isr_produced_frames.load(std::memory_order_relaxed) - ref->seq;
+      if (age >= kDriverDmaBuffers) {
+        // The tail of the frame may contain newer pairs. Not worth
+        // dropping the analysis, but reported.
+        xSemaphoreTake(stats_mutex, portMAX_DELAY);
+        { stats.overwritten_frames++; }
+        xSemaphoreGive(stats_mutex);
+      }
+      dma_frame_refs.consumer_release();
     }
+  }
+}
 
-    adc_digi_output_data_t* buffer_values =
-        (adc_digi_output_data_t*)&buffer_bytes;
+#elif CONFIG_FREERTOS_UNICORE
 
-    buffers_count++;
+void adc_task(void* ignored) {
+  uint32_t pairs_since_snapshot = 0;
 
-    // We expect the buffer to have the same order of pairs.
-    analyzer::enter_mutex();
-    xSemaphoreTake(stats_mutex, portMAX_DELAY);
-    {
-      for (int i = 0; i < kValuesPerBuffer; i += 2) {
-        uint16_t v1;
-        uint16_t v2;
-        if (!mutex_condition_sample_pair(
-                buffer_values[i], buffer_values[i + 1], &v1, &v2)) {
-          // Bad pair. Skip.
-          continue;
-        }
-        analyzer::isr_handle_one_sample(v1, v2);
-      }
-    }
+  for (;;) {
+    const uint32_t restart_lost_pairs = maybe_restart_driver();
+    read_frame(&frame_buffer);
+    frame_buffer.lost_pairs += restart_lost_pairs;
+    process_frame(frame_buffer, &pairs_since_snapshot);
+  }
+}
+
+#else
+
+// The DMA reader. Runs at a higher priority than the analyzer task
+// so the DMA pool is drained even if the analysis falls behind.
+void adc_task(void* ignored) {
+  // Pairs of dropped frames, not passed yet to the analyzer.
+  uint32_t pending_lost_pairs = 0;
 
-    samples_to_snapshot += kValuePairsPerBuffer;
-    if (samples_to_snapshot >= 800) {
-      analyzer::isr_snapshot_state();
-      samples_to_snapshot = 0;
+  for (;;) {
+    pending_lost_pairs += maybe_restart_driver();
+
+    // Read directly into the ring, if it has room.
+    AdcFrame* frame = frame_ring.producer_slot();
+    if (frame) {
+      read_frame(frame);
+      frame->lost_pairs += pending_lost_pairs;
+      pending_lost_pairs = 0;
+      frame_ring.producer_commit();
+      xTaskNotifyGive(analyzer_task_handle);
+      continue;
     }
+
+    read_frame(&overflow_frame);
+    pending_lost_pairs += overflow_frame.lost_pairs + overflow_frame.num_pairs;
+    xSemaphoreTake(stats_mutex, portMAX_DELAY);
+    { stats.dropped_frames++; }
     xSemaphoreGive(stats_mutex);
-    analyzer::exit_mutex();
   }
 }
 
-void setup() {
+void analyzer_task(void* ignored) {
+  uint32_t pairs_since_snapshot = 0;
+
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    const AdcFrame* frame;
+    while ((frame = frame_ring.consumer_slot())) {
+      process_frame(*frame, &pairs_since_snapshot);
+      frame_ring.consumer_release();
+    }
+  }
+}
+
+#endif
+
+void setup(uint8_t frame_profile) {
   stats_mutex = xSemaphoreCreateMutex();
   assert(stats_mutex);
+  profiler::setup();
 
-  ESP_ERROR_CHECK(adc_continuous_new_handle(&continious_config, &handle));
-  ESP_ERROR_CHECK(adc_continuous_config(handle, &dig_cfg));
-  ESP_ERROR_CHECK(adc_continuous_start(handle));
+  if (frame_profile >= kNumFrameProfiles) {
+    ESP_LOGE(TAG, "Invalid frame profile %hhu, using default.", frame_profile);
+    frame_profile = kDefaultFrameProfile;
+  }
+  requested_frame_profile.store(frame_profile, std::memory_order_relaxed);
+  start_driver(frame_profile);
 
-  TaskHandle_t xHandle = NULL;
+#if CONFIG_FREERTOS_UNICORE
   // Create the task, storing the handle.  Note that the passed parameter
   // ucParameterToPass must exist for the lifetime of the task, so in this case
   // is declared static.  If it was just an an automatic stack variable it might
   // no longer exist, or at least have been corrupted, by the time the new task
   // attempts to access it.
-  xTaskCreate(adc_task, "ADC", 4000, nullptr, 10, &xHandle);
-  configASSERT(xHandle);
+  xTaskCreate(adc_task, "ADC", 4000, nullptr, 10, &adc_task_handle);
+  configASSERT(adc_task_handle);
+#elif ADC_ZERO_COPY
+  // A single task, on the APP CPU as in the copy mode.
+  xTaskCreatePinnedToCore(adc_task, "ADC", 4000, nullptr, 10,
+      &adc_task_handle, APP_CPU_NUM);
+  configASSERT(adc_task_handle);
+#else
+  // The analyzer task is created first since the adc task notifies it.
+  xTaskCreatePinnedToCore(analyzer_task, "ANALYZER", 4000, nullptr, 10,
+      &analyzer_task_handle, APP_CPU_NUM);
+  configASSERT(analyzer_task_handle);
+  xTaskCreatePinnedToCore(
+      adc_task, "ADC", 3000, nullptr, 11, &adc_task_handle, APP_CPU_NUM);
+  configASSERT(adc_task_handle);
+#endif
 }
 
 }  // namespace adc_task
@@ -1,10 +1,70 @@
 #pragma once
 
+#include <stdint.h>
+
 #include "esp_adc/adc_continuous.h"
 
+// Acquisition mode, selected at build time.
+//   0 - Copy. The adc task reads each DMA frame from the driver's pool
+//       with adc_continuous_read(), which copies it.
+//   1 - Zero copy. The driver's conversion done callback passes a
+//       pointer to the DMA buffer of each frame and the frames are
+//       processed in place. Saves the copies and the pool's locking, at
+//       the cost of having to process each frame before the DMA
+//       overwrites it, about 4 frames later.
+// The profiler's acquire stage reports the per frame cost of each mode.
+#ifndef ADC_ZERO_COPY
+#define ADC_ZERO_COPY 0
+#endif
+
 namespace adc_task {
 
-void setup();
+// DMA frame profiles, trading latency for task wakeups per second.
+//   0 - Low latency. 10 pairs per frame, 0.25ms, 4000 frames/sec.
+//   1 - Default. 50 pairs per frame, 1.25ms, 800 frames/sec.
+//   2 - Low overhead. 250 pairs per frame, 6.25ms, 160 frames/sec.
+constexpr uint8_t kNumFrameProfiles = 3;
+constexpr uint8_t kDefaultFrameProfile = 1;
+
+// Acquisition health counters, since boot.
+struct AdcTaskStats {
+  uint64_t good_67_pairs;
+  uint64_t good_76_pairs;
+  uint32_t bad_pairs;
+  // Frames that the ADC driver dropped because its pool was full. In
+  // zero copy mode, the pool is the ring of frame pointers.
+  uint32_t pool_overflow_frames;
+  // Frames dropped because the analyzer task was behind. Dual core
+  // mode, or zero copy mode for frames that the DMA already
+  // overwrote.
+  uint32_t dropped_frames;
+  // Reads that returned less than a full frame, and reads that failed.
+  uint32_t short_reads;
+  uint32_t read_errors;
+  // Frames in the driver's pool that were not read yet. Current and
+  // max values. A growing backlog indicates that other tasks starve
+  // the acquisition.
+  uint16_t backlog_frames;
+  uint16_t max_backlog_frames;
+  // The capacity of the driver's pool, in frames.
+  uint16_t pool_frames;
+  // The current frame profile and its frame size.
+  uint8_t frame_profile;
+  uint16_t pairs_per_frame;
+  // Number of driver restarts to change the frame profile.
+  uint32_t driver_restarts;
+  // Zero copy mode only. Frames that the DMA started to overwrite
+  // while they were processed.
+  uint32_t overwritten_frames;
+};
+
+void setup(uint8_t frame_profile);
+// Requests to switch to the given frame profile. The adc task applies
+// it by restarting the ADC driver, and the pairs that are lost while
+// restarting are accounted as lost pairs. Returns false if the profile
+// is invalid.
+bool set_frame_profile(uint8_t frame_profile);
 void dump_stats();
+void get_stats(AdcTaskStats* stats);
 
-}  // namespace adc_task
\ No newline at end of file
+}  // namespace adc_task
@@ -11,13 +11,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <algorithm>
+#include <atomic>
+
 #include "analyzer_private.h"
+#include "cordic.h"
+#include "esp_heap_caps.h"
 #include "esp_log.h"
 #include "filters.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
 #include "io/io.h"
 #include "misc/circular_buffer.h"
+#include "misc/log_sketch.h"
+#include "misc/seqlock.h"
+#include "misc/spsc_ring.h"
+#include "misc/zigzag_varint.h"
+#include "profiler.h"
 
 namespace analyzer {
 
@@ -33,9 +43,41 @@ static SemaphoreHandle_t data_mutex;
 void enter_mutex() { ENTER_MUTEX }
 void exit_mutex() { EXIT_MUTEX }
 
-// Circular buffer of states. Used for state notifications.
-// With 20ms per sample, 10 entires provides 200ms buffering.
-static CircularBuffer<State, 10> state_circular_buffer;
+// Lock free queue of states from the adc task to the main task. Used
+// for state notifications. With 20ms per sample, 16 entires provides
+// 320ms buffering. If full, new states are dropped.
+static SpscRing<State, 16> state_circular_buffer;
+
+// Number of states dropped because state_circular_buffer was full.
+// Accessed by the adc task only.
+static uint32_t dropped_states = 0;
+
+// Lock free queue of step events from the adc task to the BLE step
+// events task. At 3k steps/sec, 256 entries provides 85ms buffering.
+// If full, new events are dropped.
+static SpscRing<StepEvent, 256> step_event_ring;
+
+// Number of step events dropped because step_event_ring was full.
+// Accessed by the adc task only.
+static uint32_t dropped_step_events = 0;
+
+// Lock free queue of stall events from the adc task to the BLE step
+// events task. Stall events are rare. If full, new events are dropped.
+static SpscRing<StallEvent, 8> stall_event_ring;
+
+// Lock free queue of waveform blocks from the adc task to the BLE
+// waveform task. Blocks are filled in place. At decimation 1, a block
+// has about 50 samples, so 16 entries provide about 20ms buffering.
+// If full, new blocks are dropped.
+static SpscRing<WaveformBlock, 16> waveform_ring;
+
+// Filled instead of a ring slot when the ring is full, such that the
+// block boundaries don't depend on the consumer.
+static WaveformBlock waveform_dropped_block;
+
+// A waveform block is completed after this number of ticks, to bound
+// the stream latency at high decimations.
+constexpr uint32_t kWaveformBlockMaxTicks = acq_consts::kTimeTicksPerSec / 10;
 
 // We signal this one each time we insert an item to state_circular_buffer.
 static SemaphoreHandle_t circular_state_semaphore;
@@ -55,6 +97,45 @@ constexpr uint16_t kEnergizedThresholdCounts = 150;
 // (0, 1024).
 constexpr uint16_t kFilterFactor = 700;
 
+// Selects the signal filter, trading CPU time for noise. Can be set
+// per deployment with a build flag, e.g. -DANALYZER_FILTER=2. See
+// host/filter_bench.cpp for the cost and noise of each.
+//   0 - No filtering.
+//   1 - First order IIR (default).
+//   2 - Average of two samples.
+//   3 - Second order Butterworth.
+#ifndef ANALYZER_FILTER
+#define ANALYZER_FILTER 1
+#endif
+
+#if ANALYZER_FILTER == 0
+using SignalFilter = filters::BypassFilter;
+#elif ANALYZER_FILTER == 1
+using SignalFilter = filters::Adc12BitsLowPassFilter<kFilterFactor>;
+#elif ANALYZER_FILTER == 2
+using SignalFilter = filters::Adc12BitsBoxcar2Filter;
+#elif ANALYZER_FILTER == 3
+using SignalFilter = filters::Adc12BitsButterworthFilter;
+#else
+#error "Unknown ANALYZER_FILTER."
+#endif
+
+// Selects the quadrant decoder. Can be set with a build flag, e.g.
+// -DANALYZER_QUADRANT_DECODER=0. The two give identical results. On
+// the host replay their speed is within the measurement noise, since
+// the host predicts the tree's branches well. The table is the default
+// since it replaces the tree's three levels of data dependent branches
+// with a single lookup, which matters more on the ESP32's in order
+// core.
+//   0 - Decision tree.
+//   1 - Table lookup (default).
+#ifndef ANALYZER_QUADRANT_DECODER
+#define ANALYZER_QUADRANT_DECODER 1
+#endif
+
+// Max number of sample pairs the frame handler filters at once.
+constexpr uint16_t kMaxFilterBlockPairs = 64;
+
 // Allowed range for adc zero current offset setting.
 // This range is wider than needed and actual offsets
 // are expected to be around 1900.
@@ -65,20 +146,67 @@ constexpr int kMaxOffset = 4095;  // 12 bits max
 constexpr uint16_t kStepsCaptureDivider =
     acq_consts::kTimeTicksPerSec / kStepsCaptursPerSec;
 
+// Size of the histogram threshold table, a power of two that is larger
+// than kNumHistogramBuckets such that the bucket lookup is a fixed
+// number of binary search steps without bound checks.
+constexpr int kHistogramThresholdsSize = 32;
+static_assert(kHistogramThresholdsSize > acq_consts::kNumHistogramBuckets);
+
+// Slower steps are ignored.
+constexpr uint32_t kMaxHistogramTicksInStep =
+    acq_consts::kTimeTicksPerSec / kMinHistogramStepsPerSec;
+
+// Stall detection, see isr_detect_stall(). A step is anomalous if its
+// peak current is kStallPeakCurrentExcess above the baseline of its
+// speed bucket, or if its duration is more than twice or less than half
+// the baseline of the recent steps. Baselines are exponential moving
+// averages with the given shifts as their weights.
+constexpr int kStallPeakBaselineShift = 4;
+constexpr int kStallTicksBaselineShift = 2;
+// 5/4, i.e. 25% above the baseline.
+constexpr uint32_t kStallPeakCurrentExcessNum = 5;
+constexpr uint32_t kStallPeakCurrentExcessDen = 4;
+// Peak current baselines below this are too noisy to compare with.
+constexpr uint32_t kStallMinPeakCurrent = 64;
+// Steps of a speed bucket before its baseline is used.
+constexpr uint8_t kStallWarmupSteps = 16;
+// Consecutive anomalous steps that raise a stall suspect, and
+// consecutive normal steps that clear it, such that a stall raises a
+// single event.
+constexpr uint8_t kStallSuspectSteps = 3;
+constexpr uint8_t kStallClearSteps = 16;
+
+// ADC ticks per histogram slice.
+constexpr uint32_t kHistogramSliceTicks = acq_consts::kTimeTicksPerSec;
+
+// Min ADC ticks between histogram publishes, the state snapshot period.
+// The histogram is large, so copying it after each frame that added a
+// step would cost the acquisition up to thousands of copies per second.
+constexpr uint32_t kHistogramPublishTicks = acq_consts::kTimeTicksPerSec / 50;
+
+// Min ADC ticks between step quantiles updates, which bounds the cost
+// of computing the quantiles from the sketches.
+constexpr uint32_t kStepQuantilesPublishTicks =
+    acq_consts::kTimeTicksPerSec / 10;
+
+// Heap bytes that a deep capture leaves for the rest of the firmware.
+constexpr size_t kDeepCaptureHeapReserve = 32 * 1024;
+
 enum AdcCaptureState {
-  // Blind filling half of the capture buffer. In this state we don't
-  // look for a trigger because we want to have at least half a buffer
-  // captured before the trigger.
-  ADC_CAPTURE_HALF_FILL,
+  // Blind filling of the pre trigger items, and the holdoff. In this
+  // state we don't look for a trigger because we want to have the
+  // pre trigger items captured before the trigger.
+  ADC_CAPTURE_PRE_FILL,
   // Keep filling in a circular way until a trigger event
   // or wait for trigger timeout.
   ADC_CAPTURE_PRE_TRIGGER,
   // Keep filling the buffer until the capture buffer is full.
   // When we complete this state, we clear the buffer and go back
-  // to go back to ADC_CAPTURE_HALF_FILL.
+  // to go back to ADC_CAPTURE_PRE_FILL.
   ADC_CAPTURE_POST_TRIGER,
-  // Not capturing. ISR is guaranteed not to update or access the
-  // capture buffer.
+  // Not capturing, after a TRIGGER_MODE_SINGLE capture. ISR is
+  // guaranteed not to update or access the capture buffer.
+  ADC_CAPTURE_STOPPED,
 };
 
 // This data is accessed from interrupt and thus should
@@ -89,6 +217,43 @@ struct IsrData {
 
   // The histogram buffer. Visible to users.
   Histogram histogram;
+  // Bucket i counts the steps with ticks_in_step <=
+  // histogram_max_ticks[i] and > histogram_max_ticks[i + 1]. Entries
+  // past the last bucket are 0 and never match. See
+  // isr_histogram_bucket().
+  uint32_t histogram_max_ticks[kHistogramThresholdsSize];
+  // Sketches of the ticks and peak currents of the steps of each
+  // histogram bucket. See isr_publish_step_quantiles().
+  LogSketch ticks_in_step_sketches[acq_consts::kNumHistogramBuckets];
+  LogSketch peak_current_sketches[acq_consts::kNumHistogramBuckets];
+  // The quantiles of the sketches as of the last update, a bit per
+  // bucket whose sketches changed since, and the tick_count of the next
+  // update.
+  StepQuantilesTable step_quantiles;
+  uint32_t step_quantiles_changed_buckets;
+  uint64_t step_quantiles_publish_tick_count;
+  // Stall detection. See isr_detect_stall().
+  //
+  // Per histogram bucket, the peak current baseline, scaled by
+  // 1 << kStallPeakBaselineShift, and the steps it has seen, up to
+  // kStallWarmupSteps.
+  uint32_t stall_peak_baselines[acq_consts::kNumHistogramBuckets];
+  uint8_t stall_baseline_steps[acq_consts::kNumHistogramBuckets];
+  // The step duration baseline, scaled by 1 << kStallTicksBaselineShift.
+  // Valid only if the previous step was checked too, since a skipped
+  // step, e.g. after a pause, breaks the step timing.
+  uint32_t stall_ticks_baseline;
+  bool stall_ticks_baseline_valid;
+  // Consecutive anomalous and normal steps, and the reasons of the
+  // anomalous ones.
+  uint8_t stall_anomalous_steps;
+  uint8_t stall_normal_steps;
+  uint8_t stall_reasons;
+  // True from a stall suspect until the steps are normal again.
+  bool stall_suspected;
+  // The layout of histogram_max_ticks. See set_histogram_layout().
+  HistogramLayoutSettings histogram_layout;
+  uint16_t histogram_min_speeds[acq_consts::kNumHistogramBuckets];
 
   // Offset settings. See analyzer::Settings.
   int16_t offset1;
@@ -100,17 +265,71 @@ struct IsrData {
   AdcCaptureState adc_capture_state;
   // Time out for waiting for trigger in divided ADC ticks.
   uint32_t adc_capture_pre_trigger_items_left;
+  // Items left to capture in ADC_CAPTURE_PRE_FILL.
+  uint16_t adc_capture_fill_items_left;
+  // Segmented capture. 1 if not segmented.
+  uint8_t adc_capture_num_segments;
+  // Segments of the capture in progress that were completed.
+  uint8_t adc_capture_segments_done;
+  // Items per segment, and the pre trigger items of each, clipped to
+  // the segment.
+  uint16_t adc_capture_segment_items;
+  uint16_t adc_capture_pre_trigger_items;
+  // Where the items are captured. The items of adc_capture_buffer, or
+  // segment_items if segmented.
+  AdcCaptureItems* adc_capture_items;
+  // The trigger settings. See set_capture_trigger().
+  TriggerSettings trigger;
+  // The trigger condition at the previous item. A trigger is a change
+  // of the condition from false to true.
+  bool trigger_condition;
+  // Quadrature errors at the previous item.
+  uint32_t trigger_last_quadrature_errors;
+  // The step duration at the step rate level, in ADC ticks, such that
+  // the trigger doesn't divide. TRIGGER_SOURCE_STEP_RATE only.
+  uint32_t trigger_step_ticks;
+  // Duration of the last step, in ADC ticks.
+  uint32_t last_step_ticks;
   // Factor to divide ADC ticks. Only every n'th sample is captured.
   // Value >= 1.
   uint8_t adc_capture_divider;
   // Up counter for capturing only every n'th samples.
   uint8_t adc_capture_divider_counter;
-  // The ADC capture buffer. Updated by ISR when state != CAPTURE_IDLE
-  // and accessible by the UI (ready only) when state = CAPTURE_IDLE.
-  AdcCaptureBuffer adc_capture_buffer;
-  // Each time we complete a sample in the adc_capture_buffer, we snapshot
-  // it in this buffer, and start from scratch.
-  AdcCaptureBuffer adc_capture_buffer_snapshot;
+  CaptureMode adc_capture_mode;
+  // The min and max of the divider window so far. Envelope mode only.
+  int16_t adc_capture_min_v1;
+  int16_t adc_capture_max_v1;
+  int16_t adc_capture_min_v2;
+  int16_t adc_capture_max_v2;
+
+  // The deep capture. The buffer is replaced only by
+  // arm_deep_capture().
+  DeepCaptureInfo deep_capture;
+  int16_t* deep_capture_values;
+  // Size of deep_capture_values.
+  uint32_t deep_capture_num_values;
+  // True if deep_capture changed since it was last published.
+  bool deep_capture_changed;
+
+  // Waveform stream. Off if waveform_decimation is 0.
+  uint8_t waveform_decimation;
+  uint8_t waveform_decimation_counter;
+  uint16_t waveform_max_block_bytes;
+  // The block being filled, or null if not started.
+  WaveformBlock* waveform_block;
+  // The previous sample of the block.
+  int16_t waveform_last_v1;
+  int16_t waveform_last_v2;
+  // Not reset by reset_data(), such that the consumer can detect
+  // dropped blocks.
+  uint32_t waveform_seq_number;
+  uint32_t waveform_dropped_blocks;
+  // Sequence number of the capture in progress.
+  uint16_t adc_capture_seq_number;
+  // Index in capture_pool of the buffer being filled, and a pointer
+  // to it.
+  uint8_t adc_capture_pool_index;
+  AdcCaptureBuffer* adc_capture_buffer;
 
   // Members for capturing step counter at fixed intervals for notification
   // to the BLE client.
@@ -120,41 +339,339 @@ struct IsrData {
   // Adc tick counter counter/divider. Use to sample the steps
   // count only every kStepsCaptureDivider adc ticks.
   uint16_t steps_capture_divider_counter;
+
+  // True if the histogram changed since it was last published, and the
+  // tick_count of the next publish.
+  bool histogram_changed;
+  uint64_t histogram_publish_tick_count;
+
+  // Sequence number of the next step event. Not reset by reset_data()
+  // such that the consumer can detect dropped events.
+  uint32_t step_event_seq_number;
 };
 
 static IsrData isr_data = {};
 
-void get_last_capture_snapshot(AdcCaptureBuffer* buffer) {
-  ENTER_MUTEX {
-    // We copy the last completed snapsho.
-    *buffer = isr_data.adc_capture_buffer_snapshot;
+// The segment in progress of a segmented capture. Completed segments
+// are appended to the capture buffer.
+static AdcCaptureItems segment_items;
+
+// Lock free copies of the state and histogram. Published by the adc
+// task and sampled by the BLE and main tasks without blocking the
+// acquisition.
+static SeqLock<State> published_state;
+static SeqLock<Histogram> published_histogram;
+static SeqLock<StepQuantilesTable> published_step_quantiles;
+
+// The deep capture info along with its buffer, such that readers get a
+// consistent pair.
+struct PublishedDeepCapture {
+  DeepCaptureInfo info;
+  const int16_t* values;
+};
+static SeqLock<PublishedDeepCapture> published_deep_capture;
+
+// A histogram bucket of a completed slice, its change during the
+// slice. Compact since there are many slices. The ticks and steps fit
+// in 16 bits since the steps of a slice end within a slice and a frame
+// and are at most kMaxHistogramTicksInStep long, and they saturate if
+// the slice is longer, e.g. after the acquisition was stalled.
+struct HistogramSliceBucket {
+  uint16_t ticks_in_steps;
+  uint16_t steps;
+  uint32_t step_peak_currents;
+};
+
+// The histogram slices. Maintained by the adc task after each frame,
+// out of the per sample path, with the data mutex held. The slices are
+// changes of isr_data.histogram, so the acquisition doesn't track them.
+struct HistogramSlices {
+  // Ring of the completed slices. next_slice is the one to overwrite
+  // next, and num_slices the slices completed since the histogram was
+  // cleared, up to kMaxHistogramWindowSlices.
+  HistogramSliceBucket slices[kMaxHistogramWindowSlices]
+                            [acq_consts::kNumHistogramBuckets];
+  uint8_t next_slice;
+  uint8_t num_slices;
+  // The window length. See set_histogram_window().
+  uint8_t window_slices;
+  // The histogram at the start of the slice in progress, and the tick
+  // count of its end.
+  HistogramBucket slice_start[acq_consts::kNumHistogramBuckets];
+  uint64_t slice_end_tick_count;
+  // The running sum of the last window.num_slices slices.
+  HistogramWindow window;
+};
+
+static HistogramSlices histogram_slices;
+static SeqLock<HistogramWindow> published_histogram_window;
+
+// Pool of capture buffers. Buffers are handed between the adc task
+// and the capture reader by exchanging indexes, without copying. Each
+// buffer is owned at any time by exactly one of: the adc task (being
+// filled, isr_data.adc_capture_pool_index), the ready slot (last
+// completed capture, capture_ready_index), or the reader (being
+// transferred, reader_capture_index).
+constexpr uint8_t kNumCaptureBuffers = 3;
+static AdcCaptureBuffer capture_pool[kNumCaptureBuffers];
+
+// Set in capture_ready_index if the ready buffer has a capture that
+// the reader didn't take yet.
+constexpr uint8_t kCaptureFreshFlag = 0x80;
+static std::atomic<uint8_t> capture_ready_index = 1;
+static uint8_t reader_capture_index = 2;
+
+const AdcCaptureBuffer* take_last_capture_snapshot() {
+  if (capture_ready_index.load(std::memory_order_acquire) &
+      kCaptureFreshFlag) {
+    // Swap our buffer with the ready one.
+    const uint8_t ready_index = capture_ready_index.exchange(
+        reader_capture_index, std::memory_order_acq_rel);
+    reader_capture_index = ready_index & ~kCaptureFreshFlag;
+    // Done once per capture, here rather than in the adc task,
+    // such that the items can be serialized as one contiguous range.
+    capture_pool[reader_capture_index].items.linearize();
   }
-  EXIT_MUTEX
+  return &capture_pool[reader_capture_index];
 }
 
-// Should be called from ISR from when interrupts are not enabled.
-void isr_reset_adc_capture_buffer() {
-  isr_data.adc_capture_buffer.items.clear();
-  isr_data.adc_capture_buffer.divider = isr_data.adc_capture_divider;
+// The last items of a completed capture for the spectrum task. Owned
+// by the adc task while not pending and by the spectrum task while
+// pending.
+static SpectrumCapture spectrum_capture;
+static std::atomic<bool> spectrum_capture_pending = false;
+
+const SpectrumCapture* peek_spectrum_capture() {
+  return spectrum_capture_pending.load(std::memory_order_acquire)
+      ? &spectrum_capture
+      : nullptr;
+}
+
+void release_spectrum_capture() {
+  spectrum_capture_pending.store(false, std::memory_order_release);
+}
+
+// Copies the last items of the completed capture, unless the spectrum
+// task didn't release the previous one yet. kSpectrumCaptureItems per
+// capture.
+static void isr_copy_spectrum_capture() {
+  const AdcCaptureBuffer& buffer = *isr_data.adc_capture_buffer;
+  if (buffer.mode != CAPTURE_MODE_DECIMATE || buffer.num_segments != 1 ||
+      buffer.items.size() < kSpectrumCaptureItems ||
+      spectrum_capture_pending.load(std::memory_order_acquire)) {
+    return;
+  }
+  spectrum_capture.seq_number = buffer.seq_number;
+  spectrum_capture.divider = buffer.divider;
+  const uint16_t first = buffer.items.size() - kSpectrumCaptureItems;
+  for (uint16_t i = 0; i < kSpectrumCaptureItems; i++) {
+    const AdcCaptureItem* item = buffer.items.get(first + i);
+    spectrum_capture.v1[i] = item->v1;
+    spectrum_capture.v2[i] = item->v2;
+  }
+  spectrum_capture_pending.store(true, std::memory_order_release);
+}
 
-  isr_data.adc_capture_state = ADC_CAPTURE_HALF_FILL;
+// Starts a new divider window of the envelope mode.
+static inline void isr_reset_adc_capture_envelope() {
+  isr_data.adc_capture_min_v1 = INT16_MAX;
+  isr_data.adc_capture_max_v1 = INT16_MIN;
+  isr_data.adc_capture_min_v2 = INT16_MAX;
+  isr_data.adc_capture_max_v2 = INT16_MIN;
+}
+
+// Starts filling the next segment, or the capture if not segmented.
+static void isr_start_capture_segment() {
+  isr_data.adc_capture_items->clear();
+  isr_data.adc_capture_state = ADC_CAPTURE_PRE_FILL;
   isr_data.adc_capture_pre_trigger_items_left = kAdcCaptureMaxWaitToTrigger;
+  isr_data.adc_capture_fill_items_left = std::max(
+      isr_data.adc_capture_pre_trigger_items, isr_data.trigger.holdoff_items);
   isr_data.adc_capture_divider_counter = 0;
+  isr_reset_adc_capture_envelope();
+}
+
+// Appends the segment that was just completed to the capture buffer.
+// Copies up to kAdcCaptureBufferSize / 2 items, once per segment.
+static void isr_append_capture_segment() {
+  const uint16_t n = isr_data.adc_capture_segment_items;
+  const uint16_t first = segment_items.size() - n;
+  AdcCaptureItems& items = isr_data.adc_capture_buffer->items;
+  for (uint16_t i = 0; i < n; i++) {
+    *items.insert() = *segment_items.get(first + i);
+  }
+}
+
+// Should be called from ISR from when interrupts are not enabled.
+void isr_reset_adc_capture_buffer() {
+  const uint8_t num_segments = isr_data.adc_capture_num_segments;
+  isr_data.adc_capture_segments_done = 0;
+  isr_data.adc_capture_segment_items = kAdcCaptureBufferSize / num_segments;
+  // At least one item after the trigger.
+  isr_data.adc_capture_pre_trigger_items =
+      std::min<uint16_t>(isr_data.trigger.pre_trigger_items,
+          isr_data.adc_capture_segment_items - 1);
+  isr_data.adc_capture_items = num_segments > 1
+      ? &segment_items
+      : &isr_data.adc_capture_buffer->items;
+
+  AdcCaptureBuffer* buffer = isr_data.adc_capture_buffer;
+  buffer->items.clear();
+  buffer->seq_number = isr_data.adc_capture_seq_number;
+  buffer->divider = isr_data.adc_capture_divider;
+  buffer->mode = isr_data.adc_capture_mode;
+  buffer->num_segments = num_segments;
+  buffer->segment_items = isr_data.adc_capture_segment_items;
+  buffer->pre_trigger_items = isr_data.adc_capture_pre_trigger_items;
+
+  isr_start_capture_segment();
 }
 
 // Should be called from ISR from when interrupts are not enabled.
 void isr_restart_adc_capture_cycle() {
-  // Snapshot the last sample, if any.
-  isr_data.adc_capture_buffer_snapshot = isr_data.adc_capture_buffer;
+  isr_copy_spectrum_capture();
+
+  // Hand the completed capture to the ready slot and continue with
+  // the buffer it held.
+  const uint8_t old_ready_index = capture_ready_index.exchange(
+      isr_data.adc_capture_pool_index | kCaptureFreshFlag,
+      std::memory_order_acq_rel);
+  isr_data.adc_capture_pool_index = old_ready_index & ~kCaptureFreshFlag;
+  isr_data.adc_capture_buffer = &capture_pool[isr_data.adc_capture_pool_index];
 
   // Initialize the new capture buffer.
-  isr_data.adc_capture_buffer.seq_number++;
+  isr_data.adc_capture_seq_number++;
   isr_reset_adc_capture_buffer();
 }
 
 void sample_histogram(Histogram* histogram) {
-  ENTER_MUTEX { *histogram = isr_data.histogram; }
+  published_histogram.read(histogram);
+}
+
+void sample_histogram_window(HistogramWindow* window) {
+  published_histogram_window.read(window);
+}
+
+// Returns the completed slice of the given age, 0 for the last one.
+static const HistogramSliceBucket* histogram_slice(int age) {
+  const int i = (histogram_slices.next_slice - 1 - age +
+                    kMaxHistogramWindowSlices) %
+      kMaxHistogramWindowSlices;
+  return histogram_slices.slices[i];
+}
+
+// Adds or subtracts a slice from the window sum.
+static void add_histogram_slice_to_window(
+    const HistogramSliceBucket* slice, bool subtract) {
+  for (int i = 0; i < acq_consts::kNumHistogramBuckets; i++) {
+    HistogramBucket& bucket = histogram_slices.window.buckets[i];
+    if (subtract) {
+      bucket.total_ticks_in_steps -= slice[i].ticks_in_steps;
+      bucket.total_step_peak_currents -= slice[i].step_peak_currents;
+      bucket.total_steps -= slice[i].steps;
+    } else {
+      bucket.total_ticks_in_steps += slice[i].ticks_in_steps;
+      bucket.total_step_peak_currents += slice[i].step_peak_currents;
+      bucket.total_steps += slice[i].steps;
+    }
+  }
+}
+
+// Sums the window from the completed slices. Should be called with the
+// data mutex held.
+static void rebuild_histogram_window() {
+  HistogramWindow& window = histogram_slices.window;
+  window = HistogramWindow();
+  window.num_slices =
+      std::min(histogram_slices.num_slices, histogram_slices.window_slices);
+  for (int age = 0; age < window.num_slices; age++) {
+    add_histogram_slice_to_window(histogram_slice(age), false);
+  }
+  published_histogram_window.write(window);
+}
+
+// Drops the slices, when the histogram is cleared. Should be called
+// with the data mutex held.
+static void clear_histogram_slices() {
+  histogram_slices.next_slice = 0;
+  histogram_slices.num_slices = 0;
+  memset(histogram_slices.slice_start, 0,
+      sizeof(histogram_slices.slice_start));
+  histogram_slices.slice_end_tick_count =
+      isr_data.state.tick_count + kHistogramSliceTicks;
+  rebuild_histogram_window();
+}
+
+// Completes the slice in progress and updates the window by adding it
+// and subtracting the one that expired, in O(buckets).
+static void isr_complete_histogram_slice() {
+  HistogramSlices& slices = histogram_slices;
+  HistogramWindow& window = slices.window;
+  if (window.num_slices == slices.window_slices) {
+    // The slice that expires. Before adding the new slice, since with a
+    // window of the entire ring they are in the same place.
+    add_histogram_slice_to_window(
+        histogram_slice(window.num_slices - 1), true);
+  } else {
+    window.num_slices++;
+  }
+
+  HistogramSliceBucket* const slice = slices.slices[slices.next_slice];
+  for (int i = 0; i < acq_consts::kNumHistogramBuckets; i++) {
+    const HistogramBucket& bucket = isr_data.histogram.buckets[i];
+    HistogramBucket& start = slices.slice_start[i];
+    slice[i].ticks_in_steps = std::min<uint64_t>(
+        bucket.total_ticks_in_steps - start.total_ticks_in_steps, UINT16_MAX);
+    slice[i].steps = std::min<uint32_t>(
+        bucket.total_steps - start.total_steps, UINT16_MAX);
+    slice[i].step_peak_currents = std::min<uint64_t>(
+        bucket.total_step_peak_currents - start.total_step_peak_currents,
+        UINT32_MAX);
+    start = bucket;
+  }
+  slices.next_slice = (slices.next_slice + 1) % kMaxHistogramWindowSlices;
+  if (slices.num_slices < kMaxHistogramWindowSlices) {
+    slices.num_slices++;
+  }
+  add_histogram_slice_to_window(slice, false);
+  published_histogram_window.write(window);
+}
+
+// Clears the histogram and everything that is derived from it. Should
+// be called with the data mutex held.
+static void clear_histogram() {
+  isr_data.histogram.clear();
+  isr_data.histogram_changed = true;
+  for (int i = 0; i < acq_consts::kNumHistogramBuckets; i++) {
+    isr_data.ticks_in_step_sketches[i].clear();
+    isr_data.peak_current_sketches[i].clear();
+  }
+  isr_data.step_quantiles_changed_buckets =
+      (1u << acq_consts::kNumHistogramBuckets) - 1;
+  // The stall baselines are per histogram bucket.
+  memset(isr_data.stall_baseline_steps, 0,
+      sizeof(isr_data.stall_baseline_steps));
+  isr_data.stall_ticks_baseline_valid = false;
+  clear_histogram_slices();
+}
+
+void sample_step_quantiles(StepQuantilesTable* table) {
+  published_step_quantiles.read(table);
+}
+
+bool set_histogram_window(uint8_t num_slices) {
+  if (num_slices < 1 || num_slices > kMaxHistogramWindowSlices) {
+    return false;
+  }
+
+  ENTER_MUTEX {
+    histogram_slices.window_slices = num_slices;
+    rebuild_histogram_window();
+  }
   EXIT_MUTEX
+
+  ESP_LOGI(TAG, "Histogram window set to %hhu slices", num_slices);
+  return true;
 }
 
 static StepsCaptureBuffer steps_capture_sample_buffer;
@@ -172,24 +689,117 @@ const StepsCaptureBuffer* sample_steps_capture() {
   return &steps_capture_sample_buffer;
 }
 
-void sample_state(State* state) {
-  ENTER_MUTEX { *state = isr_data.state; }
+void sample_state(State* state) { published_state.read(state); }
+
+void dump_stats() {
+  ESP_LOGI(TAG,
+      "Sampling reads/retries: state %lu/%lu, histogram %lu/%lu. "
+      "Dropped states: %lu, step events: %lu",
+      published_state.reads(), published_state.retries(),
+      published_histogram.reads(), published_histogram.retries(),
+      dropped_states, dropped_step_events);
+}
+
+bool pop_step_event(StepEvent* event) {
+  // Lock free. We are the single consumer.
+  return step_event_ring.pop(event);
+}
+
+bool pop_stall_event(StallEvent* event) {
+  // Lock free. We are the single consumer.
+  return stall_event_ring.pop(event);
+}
+
+const WaveformBlock* peek_waveform_block() {
+  // Lock free. We are the single consumer.
+  return waveform_ring.consumer_slot();
+}
+
+void release_waveform_block() { waveform_ring.consumer_release(); }
+
+// Completes the waveform block in progress, if any.
+static void isr_end_waveform_block() {
+  WaveformBlock* block = isr_data.waveform_block;
+  if (!block) {
+    return;
+  }
+  isr_data.waveform_block = nullptr;
+  if (block == &waveform_dropped_block) {
+    isr_data.waveform_dropped_blocks++;
+    return;
+  }
+  block->dropped_blocks = isr_data.waveform_dropped_blocks;
+  waveform_ring.producer_commit();
+}
+
+// Adds a sample to the waveform stream. Not inlined since it's called
+// once per decimation.
+static void isr_add_waveform_sample(
+    uint64_t tick_count, int16_t v1, int16_t v2) {
+  WaveformBlock* block = isr_data.waveform_block;
+  // The samples of a block should be uniformly spaced, so a block is
+  // ended on a gap, e.g. due to bad or lost pairs.
+  if (block &&
+      tick_count !=
+          block->tick_count +
+              (uint64_t)block->num_samples * isr_data.waveform_decimation) {
+    isr_end_waveform_block();
+    block = nullptr;
+  }
+  if (!block) {
+    block = waveform_ring.producer_slot();
+    if (!block) {
+      block = &waveform_dropped_block;
+    }
+    block->tick_count = tick_count;
+    block->seq_number = isr_data.waveform_seq_number++;
+    block->decimation = isr_data.waveform_decimation;
+    block->num_samples = 0;
+    block->num_bytes = 0;
+    isr_data.waveform_block = block;
+    isr_data.waveform_last_v1 = 0;
+    isr_data.waveform_last_v2 = 0;
+  }
+
+  uint8_t* p = &block->bytes[block->num_bytes];
+  p = zigzag_varint::append(p, v1 - isr_data.waveform_last_v1);
+  p = zigzag_varint::append(p, v2 - isr_data.waveform_last_v2);
+  isr_data.waveform_last_v1 = v1;
+  isr_data.waveform_last_v2 = v2;
+  block->num_bytes = p - block->bytes;
+  block->num_samples++;
+
+  // End the block if the next sample may not fit, or on timeout.
+  if (block->num_bytes + 2 * zigzag_varint::kMaxInt16Bytes >
+          isr_data.waveform_max_block_bytes ||
+      tick_count - block->tick_count >= kWaveformBlockMaxTicks) {
+    isr_end_waveform_block();
+  }
+}
+
+void set_waveform_stream(uint8_t decimation, uint16_t max_block_bytes) {
+  max_block_bytes = std::min(max_block_bytes, kWaveformBlockMaxBytes);
+  // Room for at least one sample.
+  if (max_block_bytes < 2 * zigzag_varint::kMaxInt16Bytes) {
+    decimation = 0;
+  }
+  ENTER_MUTEX {
+    isr_end_waveform_block();
+    isr_data.waveform_decimation = decimation;
+    isr_data.waveform_decimation_counter = 0;
+    isr_data.waveform_max_block_bytes = max_block_bytes;
+  }
   EXIT_MUTEX
+
+  ESP_LOGI(TAG, "Waveform stream decimation set to %hhu (%hu bytes blocks)",
+      decimation, max_block_bytes);
 }
 
 // Blocks until next state is available. (50Hz)
 bool pop_next_state(State* state) {
   for (;;) {
-    const State* popped_state;
-    ENTER_MUTEX {
-      // Null if buffer is empty.
-      popped_state = state_circular_buffer.pop();
-      if (popped_state) {
-        *state = *popped_state;
-      }
-    }
-    EXIT_MUTEX
-    if (popped_state) {
+    // Lock free. We are the single consumer.
+    if (state_circular_buffer.pop(state)) {
       // TODO: take semaphore if taken.
       return true;
     }
@@ -205,12 +815,15 @@ void reset_data() {
     // the captured signals.
 
     isr_data.state.ticks_with_errors = 0;
+    isr_data.state.lost_pairs = 0;
     isr_data.state.non_energized_count = 0;
     isr_data.state.full_steps = 0;
     isr_data.state.max_full_steps = 0;
     isr_data.state.max_retraction_steps = 0;
     isr_data.state.quadrature_errors = 0;
-    memset(isr_data.histogram.buckets, 0, sizeof(isr_data.histogram.buckets));
+    isr_data.state.stall_suspects = 0;
+    isr_data.state.last_stall_suspect_tick_count = 0;
+    clear_histogram();
   }
   EXIT_MUTEX
 }
@@ -250,6 +863,185 @@ bool get_is_reversed_direction() {
   return result;
 }
 
+// Restarts an armed or filling deep capture with the current capture
+// divider and mode.
+static void isr_rearm_deep_capture() {
+  DeepCaptureInfo& deep = isr_data.deep_capture;
+  if (deep.state != DEEP_CAPTURE_ARMED && deep.state != DEEP_CAPTURE_FILLING) {
+    return;
+  }
+  deep.state = DEEP_CAPTURE_ARMED;
+  deep.divider = isr_data.adc_capture_divider;
+  deep.mode = isr_data.adc_capture_mode;
+  deep.capacity = isr_data.deep_capture_num_values /
+      deep_capture_values_per_item(deep.mode);
+  deep.size = 0;
+  deep.trigger_tick_count = 0;
+  isr_data.deep_capture_changed = true;
+}
+
+// Publishes the deep capture for sample_deep_capture(). Called with
+// the mutex held, which serializes the writers of the SeqLock.
+static void isr_publish_deep_capture() {
+  isr_data.deep_capture_changed = false;
+  published_deep_capture.write(
+      {isr_data.deep_capture, isr_data.deep_capture_values});
+}
+
+// Adds an item to the filling deep capture.
+static inline void isr_add_deep_capture_item(const AdcCaptureItem& item) {
+  DeepCaptureInfo& deep = isr_data.deep_capture;
+  const bool is_envelope = deep.mode == CAPTURE_MODE_ENVELOPE;
+  int16_t* values = &isr_data.deep_capture_values[is_envelope
+          ? 4 * deep.size
+          : 2 * deep.size];
+  values[0] = item.v1;
+  values[1] = item.v2;
+  if (is_envelope) {
+    values[2] = item.min_v1;
+    values[3] = item.min_v2;
+  }
+  if (++deep.size >= deep.capacity) {
+    deep.state = DEEP_CAPTURE_DONE;
+  }
+  isr_data.deep_capture_changed = true;
+}
+
+// Starts looking for a trigger. The condition starts as true such that
+// a trigger requires to see it false first, e.g. the signal below the
+// level before crossing it up.
+static inline void isr_arm_trigger(const State& isr_state) {
+  isr_data.trigger_condition = true;
+  isr_data.trigger_last_quadrature_errors = isr_state.quadrature_errors;
+}
+
+// The trigger condition at the captured item. isr_state is as of the
+// previous sample. O(1), without divisions.
+static inline bool isr_trigger_condition(
+    const AdcCaptureItem& item, const State& isr_state) {
+  const TriggerSettings& trigger = isr_data.trigger;
+  switch (trigger.source) {
+    case TRIGGER_SOURCE_LEVEL: {
+      // The middle of the min and max, which in decimate mode is the
+      // sample itself. A falling edge is a rising edge of the negated
+      // signal.
+      int value = trigger.channel ? (item.v2 + item.min_v2) / 2
+                                  : (item.v1 + item.min_v1) / 2;
+      int level = trigger.level;
+      if (trigger.is_falling_edge) {
+        value = -value;
+        level = -level;
+      }
+      if (value >= level) {
+        return true;
+      }
+      if (value < level - trigger.hysteresis) {
+        return false;
+      }
+      return isr_data.trigger_condition;
+    }
+
+    case TRIGGER_SOURCE_QUADRATURE_ERROR: {
+      const bool has_new_errors = isr_state.quadrature_errors !=
+          isr_data.trigger_last_quadrature_errors;
+      isr_data.trigger_last_quadrature_errors = isr_state.quadrature_errors;
+      return has_new_errors;
+    }
+
+    case TRIGGER_SOURCE_ENERGIZED:
+      return isr_state.is_energized != trigger.is_falling_edge;
+
+    case TRIGGER_SOURCE_STEP_RATE: {
+      // Faster than the level if the last step and the step so far are
+      // both shorter than the level's step.
+      const bool is_faster = isr_state.is_energized &&
+          isr_state.last_step_direction != UNKNOWN_DIRECTION &&
+          isr_data.last_step_ticks <= isr_data.trigger_step_ticks &&
+          isr_state.ticks_in_step <= isr_data.trigger_step_ticks;
+      return is_faster != trigger.is_falling_edge;
+    }
+  }
+  return false;
+}
+
+// Called on a signal capture trigger, forced or not, with the trigger
+// item.
+static inline void isr_on_capture_trigger(
+    const AdcCaptureItem& item, uint64_t tick_count) {
+  isr_data.adc_capture_buffer
+      ->trigger_tick_counts[isr_data.adc_capture_segments_done] = tick_count;
+  if (isr_data.deep_capture.state == DEEP_CAPTURE_ARMED) {
+    isr_data.deep_capture.state = DEEP_CAPTURE_FILLING;
+    isr_data.deep_capture.trigger_tick_count = tick_count;
+    isr_add_deep_capture_item(item);
+  }
+}
+
+uint32_t arm_deep_capture(uint32_t num_items) {
+  int16_t* old_values;
+  CaptureMode mode;
+  ENTER_MUTEX {
+    old_values = isr_data.deep_capture_values;
+    isr_data.deep_capture_values = nullptr;
+    isr_data.deep_capture_num_values = 0;
+    isr_data.deep_capture.state = DEEP_CAPTURE_IDLE;
+    isr_data.deep_capture.capacity = 0;
+    isr_data.deep_capture.size = 0;
+    mode = isr_data.adc_capture_mode;
+    // Readers stop using the old buffer before it's freed.
+    isr_publish_deep_capture();
+  }
+  EXIT_MUTEX
+  heap_caps_free(old_values);
+
+  if (!num_items) {
+    return 0;
+  }
+
+  // Sized for the current mode. If the mode changes before the capture
+  // is filled, the capacity is adjusted.
+  const size_t largest_block =
+      heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  const size_t max_bytes = largest_block > kDeepCaptureHeapReserve
+      ? largest_block - kDeepCaptureHeapReserve
+      : 0;
+  const uint8_t values_per_item = deep_capture_values_per_item(mode);
+  const uint32_t max_items = max_bytes / (values_per_item * sizeof(int16_t));
+  const uint32_t num_values = std::min(num_items, max_items) * values_per_item;
+  int16_t* const values = num_values
+      ? (int16_t*)heap_caps_malloc(
+            num_values * sizeof(int16_t), MALLOC_CAP_8BIT)
+      : nullptr;
+  if (!values) {
+    ESP_LOGE(TAG, "No heap for a deep capture of %lu items (max %lu)",
+        num_items, max_items);
+    return 0;
+  }
+
+  uint32_t capacity;
+  ENTER_MUTEX {
+    isr_data.deep_capture_values = values;
+    isr_data.deep_capture_num_values = num_values;
+    isr_data.deep_capture.seq_number++;
+    isr_data.deep_capture.state = DEEP_CAPTURE_ARMED;
+    isr_rearm_deep_capture();
+    isr_publish_deep_capture();
+    capacity = isr_data.deep_capture.capacity;
+  }
+  EXIT_MUTEX
+
+  ESP_LOGI(TAG, "Deep capture armed with %lu items (requested %lu)",
+      capacity, num_items);
+  return capacity;
+}
+
+const int16_t* sample_deep_capture(DeepCaptureInfo* info) {
+  PublishedDeepCapture deep;
+  published_deep_capture.read(&deep);
+  *info = deep.info;
+  return deep.values;
+}
+
 void set_signal_capture_divider(uint8_t divider) {
   // Clip to a reaonsable range.
   if (divider < 1) {
@@ -265,12 +1057,178 @@ void set_signal_capture_divider(uint8_t divider) {
     // Restart the capture buffer so we don't mix data points
     // from diferent dividers.
     isr_reset_adc_capture_buffer();
+    isr_rearm_deep_capture();
   }
   EXIT_MUTEX
 
   ESP_LOGI(TAG, "Signal capture divider set to %hu", divider);
 }
 
+bool set_capture_segments(uint8_t num_segments) {
+  if (num_segments < 1 || num_segments > kMaxCaptureSegments) {
+    return false;
+  }
+
+  ENTER_MUTEX {
+    isr_data.adc_capture_num_segments = num_segments;
+    isr_reset_adc_capture_buffer();
+  }
+  EXIT_MUTEX
+
+  ESP_LOGI(TAG, "Capture segments set to %hhu", num_segments);
+  return true;
+}
+
+bool set_capture_trigger(const TriggerSettings& settings) {
+  if (settings.source > TRIGGER_SOURCE_STEP_RATE ||
+      settings.mode > TRIGGER_MODE_SINGLE || settings.channel > 1 ||
+      settings.pre_trigger_items < 1 ||
+      settings.pre_trigger_items >= kAdcCaptureBufferSize ||
+      (settings.source == TRIGGER_SOURCE_STEP_RATE && settings.level <= 0)) {
+    return false;
+  }
+  const uint32_t step_ticks = settings.source == TRIGGER_SOURCE_STEP_RATE
+      ? acq_consts::kTimeTicksPerSec / settings.level
+      : 0;
+
+  ENTER_MUTEX {
+    isr_data.trigger = settings;
+    isr_data.trigger_step_ticks = step_ticks;
+    // Restart the capture with the new trigger. Also rearms a single
+    // shot trigger.
+    isr_reset_adc_capture_buffer();
+  }
+  EXIT_MUTEX
+
+  ESP_LOGI(TAG,
+      "Capture trigger set: source %hhu, mode %hhu, channel %hhu, "
+      "falling %d, level %hd, hysteresis %hu, pre trigger %hu, holdoff %hu",
+      settings.source, settings.mode, settings.channel,
+      settings.is_falling_edge, settings.level, settings.hysteresis,
+      settings.pre_trigger_items, settings.holdoff_items);
+  return true;
+}
+
+void get_capture_trigger(TriggerSettings* settings) {
+  ENTER_MUTEX { *settings = isr_data.trigger; }
+  EXIT_MUTEX
+}
+
+// Computes the min speed of each bucket of a histogram layout. Returns
+// false if the speeds are not increasing or don't fit in 16 bits, or,
+// except for the linear layout, if two buckets have the same
+// kTimeTicksPerSec / min_speed, since no step could fill the lower one.
+// The linear layout keeps the fixed width buckets of the classic
+// histogram, whose fastest buckets may be empty for that reason.
+static bool compute_histogram_min_speeds(
+    const HistogramLayoutSettings& settings,
+    uint16_t min_speeds[acq_consts::kNumHistogramBuckets]) {
+  constexpr int n = acq_consts::kNumHistogramBuckets;
+  const uint32_t p1 = settings.param1;
+  const uint32_t p2 = settings.param2;
+  uint32_t speeds[n];
+  speeds[0] = 0;
+  switch (settings.layout) {
+    case HISTOGRAM_LAYOUT_LINEAR:
+      for (int i = 1; i < n; i++) {
+        speeds[i] = i * p1;
+      }
+      break;
+    case HISTOGRAM_LAYOUT_LOG: {
+      if (p1 == 0 || p2 <= p1) {
+        return false;
+      }
+      // From param1 at bucket 1 to param2 at the last bucket.
+      const float ratio = (float)p2 / p1;
+      for (int i = 1; i < n - 1; i++) {
+        speeds[i] = lroundf(p1 * powf(ratio, (float)(i - 1) / (n - 2)));
+      }
+      speeds[n - 1] = p2;
+      break;
+    }
+    case HISTOGRAM_LAYOUT_SPARSE:
+      for (int i = 1; i < n; i++) {
+        speeds[i] = p1 + (i - 1) * p2;
+      }
+      break;
+    default:
+      return false;
+  }
+  for (int i = 1; i < n; i++) {
+    if (speeds[i] <= speeds[i - 1] || speeds[i] > UINT16_MAX) {
+      return false;
+    }
+    if (settings.layout != HISTOGRAM_LAYOUT_LINEAR && i > 1 &&
+        acq_consts::kTimeTicksPerSec / speeds[i] ==
+            acq_consts::kTimeTicksPerSec / speeds[i - 1]) {
+      return false;
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    min_speeds[i] = speeds[i];
+  }
+  return true;
+}
+
+bool set_histogram_layout(const HistogramLayoutSettings& settings) {
+  uint16_t min_speeds[acq_consts::kNumHistogramBuckets];
+  if (!compute_histogram_min_speeds(settings, min_speeds)) {
+    return false;
+  }
+  // A step is in bucket i if its speed kTimeTicksPerSec / ticks_in_step,
+  // rounded down, is >= min_speeds[i], that is, if ticks_in_step <=
+  // kTimeTicksPerSec / min_speeds[i], rounded down. This matches the
+  // buckets of the integer division exactly.
+  uint32_t max_ticks[kHistogramThresholdsSize] = {};
+  max_ticks[0] = UINT32_MAX;
+  for (int i = 1; i < acq_consts::kNumHistogramBuckets; i++) {
+    max_ticks[i] = acq_consts::kTimeTicksPerSec / min_speeds[i];
+  }
+
+  ENTER_MUTEX {
+    isr_data.histogram_layout = settings;
+    memcpy(isr_data.histogram_min_speeds, min_speeds, sizeof(min_speeds));
+    memcpy(isr_data.histogram_max_ticks, max_ticks, sizeof(max_ticks));
+    // The buckets of the previous layout are meaningless now.
+    clear_histogram();
+  }
+  EXIT_MUTEX
+
+  ESP_LOGI(TAG, "Histogram layout set: layout %hhu, params %hu, %hu",
+      settings.layout, settings.param1, settings.param2);
+  return true;
+}
+
+void get_histogram_layout(HistogramLayoutSettings* settings,
+    uint16_t min_speeds[acq_consts::kNumHistogramBuckets]) {
+  ENTER_MUTEX {
+    *settings = isr_data.histogram_layout;
+    if (min_speeds) {
+      memcpy(min_speeds, isr_data.histogram_min_speeds,
+          sizeof(isr_data.histogram_min_speeds));
+    }
+  }
+  EXIT_MUTEX
+}
+
+bool set_signal_capture_mode(uint8_t mode) {
+  if (mode != CAPTURE_MODE_DECIMATE && mode != CAPTURE_MODE_ENVELOPE) {
+    return false;
+  }
+
+  ENTER_MUTEX {
+    isr_data.adc_capture_mode = (CaptureMode)mode;
+    // Restart the capture buffer so we don't mix items of different
+    // modes.
+    isr_reset_adc_capture_buffer();
+    isr_rearm_deep_capture();
+  }
+  EXIT_MUTEX
+
+  ESP_LOGI(TAG, "Signal capture mode set to %hhu", mode);
+  return true;
+}
+
 void get_settings(nvs_config::AcquistionSettings* settings) {
   // A weak check that new fields where not added to settings.
   static_assert(sizeof(sizeof(*settings) == 6)); 
@@ -284,57 +1242,164 @@ void get_settings(nvs_config::AcquistionSettings* settings) {
 
 void dump_state(const State& state) {
   ESP_LOGI(TAG,
-      "[%6llu][er:%lu, %lu] [%5d, %5d] [en:%d %lu] s:%hhu/%d  steps:%d "
-      "max_steps:%d",
+      "[%6llu][er:%lu, %lu, %lu] [%5d, %5d] [en:%d %lu] s:%hhu/%d  steps:%d "
+      "%+4d/256 max_steps:%d",
       state.tick_count, state.quadrature_errors, state.ticks_with_errors,
+      state.lost_pairs,
       state.v1, state.v2, state.is_energized, state.non_energized_count,
       state.quadrant, state.last_step_direction, state.full_steps,
-      state.max_full_steps);
+      state.step_fraction, state.max_full_steps);
 }
 
 // Assumes that ADC capture data is ready.
 void dump_adc_capture_buffer(const AdcCaptureBuffer& buffer) {
   printf("\nCapture buffer:\n");
-  printf(" seq: %hu, div=%hus\n", buffer.seq_number, buffer.divider);
+  printf(" seq: %hu, div=%hus, mode=%hhu\n", buffer.seq_number,
+      buffer.divider, buffer.mode);
   for (int i = 0; i < buffer.items.size(); i++) {
     const analyzer::AdcCaptureItem* item = buffer.items.get(i);
-    printf("%hd,%hd\n", item->v1, item->v2);
+    if (buffer.mode == CAPTURE_MODE_ENVELOPE) {
+      printf("%hd..%hd,%hd..%hd\n", item->min_v1, item->v1, item->min_v2,
+          item->v2);
+    } else {
+      printf("%hd,%hd\n", item->v1, item->v2);
+    }
   }
   printf("\n");
 }
 
-// Maybe add step's information to the histogram.
-// Called from isr on step transition.
-static inline void isr_add_step_to_histogram(uint8_t quadrant,
+// Returns the histogram bucket of a step. The thresholds decrease with
+// the bucket index, so this is a binary search for the last threshold
+// that is >= ticks_in_step, which avoids dividing per step.
+// histogram_max_ticks[0] matches any step so the search starts there.
+static inline int isr_histogram_bucket(uint32_t ticks_in_step) {
+  const uint32_t* const max_ticks = isr_data.histogram_max_ticks;
+  int i = 0;
+  for (int step = kHistogramThresholdsSize / 2; step > 0; step /= 2) {
+    if (ticks_in_step <= max_ticks[i + step]) {
+      i += step;
+    }
+  }
+  return i;
+}
+
+// Checks a step for signs of a stall, and raises a stall suspect after
+// kStallSuspectSteps anomalous steps. Called for the steps that are
+// added to the histogram, with their bucket. A few compares and shifts
+// per step.
+static inline void isr_detect_stall(State& isr_state, int bucket_index,
+    uint32_t ticks_in_step, uint32_t max_current_in_step) {
+  uint8_t reasons = 0;
+
+  // Peak current, compared with steps of the same speed.
+  uint32_t& peak_baseline = isr_data.stall_peak_baselines[bucket_index];
+  uint8_t& baseline_steps = isr_data.stall_baseline_steps[bucket_index];
+  const uint32_t baseline_peak_current =
+      peak_baseline >> kStallPeakBaselineShift;
+  if (baseline_steps < kStallWarmupSteps) {
+    if (!baseline_steps) {
+      peak_baseline = max_current_in_step << kStallPeakBaselineShift;
+    }
+    baseline_steps++;
+  } else if (baseline_peak_current >= kStallMinPeakCurrent &&
+      max_current_in_step * kStallPeakCurrentExcessDen >
+          baseline_peak_current * kStallPeakCurrentExcessNum) {
+    reasons |= STALL_REASON_PEAK_CURRENT;
+  }
+  peak_baseline +=
+      max_current_in_step - (peak_baseline >> kStallPeakBaselineShift);
+
+  // Step duration, compared with the previous steps.
+  uint32_t& ticks_baseline = isr_data.stall_ticks_baseline;
+  const uint32_t baseline_ticks = ticks_baseline >> kStallTicksBaselineShift;
+  if (!isr_data.stall_ticks_baseline_valid) {
+    ticks_baseline = ticks_in_step << kStallTicksBaselineShift;
+    isr_data.stall_ticks_baseline_valid = true;
+  } else {
+    if (ticks_in_step * 2 < baseline_ticks ||
+        ticks_in_step > baseline_ticks * 2) {
+      reasons |= STALL_REASON_STEP_INTERVAL;
+    }
+    ticks_baseline +=
+        ticks_in_step - (ticks_baseline >> kStallTicksBaselineShift);
+  }
+
+  if (!reasons) {
+    isr_data.stall_anomalous_steps = 0;
+    isr_data.stall_reasons = 0;
+    if (isr_data.stall_normal_steps < kStallClearSteps) {
+      isr_data.stall_normal_steps++;
+    } else {
+      isr_data.stall_suspected = false;
+    }
+    return;
+  }
+  isr_data.stall_normal_steps = 0;
+  isr_data.stall_reasons |= reasons;
+  if (isr_data.stall_suspected ||
+      ++isr_data.stall_anomalous_steps < kStallSuspectSteps) {
+    return;
+  }
+
+  isr_data.stall_suspected = true;
+  isr_state.stall_suspects++;
+  isr_state.last_stall_suspect_tick_count = isr_state.tick_count;
+  // If the consumer is behind and the ring is full, the event is
+  // dropped. Its sequence number is skipped.
+  StallEvent* event = stall_event_ring.producer_slot();
+  if (!event) {
+    return;
+  }
+  event->tick_count = isr_state.tick_count;
+  event->seq_number = isr_state.stall_suspects;
+  event->reasons = isr_data.stall_reasons;
+  event->peak_current = std::min<uint32_t>(max_current_in_step, UINT16_MAX);
+  event->baseline_peak_current = baseline_peak_current;
+  event->ticks_in_step = ticks_in_step;
+  event->baseline_ticks_in_step = baseline_ticks;
+  stall_event_ring.producer_commit();
+}
+
+// Maybe add step's information to the histogram, and check it for a
+// stall. Called from isr on step transition.
+static inline void isr_add_step_to_histogram(State& isr_state,
     Direction entry_direction, Direction exit_direction, uint32_t ticks_in_step,
     uint32_t max_current_in_step) {
   // Ignoring this step if not entering and exiting this step in same forward or
   // backward direction.
   if (entry_direction != exit_direction ||
       entry_direction == UNKNOWN_DIRECTION) {
+    isr_data.stall_ticks_baseline_valid = false;
     return;
   }
-  uint32_t steps_per_sec = acq_consts::kTimeTicksPerSec /
-      ticks_in_step;  // speed in steps per second
-  if (steps_per_sec < 10) {
+  if (ticks_in_step > kMaxHistogramTicksInStep) {
+    isr_data.stall_ticks_baseline_valid = false;
     return;  // ignore very slow steps as they dominate the time.
   }
-  uint32_t bucket_index = steps_per_sec / acq_consts::kBucketStepsPerSecond;
-  if (bucket_index >= acq_consts::kNumHistogramBuckets) {
-    bucket_index = acq_consts::kNumHistogramBuckets - 1;
-  }
+  const int bucket_index = isr_histogram_bucket(ticks_in_step);
   HistogramBucket& bucket = isr_data.histogram.buckets[bucket_index];
   bucket.total_ticks_in_steps += ticks_in_step;
   bucket.total_step_peak_currents += max_current_in_step;
   bucket.total_steps++;
+  const uint32_t bin = std::min<uint32_t>(
+      max_current_in_step >> acq_consts::kPeakCurrentBinShift,
+      acq_consts::kNumPeakCurrentBins - 1);
+  uint16_t& cell = isr_data.histogram.peak_current_steps[bucket_index][bin];
+  if (cell < UINT16_MAX) {
+    cell++;
+  }
+  isr_data.ticks_in_step_sketches[bucket_index].add(ticks_in_step);
+  isr_data.peak_current_sketches[bucket_index].add(max_current_in_step);
+  isr_data.step_quantiles_changed_buckets |= 1u << bucket_index;
+  isr_detect_stall(isr_state, bucket_index, ticks_in_step, max_current_in_step);
+  isr_data.histogram_changed = true;
 }
 
 // A helper for the isr function.
-static inline void isr_update_full_steps_counter(int increment) {
-  State& isr_state = isr_data.state;  // alias
-
+static inline void isr_update_full_steps_counter(
+    State& isr_state, int increment) {
   // Update step counter based on direction setting.
-  if (isr_data.state.is_reverse_direction) {
+  if (isr_state.is_reverse_direction) {
     isr_state.full_steps -= increment;
   } else {
     isr_state.full_steps += increment;
@@ -350,49 +1415,192 @@ static inline void isr_update_full_steps_counter(int increment) {
   }
 }
 
-// NOTE: these four filters slow the interrupt handling. Consider
-// to eliminate if free CPU time is insufficient.
+// NOTE: these filters slow the interrupt handling. If free CPU time
+// is insufficient, select a cheaper one with ANALYZER_FILTER.
 //
 // We use these filters to reduce internal and external noise.
-static filters::Adc12BitsLowPassFilter<kFilterFactor> signal1_filter;
-static filters::Adc12BitsLowPassFilter<kFilterFactor> signal2_filter;
+static filters::DualChannelFilter<SignalFilter> signal_filter;
+
+// Quadrant decoding table. Indexed by the old quadrant and the
+// signs and relative magnitudes of the new v1, v2. See
+// isr_decode_quadrant().
+namespace quadrant_table {
+
+// Transition classes, relative to the old quadrant.
+enum Transition : uint8_t { SAME = 0, NEXT = 1, PREVIOUS = 2, INVALID = 3 };
+
+// Entry bit fields.
+constexpr uint8_t kQuadrantMask = 0x03;
+// Set if |v2| is the max coil current, clear if |v1| is.
+constexpr uint8_t kMaxIsV2Bit = 0x04;
+constexpr uint8_t kTransitionShift = 3;
+
+// Index bit fields.
+constexpr uint8_t kAbsV1GreaterBit = 0x01;  // |v1| > |v2|
+constexpr uint8_t kV1NegativeBit = 0x02;
+constexpr uint8_t kV2NegativeBit = 0x04;
+constexpr uint8_t kOldQuadrantShift = 3;
+
+constexpr Transition transition_of(uint8_t old_quadrant, uint8_t new_quadrant) {
+  if (new_quadrant == old_quadrant) {
+    return SAME;
+  }
+  if (new_quadrant == ((old_quadrant + 1) & 0x03)) {
+    return NEXT;
+  }
+  if (new_quadrant == ((old_quadrant - 1) & 0x03)) {
+    return PREVIOUS;
+  }
+  return INVALID;
+}
+
+constexpr uint8_t make_entry(uint8_t index) {
+  const bool abs_v1_greater = index & kAbsV1GreaterBit;
+  const bool v1_negative = index & kV1NegativeBit;
+  const bool v2_negative = index & kV2NegativeBit;
+  const uint8_t old_quadrant = index >> kOldQuadrantShift;
+  // Quadrants 0-3 are (+,+), (-,+), (-,-), (+,-) for (v1, v2). See
+  // quadrants_plot.png.
+  const uint8_t new_quadrant =
+      v2_negative ? (v1_negative ? 2 : 3) : (v1_negative ? 1 : 0);
+  const Transition transition = transition_of(old_quadrant, new_quadrant);
+  return new_quadrant | (abs_v1_greater ? 0 : kMaxIsV2Bit) |
+      (transition << kTransitionShift);
+}
+
+struct Table {
+  uint8_t entries[4 << kOldQuadrantShift];
+};
+
+constexpr Table make_table() {
+  Table table = {};
+  for (uint8_t i = 0; i < sizeof(table.entries); i++) {
+    table.entries[i] = make_entry(i);
+  }
+  return table;
+}
+
+constexpr Table kTable = make_table();
+
+static_assert(kTable.entries[(0 << kOldQuadrantShift) | kV1NegativeBit] ==
+    (1 | kMaxIsV2Bit | (NEXT << kTransitionShift)));
+static_assert(
+    kTable.entries[(0 << kOldQuadrantShift) | kV2NegativeBit |
+        kAbsV1GreaterBit] == (3 | (PREVIOUS << kTransitionShift)));
+static_assert(
+    kTable.entries[(1 << kOldQuadrantShift) | kV2NegativeBit] ==
+    (3 | kMaxIsV2Bit | (INVALID << kTransitionShift)));
+
+}  // namespace quadrant_table
+
+// The analyzer variables that are updated on every sample. The frame
+// handler keeps a local copy of them for the duration of a frame,
+// such that the compiler can keep them in registers, and writes them
+// back once at the end of the frame.
+struct HotVars {
+  State state;
+  filters::DualChannelFilter<SignalFilter> signal_filter;
+  uint16_t steps_capture_divider_counter;
+};
+
+static inline void isr_load_hot_vars(HotVars* hot) {
+  hot->state = isr_data.state;
+  hot->signal_filter = signal_filter;
+  hot->steps_capture_divider_counter = isr_data.steps_capture_divider_counter;
+}
+
+static inline void isr_store_hot_vars(const HotVars& hot) {
+  isr_data.state = hot.state;
+  signal_filter = hot.signal_filter;
+  isr_data.steps_capture_divider_counter = hot.steps_capture_divider_counter;
+}
+
+// Records the step that just ended. Called on a quadrant transition,
+// before the step fields of isr_state are reset for the next step.
+static inline void isr_add_step_event(const State& isr_state, int increment) {
+  // For the step rate trigger.
+  isr_data.last_step_ticks = isr_state.ticks_in_step;
+  // If the consumer is behind and the ring is full, the event is dropped
+  // and its sequence number is skipped.
+  StepEvent* event = step_event_ring.producer_slot();
+  const uint32_t seq_number = isr_data.step_event_seq_number++;
+  if (!event) {
+    dropped_step_events++;
+    return;
+  }
+  event->tick_count = isr_state.tick_count;
+  event->seq_number = seq_number;
+  event->ticks_in_step = isr_state.ticks_in_step;
+  event->max_current_in_step = isr_state.max_current_in_step;
+  event->increment = isr_state.is_reverse_direction ? -increment : increment;
+  step_event_ring.producer_commit();
+}
 
 // This function performs the bulk of the IRQ processing. It accepts
-// one pair of ADC1, ADC2 readings, analyzes it, and updates the
-// state.
-void isr_handle_one_sample(const uint16_t raw_v1, const uint16_t raw_v2) {
-  isr_data.state.tick_count++;
+// one pair of filtered ADC1, ADC2 readings, analyzes it, and updates
+// the hot vars. Forced inline since it's called once per sample.
+static inline __attribute__((always_inline)) void isr_process_sample(
+    HotVars& hot, const uint16_t filtered_v1, const uint16_t filtered_v2) {
+  State& isr_state = hot.state;  // alias
+
+  isr_state.tick_count++;
 
   // Every N ADC ticks, capture the steps values.
-  if (++isr_data.steps_capture_divider_counter >= kStepsCaptureDivider) {
-    isr_data.steps_capture_divider_counter = 0;
+  if (++hot.steps_capture_divider_counter >= kStepsCaptureDivider) {
+    hot.steps_capture_divider_counter = 0;
     StepsCaptureItem* item = isr_data.steps_capture_buffer.insert();
-    item->full_steps = isr_data.state.full_steps;
-    item->max_full_steps = isr_data.state.max_full_steps;
+    item->full_steps = isr_state.full_steps;
+    item->max_full_steps = isr_state.max_full_steps;
   }
 
-  // Slight filtering for signal cleanup.
-  const int16_t v1 = (int16_t)signal1_filter.update(raw_v1) - isr_data.offset1;
-  const int16_t v2 = (int16_t)signal2_filter.update(raw_v2) - isr_data.offset2;
+  const int16_t v1 = (int16_t)filtered_v1 - isr_data.offset1;
+  const int16_t v2 = (int16_t)filtered_v2 - isr_data.offset2;
+
+  isr_state.v1 = v1;
+  isr_state.v2 = v2;
 
-  isr_data.state.v1 = v1;
-  isr_data.state.v2 = v2;
+  if (isr_data.waveform_decimation &&
+      ++isr_data.waveform_decimation_counter >= isr_data.waveform_decimation) {
+    isr_data.waveform_decimation_counter = 0;
+    isr_add_waveform_sample(isr_state.tick_count, v1, v2);
+  }
 
   // Handle adc signal capturing.
-  if (++isr_data.adc_capture_divider_counter >= isr_data.adc_capture_divider) {
+  PROFILER_START(capture_start);
+  const bool is_envelope = isr_data.adc_capture_mode == CAPTURE_MODE_ENVELOPE;
+  if (is_envelope) {
+    isr_data.adc_capture_min_v1 = std::min(isr_data.adc_capture_min_v1, v1);
+    isr_data.adc_capture_max_v1 = std::max(isr_data.adc_capture_max_v1, v1);
+    isr_data.adc_capture_min_v2 = std::min(isr_data.adc_capture_min_v2, v2);
+    isr_data.adc_capture_max_v2 = std::max(isr_data.adc_capture_max_v2, v2);
+  }
+  if (++isr_data.adc_capture_divider_counter >= isr_data.adc_capture_divider &&
+      isr_data.adc_capture_state != ADC_CAPTURE_STOPPED) {
     isr_data.adc_capture_divider_counter = 0;
     // Insert sample to circular buffer. If the buffer is full it drops
     // the oldest item.
-    AdcCaptureItem* adc_capture_item =
-        isr_data.adc_capture_buffer.items.insert();
-    adc_capture_item->v1 = v1;
-    adc_capture_item->v2 = v2;
+    AdcCaptureItem* adc_capture_item = isr_data.adc_capture_items->insert();
+    if (is_envelope) {
+      adc_capture_item->v1 = isr_data.adc_capture_max_v1;
+      adc_capture_item->v2 = isr_data.adc_capture_max_v2;
+      adc_capture_item->min_v1 = isr_data.adc_capture_min_v1;
+      adc_capture_item->min_v2 = isr_data.adc_capture_min_v2;
+      isr_reset_adc_capture_envelope();
+    } else {
+      adc_capture_item->v1 = v1;
+      adc_capture_item->v2 = v2;
+      adc_capture_item->min_v1 = v1;
+      adc_capture_item->min_v2 = v2;
+    }
+    if (isr_data.deep_capture.state == DEEP_CAPTURE_FILLING) {
+      isr_add_deep_capture_item(*adc_capture_item);
+    }
 
     switch (isr_data.adc_capture_state) {
-      // In this sate we blindly fill half of the buffer.
-      case ADC_CAPTURE_HALF_FILL:
-        if (isr_data.adc_capture_buffer.items.size() >=
-            kAdcCaptureBufferSize / 2) {
+      // In this sate we blindly fill the pre trigger items.
+      case ADC_CAPTURE_PRE_FILL:
+        if (--isr_data.adc_capture_fill_items_left == 0) {
+          isr_arm_trigger(isr_state);
           isr_data.adc_capture_state = ADC_CAPTURE_PRE_TRIGGER;
         }
         break;
@@ -400,22 +1608,37 @@ void isr_handle_one_sample(const uint16_t raw_v1, const uint16_t raw_v2) {
       // In this state we look for a trigger event or a pre trigger timeout.
       case ADC_CAPTURE_PRE_TRIGGER: {
         // Pre trigger timeout?
-        if (isr_data.adc_capture_pre_trigger_items_left == 0) {
-          // NOTE: if the buffer is full here we could terminate
-          // the capture but we go through the normal motions for simplicity.
-          isr_data.adc_capture_state = ADC_CAPTURE_POST_TRIGER;
-          break;
+        if (isr_data.trigger.mode == TRIGGER_MODE_AUTO) {
+          if (isr_data.adc_capture_pre_trigger_items_left == 0) {
+            // NOTE: if the buffer is full here we could terminate the
+            // capture but we go through the normal motions for
+            // simplicity. Segments keep the trigger at the same position
+            // also when forced.
+            isr_data.adc_capture_state = ADC_CAPTURE_POST_TRIGER;
+            isr_on_capture_trigger(*adc_capture_item, isr_state.tick_count);
+            if (isr_data.adc_capture_num_segments > 1) {
+              isr_data.adc_capture_items->keep_at_most(
+                  isr_data.adc_capture_pre_trigger_items);
+            }
+            break;
+          }
+          isr_data.adc_capture_pre_trigger_items_left--;
         }
-        isr_data.adc_capture_pre_trigger_items_left--;
         // Is this a trigger event?
-        const int16_t old_v1 =
-            isr_data.adc_capture_buffer.items.get_reversed(5)->v1;
-        // Trigger criteria: crossing up the zero line.
-        if (old_v1 < -10 && v1 >= 0) {
-          // Keep only the last n/2 points. This way the trigger will
-          // always be in the middle of the buffer.
-          isr_data.adc_capture_buffer.items.keep_at_most(
-              kAdcCaptureBufferSize / 2);
+        PROFILER_START(trigger_start);
+        const bool condition =
+            isr_trigger_condition(*adc_capture_item, isr_state);
+        const bool is_trigger = condition && !isr_data.trigger_condition;
+        isr_data.trigger_condition = condition;
+        PROFILER_ADD_NESTED(
+            profiler::STAGE_TRIGGER, profiler::STAGE_CAPTURE, trigger_start);
+        if (is_trigger) {
+          isr_on_capture_trigger(*adc_capture_item, isr_state.tick_count);
+          // Keep only the pre trigger items, including the trigger
+          // item, such that the trigger is always at the same position
+          // in the buffer.
+          isr_data.adc_capture_items->keep_at_most(
+              isr_data.adc_capture_pre_trigger_items);
           isr_data.adc_capture_state = ADC_CAPTURE_POST_TRIGER;
         }
       } break;
@@ -423,40 +1646,76 @@ void isr_handle_one_sample(const uint16_t raw_v1, const uint16_t raw_v2) {
       // In this state we blindly fill the rest of the buffer. Note
       // that the current sample was already inserted above.
       case ADC_CAPTURE_POST_TRIGER:
-        if (isr_data.adc_capture_buffer.items.is_full()) {
+        if (isr_data.adc_capture_items->size() >=
+            isr_data.adc_capture_segment_items) {
+          if (isr_data.adc_capture_num_segments > 1) {
+            isr_append_capture_segment();
+            if (++isr_data.adc_capture_segments_done <
+                isr_data.adc_capture_num_segments) {
+              isr_start_capture_segment();
+              break;
+            }
+          }
           // We completed a capture cycle. Snapshot the result and start
           // a new cycle.
           isr_restart_adc_capture_cycle();
+          if (isr_data.trigger.mode == TRIGGER_MODE_SINGLE) {
+            isr_data.adc_capture_state = ADC_CAPTURE_STOPPED;
+          }
         }
         break;
+
+      case ADC_CAPTURE_STOPPED:
+        break;
     }
   }
+  PROFILER_ADD_NESTED(
+      profiler::STAGE_CAPTURE, profiler::STAGE_DECODING, capture_start);
 
   // Determine if motor is energized. Use hysteresis for noise rejection.
   // Release: 200ns. Debug: 600ns.
-  const bool old_is_energized = isr_data.state.is_energized;
+  const bool old_is_energized = isr_state.is_energized;
   const uint16_t total_current = abs(v1) + abs(v2);
   // Using histeresis.
   const uint16_t energized_threshold = old_is_energized
       ? kNonEnergizedThresholdCounts
       : kEnergizedThresholdCounts;
   const bool new_is_energized = total_current > energized_threshold;
-  isr_data.state.is_energized = new_is_energized;
+  isr_state.is_energized = new_is_energized;
 
   // Handle the non energized case. No need to go through quadrant decoding.
   // Pass through case: Release: 110ns. Debug: 250ns.
   if (!new_is_energized) {
     if (old_is_energized) {
       // Becoming non energized.
-      isr_data.state.last_step_direction = UNKNOWN_DIRECTION;
-      isr_data.state.ticks_in_step = 0;
-      isr_data.state.non_energized_count++;
+      isr_state.last_step_direction = UNKNOWN_DIRECTION;
+      isr_state.ticks_in_step = 0;
+      isr_state.non_energized_count++;
     } else {
       // Staying non energized
     }
     return;
   }
 
+  const uint8_t old_quadrant = isr_state.quadrant;  // old quadrant [0, 3]
+
+#if ANALYZER_QUADRANT_DECODER == 1
+  // Here when energized. Decode quadrant with a single table lookup.
+  // The max coil current is max(|v1|, |v2|), also in the sectors where
+  // the decision tree below breaks ties differently.
+  const uint16_t abs_v1 = v1 < 0 ? -v1 : v1;
+  const uint16_t abs_v2 = v2 < 0 ? -v2 : v2;
+  const uint8_t index = (old_quadrant << quadrant_table::kOldQuadrantShift) |
+      ((v2 < 0) ? quadrant_table::kV2NegativeBit : 0) |
+      ((v1 < 0) ? quadrant_table::kV1NegativeBit : 0) |
+      ((abs_v1 > abs_v2) ? quadrant_table::kAbsV1GreaterBit : 0);
+  const uint8_t entry = quadrant_table::kTable.entries[index];
+  const uint8_t new_quadrant = entry & quadrant_table::kQuadrantMask;
+  const uint32_t max_current =
+      (entry & quadrant_table::kMaxIsV2Bit) ? abs_v2 : abs_v1;
+  const quadrant_table::Transition transition =
+      (quadrant_table::Transition)(entry >> quadrant_table::kTransitionShift);
+#elif ANALYZER_QUADRANT_DECODER == 0
   // Here when energized. Decode quadrant.
   // We now go through a decision tree to collect the new quadrant, sector
   // and max coil current. Optimized for speed. See quadrants_plot.png
@@ -509,55 +1768,307 @@ void isr_handle_one_sample(const uint16_t raw_v1, const uint16_t raw_v2) {
     }
   }
 
-  const uint8_t old_quadrant = isr_data.state.quadrant;  // old quadrant [0, 3]
-  isr_data.state.quadrant = new_quadrant;
+  const quadrant_table::Transition transition =
+      quadrant_table::transition_of(old_quadrant, new_quadrant);
+#else
+#error "Unknown ANALYZER_QUADRANT_DECODER."
+#endif
+
+  isr_state.quadrant = new_quadrant;
 
   // Track quadrant transitions and update steps.
   if (!old_is_energized) {
     // Case 1: motor just became energized. Direction is still not known.
-    isr_data.state.last_step_direction = UNKNOWN_DIRECTION;
-    isr_data.state.ticks_in_step = 1;
-    isr_data.state.max_current_in_step = max_current;
-  } else if (new_quadrant == old_quadrant) {
+    isr_state.last_step_direction = UNKNOWN_DIRECTION;
+    isr_state.ticks_in_step = 1;
+    isr_state.max_current_in_step = max_current;
+  } else if (transition == quadrant_table::SAME) {
     // Case 2: staying in same quadrant
-    isr_data.state.ticks_in_step++;
-    if (max_current > isr_data.state.max_current_in_step) {
-      isr_data.state.max_current_in_step = max_current;
+    isr_state.ticks_in_step++;
+    if (max_current > isr_state.max_current_in_step) {
+      isr_state.max_current_in_step = max_current;
     }
-  } else if (new_quadrant == ((old_quadrant + 1) & 0x03)) {
+  } else if (transition == quadrant_table::NEXT) {
     // Case 3: Moved to next quadrant.
-    isr_update_full_steps_counter(+1);
-    isr_add_step_to_histogram(old_quadrant, isr_data.state.last_step_direction,
-        FORWARD, isr_data.state.ticks_in_step,
-        isr_data.state.max_current_in_step);
-    isr_data.state.last_step_direction = FORWARD;
-    isr_data.state.ticks_in_step = 1;
-    isr_data.state.max_current_in_step = max_current;
-  } else if (new_quadrant == ((old_quadrant - 1) & 0x03)) {
+    isr_update_full_steps_counter(isr_state, +1);
+    isr_add_step_event(isr_state, +1);
+    PROFILER_START(histogram_start);
+    isr_add_step_to_histogram(isr_state, isr_state.last_step_direction,
+        FORWARD, isr_state.ticks_in_step, isr_state.max_current_in_step);
+    PROFILER_ADD_NESTED(
+        profiler::STAGE_HISTOGRAM, profiler::STAGE_DECODING, histogram_start);
+    isr_state.last_step_direction = FORWARD;
+    isr_state.ticks_in_step = 1;
+    isr_state.max_current_in_step = max_current;
+  } else if (transition == quadrant_table::PREVIOUS) {
     // Case 4: Moved to previous quadrant.
-    isr_update_full_steps_counter(-1);
-    isr_add_step_to_histogram(old_quadrant, isr_data.state.last_step_direction,
-        BACKWARD, isr_data.state.ticks_in_step,
-        isr_data.state.max_current_in_step);
-    isr_data.state.last_step_direction = BACKWARD;
-    isr_data.state.ticks_in_step = 1;
-    isr_data.state.max_current_in_step = max_current;
+    isr_update_full_steps_counter(isr_state, -1);
+    isr_add_step_event(isr_state, -1);
+    PROFILER_START(histogram_start);
+    isr_add_step_to_histogram(isr_state, isr_state.last_step_direction,
+        BACKWARD, isr_state.ticks_in_step, isr_state.max_current_in_step);
+    PROFILER_ADD_NESTED(
+        profiler::STAGE_HISTOGRAM, profiler::STAGE_DECODING, histogram_start);
+    isr_state.last_step_direction = BACKWARD;
+    isr_state.ticks_in_step = 1;
+    isr_state.max_current_in_step = max_current;
   } else {
     // Case 5: Invalid quadrant transition.
     // TODO: count and report errors.
-    isr_data.state.quadrature_errors++;
-    isr_data.state.last_step_direction = UNKNOWN_DIRECTION;
-    isr_data.state.ticks_in_step = 1;
-    isr_data.state.max_current_in_step = max_current;
+    isr_state.quadrature_errors++;
+    isr_state.last_step_direction = UNKNOWN_DIRECTION;
+    isr_state.ticks_in_step = 1;
+    isr_state.max_current_in_step = max_current;
+  }
+}
+
+void isr_handle_one_sample(const uint16_t raw_v1, const uint16_t raw_v2) {
+  HotVars hot;
+  isr_load_hot_vars(&hot);
+  // Slight filtering for signal cleanup.
+  uint16_t v1 = raw_v1;
+  uint16_t v2 = raw_v2;
+  PROFILER_START(filter_start);
+  hot.signal_filter.update(&v1, &v2);
+  PROFILER_ADD(profiler::STAGE_FILTER, filter_start);
+  PROFILER_START(decoding_start);
+  isr_process_sample(hot, v1, v2);
+  PROFILER_ADD(profiler::STAGE_DECODING, decoding_start);
+  isr_store_hot_vars(hot);
+}
+
+// Accounts for num_pairs ticks without a sample, bad or lost pairs,
+// such that tick_count stays a time base. Advances every tick driven
+// counter as isr_process_sample() does. The steps capture is as
+// usual, but the signal captures and the waveform have no value for
+// these ticks, so an item that falls due is taken at the next sample
+// and the items around the gap are not evenly spaced.
+static void isr_skip_pairs(HotVars& hot, uint32_t num_pairs) {
+  State& isr_state = hot.state;  // alias
+  isr_state.tick_count += num_pairs;
+  isr_state.ticks_with_errors += num_pairs;
+  // Keeps the step speed a true speed, though steps may have been
+  // missed during the gap. A de-energized motor has no step.
+  if (isr_state.is_energized) {
+    isr_state.ticks_in_step += num_pairs;
+  }
+
+  uint32_t steps_counter = hot.steps_capture_divider_counter + num_pairs;
+  while (steps_counter >= kStepsCaptureDivider) {
+    steps_counter -= kStepsCaptureDivider;
+    StepsCaptureItem* item = isr_data.steps_capture_buffer.insert();
+    item->full_steps = isr_state.full_steps;
+    item->max_full_steps = isr_state.max_full_steps;
+  }
+  hot.steps_capture_divider_counter = steps_counter;
+
+  isr_data.adc_capture_divider_counter = std::min<uint32_t>(
+      isr_data.adc_capture_divider_counter + num_pairs,
+      isr_data.adc_capture_divider);
+  if (isr_data.waveform_decimation) {
+    isr_data.waveform_decimation_counter = std::min<uint32_t>(
+        isr_data.waveform_decimation_counter + num_pairs,
+        isr_data.waveform_decimation);
+  }
+}
+
+// Accepts a pair of samples, sort them to v1 and v2 and return true,
+// or returns false, if can't. Updates the pair counts in stats.
+static inline bool isr_sort_sample_pair(const adc_digi_output_data_t& data1,
+    const adc_digi_output_data_t& data2, uint16_t* raw_v1, uint16_t* raw_v2,
+    FrameStats* stats) {
+  if (data1.type1.channel == 6 && data2.type1.channel == 7) {
+    *raw_v1 = data1.type1.data;
+    *raw_v2 = data2.type1.data;
+    stats->good_67_pairs++;
+    return true;
+  }
+
+  if (data1.type1.channel == 7 && data2.type1.channel == 6) {
+    *raw_v1 = data2.type1.data;
+    *raw_v2 = data1.type1.data;
+    stats->good_76_pairs++;
+    return true;
+  }
+
+  stats->bad_pairs++;
+  return false;
+}
+
+void isr_handle_frame(const adc_digi_output_data_t* values,
+    uint16_t num_pairs, FrameStats* stats) {
+  if (!num_pairs) {
+    return;
+  }
+
+  // The channel order is determined once, from the first pair. Pairs
+  // that don't match it, e.g. after a lost DMA value, are sorted
+  // individually.
+  const bool is_swapped = values[0].type1.channel == 7;
+  // The channels of the first and second values of a pair, as 4 bit
+  // nibbles.
+  const uint8_t expected_channels = is_swapped ? 0x67 : 0x76;
+  const int i1 = is_swapped ? 1 : 0;
+  const int i2 = is_swapped ? 0 : 1;
+  uint32_t ordered_pairs = 0;
+
+  HotVars hot;
+  isr_load_hot_vars(&hot);
+
+  // The frame is processed in blocks. Each block is sorted into per
+  // signal arrays, filtered as a whole, and then analyzed.
+  uint16_t block_v1[kMaxFilterBlockPairs];
+  uint16_t block_v2[kMaxFilterBlockPairs];
+  for (uint16_t block_start = 0; block_start < num_pairs;
+       block_start += kMaxFilterBlockPairs) {
+    const uint16_t block_end = std::min<uint16_t>(
+        num_pairs, block_start + kMaxFilterBlockPairs);
+    PROFILER_START(validation_start);
+    uint16_t n = 0;
+    // The bad pairs, as the number of good pairs before each of them.
+    uint8_t bad_pair_positions[kMaxFilterBlockPairs];
+    uint16_t num_bad_pairs = 0;
+    for (uint16_t i = block_start; i < block_end; i++) {
+      const adc_digi_output_data_t* pair = &values[2 * i];
+      const uint8_t channels =
+          pair[0].type1.channel | (pair[1].type1.channel << 4);
+      if (channels == expected_channels) {
+        ordered_pairs++;
+        block_v1[n] = pair[i1].type1.data;
+        block_v2[n] = pair[i2].type1.data;
+      } else if (!isr_sort_sample_pair(
+                     pair[0], pair[1], &block_v1[n], &block_v2[n], stats)) {
+        // Bad pair. Skip.
+        bad_pair_positions[num_bad_pairs++] = n;
+        continue;
+      }
+      n++;
+    }
+    PROFILER_ADD(profiler::STAGE_PAIR_VALIDATION, validation_start);
+
+    // Slight filtering for signal cleanup.
+    PROFILER_START(filter_start);
+    hot.signal_filter.update_block(block_v1, block_v2, n);
+    PROFILER_ADD(profiler::STAGE_FILTER, filter_start);
+
+    // Processed in segments between the bad pairs, which still take
+    // their time, such that the results don't depend on the frame
+    // boundaries.
+    PROFILER_START(decoding_start);
+    uint16_t i = 0;
+    for (uint16_t b = 0; b <= num_bad_pairs; b++) {
+      const uint16_t segment_end =
+          (b < num_bad_pairs) ? bad_pair_positions[b] : n;
+      for (; i < segment_end; i++) {
+        isr_process_sample(hot, block_v1[i], block_v2[i]);
+      }
+      if (b < num_bad_pairs) {
+        isr_skip_pairs(hot, 1);
+      }
+    }
+    PROFILER_ADD(profiler::STAGE_DECODING, decoding_start);
+  }
+
+  isr_store_hot_vars(hot);
+
+  if (is_swapped) {
+    stats->good_76_pairs += ordered_pairs;
+  } else {
+    stats->good_67_pairs += ordered_pairs;
+  }
+}
+
+void isr_handle_lost_pairs(uint32_t num_pairs) {
+  HotVars hot;
+  isr_load_hot_vars(&hot);
+  hot.state.lost_pairs += num_pairs;
+  isr_skip_pairs(hot, num_pairs);
+  isr_store_hot_vars(hot);
+}
+
+// Computes isr_state.step_fraction. The fixed point equivalent of the
+// fraction computed by state_steps().
+static void isr_update_step_fraction(State& isr_state) {
+  if (!isr_state.is_energized) {
+    isr_state.step_fraction = 0;
+    return;
+  }
+  const uint16_t abs_v1 = isr_state.v1 < 0 ? -isr_state.v1 : isr_state.v1;
+  const uint16_t abs_v2 = isr_state.v2 < 0 ? -isr_state.v2 : isr_state.v2;
+  // The angle from the axis where the quadrant starts. In the odd
+  // quadrants that's the v2 axis. See quadrants_plot.png.
+  const uint32_t angle = (isr_state.quadrant & 0x01)
+      ? cordic::quarter_turn_angle(abs_v2, abs_v1)
+      : cordic::quarter_turn_angle(abs_v1, abs_v2);
+  // Quarter turn is one step. Rounded and shifted to [-128, 128].
+  static_assert(cordic::kQuarterTurn == (256 << 8));
+  const int16_t fraction = (int16_t)((angle + 0x80) >> 8) - 128;
+  isr_state.step_fraction =
+      isr_state.is_reverse_direction ? -fraction : fraction;
+}
+
+// Updates the quantiles of the buckets whose sketches changed and
+// publishes them.
+static void isr_publish_step_quantiles() {
+  for (int i = 0; i < acq_consts::kNumHistogramBuckets; i++) {
+    if (!(isr_data.step_quantiles_changed_buckets & (1u << i))) {
+      continue;
+    }
+    StepQuantiles& quantiles = isr_data.step_quantiles.buckets[i];
+    isr_data.ticks_in_step_sketches[i].quantiles(
+        kStepQuantilesPerMille, kNumStepQuantiles, quantiles.ticks_in_step);
+    isr_data.peak_current_sketches[i].quantiles(
+        kStepQuantilesPerMille, kNumStepQuantiles, quantiles.peak_current);
+  }
+  isr_data.step_quantiles_changed_buckets = 0;
+  published_step_quantiles.write(isr_data.step_quantiles);
+}
+
+// Called by the adc task after each frame. The deep capture is
+// published only if it changed since the last call. The histogram and
+// the step quantiles are published if they changed, at most every
+// kHistogramPublishTicks and kStepQuantilesPublishTicks.
+void isr_publish_data() {
+  isr_update_step_fraction(isr_data.state);
+  published_state.write(isr_data.state);
+  if (isr_data.histogram_changed &&
+      isr_data.state.tick_count >= isr_data.histogram_publish_tick_count) {
+    isr_data.histogram_changed = false;
+    published_histogram.write(isr_data.histogram);
+    isr_data.histogram_publish_tick_count =
+        isr_data.state.tick_count + kHistogramPublishTicks;
+  }
+  if (isr_data.deep_capture_changed) {
+    isr_publish_deep_capture();
+  }
+  if (isr_data.step_quantiles_changed_buckets &&
+      isr_data.state.tick_count >=
+          isr_data.step_quantiles_publish_tick_count) {
+    isr_publish_step_quantiles();
+    isr_data.step_quantiles_publish_tick_count =
+        isr_data.state.tick_count + kStepQuantilesPublishTicks;
+  }
+  if (isr_data.state.tick_count >= histogram_slices.slice_end_tick_count) {
+    isr_complete_histogram_slice();
+    histogram_slices.slice_end_tick_count += kHistogramSliceTicks;
+    // If the acquisition was stalled, the next slice starts now.
+    if (isr_data.state.tick_count >= histogram_slices.slice_end_tick_count) {
+      histogram_slices.slice_end_tick_count =
+          isr_data.state.tick_count + kHistogramSliceTicks;
+    }
   }
 }
 
 // An ISR that is called after a predefined number of calls to
 // isr_handle_one_sample. Used to snapshot the state at fixed time intervals.
 void isr_snapshot_state() {
-  // This drops the oldest entry if buffer becomes full.
-  State* entry = state_circular_buffer.insert();
-  *entry = isr_data.state;
+  // The frame may not be published yet.
+  isr_update_step_fraction(isr_data.state);
+  // If the consumer is behind and the buffer is full, this state is
+  // dropped.
+  if (!state_circular_buffer.push(isr_data.state)) {
+    dropped_states++;
+  }
   // Notify the notification thread that a new state is available.
   xSemaphoreGive(circular_state_semaphore);
 }
@@ -580,8 +2091,13 @@ void setup(const nvs_config::AcquistionSettings& settings) {
   assert(circular_state_semaphore);
 
   ENTER_MUTEX {
-    isr_data.adc_capture_state = ADC_CAPTURE_HALF_FILL;
+    isr_data.adc_capture_state = ADC_CAPTURE_PRE_FILL;
     isr_data.adc_capture_divider = 1;
+    isr_data.adc_capture_num_segments = 1;
+    isr_data.trigger = kDefaultTriggerSettings;
+    histogram_slices.window_slices = kMaxHistogramWindowSlices;
+    isr_data.adc_capture_pool_index = 0;
+    isr_data.adc_capture_buffer = &capture_pool[0];
 
     isr_data.offset1 = clip_offset(settings.offset1);
     isr_data.offset2 = clip_offset(settings.offset2);
@@ -592,6 +2108,11 @@ void setup(const nvs_config::AcquistionSettings& settings) {
     isr_reset_adc_capture_buffer();
   }
   EXIT_MUTEX
+
+  const bool histogram_layout_ok =
+      set_histogram_layout(kDefaultHistogramLayout);
+  assert(histogram_layout_ok);
+  (void)histogram_layout_ok;
 }
 
 // This involves floating point operations and thus slow. Do not
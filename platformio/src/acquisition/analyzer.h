@@ -19,16 +19,101 @@ namespace analyzer {
 constexpr uint16_t kAdcCaptureBufferSize = 400;
 
 // Number of captured samples to wait for a trigger. If this number
-// of samples is reached, we force a trigger.
+// of samples is reached, we force a trigger. TRIGGER_MODE_AUTO only.
 constexpr uint16_t kAdcCaptureMaxWaitToTrigger = kAdcCaptureBufferSize;
 
+// Max number of segments of a segmented capture. A segmented capture
+// splits the capture buffer into equal segments, each around its own
+// trigger, to catch rare events. Each segment has at least
+// kAdcCaptureBufferSize / kMaxCaptureSegments items.
+constexpr uint8_t kMaxCaptureSegments = 8;
+
+// How the captured items represent the samples of a divider window.
+enum CaptureMode : uint8_t {
+  // Each item is the last sample of the window. Other samples are
+  // dropped, so spikes between the items are not visible.
+  CAPTURE_MODE_DECIMATE = 0,
+  // Each item is the min and max of the window samples, a peak detect
+  // envelope for long time bases.
+  CAPTURE_MODE_ENVELOPE = 1,
+};
+
+// The event that triggers a signal capture.
+enum TriggerSource : uint8_t {
+  // The selected channel crossing the level, with hysteresis. In
+  // envelope mode, the middle of the min and max.
+  TRIGGER_SOURCE_LEVEL = 0,
+  // A quadrature error. The edge is ignored.
+  TRIGGER_SOURCE_QUADRATURE_ERROR = 1,
+  // Rising, the motor becomes energized. Falling, it becomes
+  // de-energized.
+  TRIGGER_SOURCE_ENERGIZED = 2,
+  // The step rate crossing the level, in steps/sec. Rising, the motor
+  // speeds up above the level. Falling, it slows down below it or
+  // stops.
+  TRIGGER_SOURCE_STEP_RATE = 3,
+};
+
+enum TriggerMode : uint8_t {
+  // Forces a trigger after kAdcCaptureMaxWaitToTrigger items without
+  // one, such that captures keep coming.
+  TRIGGER_MODE_AUTO = 0,
+  // Captures only on a trigger.
+  TRIGGER_MODE_NORMAL = 1,
+  // Captures on the first trigger and then stops, until the trigger
+  // settings, divider or mode are set again.
+  TRIGGER_MODE_SINGLE = 2,
+};
+
+// The signal capture trigger. The trigger is evaluated once per
+// captured item, in O(1).
+struct TriggerSettings {
+  TriggerSource source;
+  TriggerMode mode;
+  // 0 for v1, 1 for v2. TRIGGER_SOURCE_LEVEL only.
+  uint8_t channel;
+  bool is_falling_edge;
+  // In adc counts, or steps/sec for TRIGGER_SOURCE_STEP_RATE.
+  int16_t level;
+  // In adc counts. A crossing counts only if the signal was beyond the
+  // level by more than this since the previous crossing.
+  // TRIGGER_SOURCE_LEVEL only.
+  uint16_t hysteresis;
+  // Captured items up to and including the trigger, in
+  // [1, kAdcCaptureBufferSize). Clipped to the segment length, minus 1,
+  // of a segmented capture.
+  uint16_t pre_trigger_items;
+  // Min number of captured items from the start of a capture to its
+  // trigger. Triggers are ignored before max(pre_trigger_items,
+  // holdoff_items).
+  uint16_t holdoff_items;
+};
+
+// An up crossing of zero by v1, with the trigger in the middle of the
+// capture.
+constexpr TriggerSettings kDefaultTriggerSettings = {
+    .source = TRIGGER_SOURCE_LEVEL,
+    .mode = TRIGGER_MODE_AUTO,
+    .channel = 0,
+    .is_falling_edge = false,
+    .level = 0,
+    .hysteresis = 10,
+    .pre_trigger_items = kAdcCaptureBufferSize / 2,
+    .holdoff_items = 0,
+};
+
 // A single captured item. These are the signed values
 // in adc counts of the two curent sensing channels.
 struct AdcCaptureItem {
-  AdcCaptureItem() : v1(0), v2(0) { }
-  // Coil currents in adc tick units.
+  AdcCaptureItem() : v1(0), v2(0), min_v1(0), min_v2(0) { }
+  // Coil currents in adc tick units. In envelope mode, the max of the
+  // window.
   int16_t v1;
   int16_t v2;
+  // The min of the window in envelope mode. Same as v1, v2 in decimate
+  // mode.
+  int16_t min_v1;
+  int16_t min_v2;
 };
 
 // A circular array with captured signals. Using a circular array
@@ -36,7 +121,14 @@ struct AdcCaptureItem {
 typedef CircularBuffer<AdcCaptureItem, kAdcCaptureBufferSize> AdcCaptureItems;
 
 struct AdcCaptureBuffer {
-  AdcCaptureBuffer() : seq_number(0), divider(1) {};
+  AdcCaptureBuffer()
+      : seq_number(0),
+        divider(1),
+        mode(CAPTURE_MODE_DECIMATE),
+        num_segments(1),
+        segment_items(kAdcCaptureBufferSize),
+        pre_trigger_items(0),
+        trigger_tick_counts{} {};
   // Incremented on each capture snapshot. Users should handle
   // overflow gracefully.
   uint16_t seq_number;
@@ -44,11 +136,68 @@ struct AdcCaptureBuffer {
   // samples are included. Value of 2 indicates every other sample
   // is included and so on.
   uint8_t divider;
+  CaptureMode mode;
+  // The items are num_segments consecutive segments of segment_items
+  // items each, oldest first. 1 if not segmented.
+  uint8_t num_segments;
+  uint16_t segment_items;
+  // Items of each segment up to and including its trigger.
+  uint16_t pre_trigger_items;
+  // The tick_count of the trigger of each segment, forced or not.
+  uint64_t trigger_tick_counts[kMaxCaptureSegments];
 
   // The actual items as a circular buffer.
   AdcCaptureItems items;
 };
 
+// Number of the last items of a capture that are passed to the
+// spectrum analysis, see spectrum::kFftSize.
+constexpr uint16_t kSpectrumCaptureItems = 256;
+
+// The last items of a completed capture, for the spectrum analysis.
+struct SpectrumCapture {
+  // Of the AdcCaptureBuffer.
+  uint16_t seq_number;
+  uint8_t divider;
+  // The channels' items, oldest first, in adc counts.
+  int16_t v1[kSpectrumCaptureItems];
+  int16_t v2[kSpectrumCaptureItems];
+};
+
+// A deep capture is a single capture of up to tens of thousands of
+// items, for seeing long events at full resolution. Its buffer is
+// allocated from the heap when armed, and it's filled from the next
+// capture trigger on, with the capture divider and mode at the time.
+enum DeepCaptureState : uint8_t {
+  // No buffer.
+  DEEP_CAPTURE_IDLE = 0,
+  // Waiting for a trigger.
+  DEEP_CAPTURE_ARMED = 1,
+  // Adding items.
+  DEEP_CAPTURE_FILLING = 2,
+  // Full. Stays until the next arm_deep_capture().
+  DEEP_CAPTURE_DONE = 3,
+};
+
+struct DeepCaptureInfo {
+  DeepCaptureState state;
+  // Incremented on each arm_deep_capture().
+  uint16_t seq_number;
+  uint8_t divider;
+  CaptureMode mode;
+  // Item capacity of the buffer and number of items added so far.
+  uint32_t capacity;
+  uint32_t size;
+  // The tick_count of the first item, the trigger.
+  uint64_t trigger_tick_count;
+};
+
+// Values per deep capture item. v1, v2, followed in envelope mode by
+// min_v1, min_v2.
+inline uint8_t deep_capture_values_per_item(CaptureMode mode) {
+  return mode == CAPTURE_MODE_ENVELOPE ? 4 : 2;
+}
+
 // Max number of capture steps items. Stpes are captures at
 // a slow rate so a small number is suffient for the
 // UI to catch up considering the worst case screen update
@@ -93,6 +242,7 @@ struct State {
   State() :
       tick_count(0),
       ticks_with_errors(0),
+      lost_pairs(0),
       v1(0),
       v2(0),
       is_energized(false),
@@ -100,21 +250,30 @@ struct State {
       quadrant(0),
       is_reverse_direction(false),
       full_steps(0),
+      step_fraction(0),
       max_full_steps(0),
       max_retraction_steps(0),
       quadrature_errors(0),
       last_step_direction(UNKNOWN_DIRECTION),
       max_current_in_step(0),
-      ticks_in_step(0) { }
+      ticks_in_step(0),
+      stall_suspects(0),
+      last_stall_suspect_tick_count(0) { }
 
   // Number of ADC pair samples since last data reset. This is
   // also a proxy for the time passed. The number of time ticks
   // per second is TIME_TICKS_PER_SEC.
   uint64_t tick_count;
 
-  // Ticks that have the ADC error flag set.
+  // Ticks with no valid ADC pair, either bad pairs or lost pairs.
+  // Included in tick_count.
   uint32_t ticks_with_errors;
 
+  // Ticks of ADC pairs that were lost before reaching the analyzer,
+  // e.g. when the BLE load starves the acquisition and the DMA pool
+  // overflows. Included in ticks_with_errors.
+  uint32_t lost_pairs;
+
   // Signed current values in ADC count units.  When the stepper
   // is energized, these values together with the quadrant value
   // below can be used to compute the fractional step value.
@@ -139,6 +298,11 @@ struct State {
   // Total (forward - backward) full steps. This is a proxy
   // for the overall distance.
   int full_steps;
+  // Position within the current full step, in 1/256 step units, in
+  // the range [-128, 128]. Zero if not energized. The position in 1/256
+  // step units is full_steps * 256 + step_fraction. Updated once per
+  // DMA frame, from v1, v2 and quadrant, using fixed point math.
+  int16_t step_fraction;
   // Max value of full_steps so far. Momentary retraction value
   // can computed as max(0, max_full_steps - full_steps).
   int max_full_steps;
@@ -156,39 +320,277 @@ struct State {
   // Time in current state, in 100Khz ADC sample time unit. This is
   // a proxy for the time in current step.
   uint32_t ticks_in_step;
+  // Number of stall suspects, see StallEvent, and the tick_count of
+  // the last one, 0 if none.
+  uint32_t stall_suspects;
+  uint64_t last_stall_suspect_tick_count;
+};
+
+// A single step, recorded by the analyzer when it detects a transition
+// to the next or previous quadrant. Used to stream the individual step
+// timing to the BLE client.
+struct StepEvent {
+  // State::tick_count at the end of the step.
+  uint64_t tick_count;
+  // Consecutive events have consecutive sequence numbers. A gap
+  // indicates events that were dropped because the consumer was
+  // behind.
+  uint32_t seq_number;
+  // The values of State::ticks_in_step and State::max_current_in_step
+  // at the end of the step.
+  uint32_t ticks_in_step;
+  uint16_t max_current_in_step;
+  // The change in State::full_steps, +1 or -1.
+  int8_t increment;
+};
+
+// Why the steps of a stall suspect were anomalous. A bit mask.
+enum StallReason : uint8_t {
+  // Peak current well above the recent peak currents at that speed. A
+  // stalled rotor has no back EMF, so the driver's current rises.
+  STALL_REASON_PEAK_CURRENT = 0x01,
+  // Step duration jumped from the recent step durations, as when the
+  // rotor slips and catches again.
+  STALL_REASON_STEP_INTERVAL = 0x02,
+};
+
+// A suspected stall or missed steps, raised by the analyzer after a few
+// consecutive anomalous steps. A motor that stalls while the driver
+// keeps commutating still has clean quadrant sequences, so this is
+// based on the per step peak current and timing instead.
+struct StallEvent {
+  // State::tick_count at the end of the step that raised it.
+  uint64_t tick_count;
+  // State::stall_suspects including this one. A gap indicates events
+  // that were dropped because the consumer was behind.
+  uint32_t seq_number;
+  // StallReason bits of the anomalous steps.
+  uint8_t reasons;
+  // The last step, and the baselines it was compared to. In ADC counts
+  // and ADC ticks.
+  uint16_t peak_current;
+  uint16_t baseline_peak_current;
+  uint32_t ticks_in_step;
+  uint32_t baseline_ticks_in_step;
+};
+
+// Max bytes of encoded samples in a waveform block. Fits, with a
+// header, in a notification with the max MTU.
+constexpr uint16_t kWaveformBlockMaxBytes = 220;
+
+// A block of the compressed waveform stream. The stream carries every
+// n'th pair of v1, v2 values (see State), as selected with
+// set_waveform_stream(). Each sample is encoded as the zigzag varint
+// deltas of v1 and v2 from the previous sample of the block, the first
+// one from zero, such that each block can be decoded on its own.
+struct WaveformBlock {
+  // The State::tick_count of the first sample. The samples of a block
+  // are exactly decimation ticks apart.
+  uint64_t tick_count;
+  // Consecutive blocks have consecutive sequence numbers. A gap
+  // indicates blocks that were dropped because the consumer was
+  // behind.
+  uint32_t seq_number;
+  // Number of blocks dropped since boot, as of this block.
+  uint32_t dropped_blocks;
+  uint8_t decimation;
+  uint16_t num_samples;
+  uint16_t num_bytes;
+  uint8_t bytes[kWaveformBlockMaxBytes];
 };
 
 struct Histogram {
-  Histogram() { memset(buckets, 0, sizeof(buckets)); }
+  Histogram() { clear(); }
+  void clear() {
+    memset(buckets, 0, sizeof(buckets));
+    memset(peak_current_steps, 0, sizeof(peak_current_steps));
+  }
   // Histogram, each bucket represents a range of steps/sec speeds.
   HistogramBucket buckets[acq_consts::kNumHistogramBuckets];
+  // Steps by speed bucket and peak current bin. The peak current of a
+  // step in ADC counts, shifted by kPeakCurrentBinShift, is its bin,
+  // and the last bin also counts the higher currents. The counts
+  // saturate at UINT16_MAX, rather than wrap around, such that long
+  // runs keep the shape of the distribution.
+  uint16_t peak_current_steps[acq_consts::kNumHistogramBuckets]
+                             [acq_consts::kNumPeakCurrentBins];
+};
+
+// The histogram is also tracked in slices of one second, such that the
+// histogram of the last seconds is available without resetting the
+// histogram. This is the max number of slices a window can cover.
+constexpr int kMaxHistogramWindowSlices = 60;
+
+// The histogram of the last slices, see set_histogram_window(). Does
+// not include peak_current_steps.
+struct HistogramWindow {
+  HistogramWindow() : num_slices(0) { memset(buckets, 0, sizeof(buckets)); }
+  // The slices this window covers. Less than the window length until
+  // enough slices completed since the histogram was cleared.
+  uint8_t num_slices;
+  HistogramBucket buckets[acq_consts::kNumHistogramBuckets];
+};
+
+// Quantiles of the steps of a histogram bucket, from fixed memory
+// sketches of the steps since the last reset, within about 6% of the
+// actual values. All zero if the bucket has no steps. Shows the jitter
+// that the bucket totals average out.
+constexpr int kNumStepQuantiles = 3;
+constexpr uint16_t kStepQuantilesPerMille[kNumStepQuantiles] = {
+    500, 900, 990};
+
+struct StepQuantiles {
+  // In ADC ticks and ADC counts, for each of kStepQuantilesPerMille.
+  uint16_t ticks_in_step[kNumStepQuantiles];
+  uint16_t peak_current[kNumStepQuantiles];
+};
+
+struct StepQuantilesTable {
+  StepQuantiles buckets[acq_consts::kNumHistogramBuckets];
+};
+
+// How step speeds map to histogram buckets. Bucket i counts the steps
+// with speeds in [min_speeds[i], min_speeds[i + 1]) steps/sec, and the
+// last bucket also counts all the faster steps. min_speeds[0] is
+// always 0. Steps slower than kMinHistogramStepsPerSec are ignored.
+// Speeds are kTimeTicksPerSec / ticks_in_step, so a bucket that no
+// whole number of ticks falls in stays empty. The log and sparse
+// layouts reject such buckets.
+enum HistogramLayout : uint8_t {
+  // Buckets of param1 steps/sec.
+  HISTOGRAM_LAYOUT_LINEAR = 0,
+  // Log spaced buckets from param1 to param2 steps/sec. The first
+  // bucket is below param1.
+  HISTOGRAM_LAYOUT_LOG = 1,
+  // High resolution in a speed band of interest and sparse elsewhere.
+  // Buckets of param2 steps/sec from param1 on. The first bucket is
+  // below param1 and the last one is above the band.
+  HISTOGRAM_LAYOUT_SPARSE = 2,
+};
+
+struct HistogramLayoutSettings {
+  HistogramLayout layout;
+  uint16_t param1;
+  uint16_t param2;
 };
 
+constexpr uint32_t kMinHistogramStepsPerSec = 10;
+
+// The layout at startup. Can be set per deployment with a build flag,
+// e.g. -DANALYZER_HISTOGRAM_LAYOUT=1.
+//   0 - Linear, 200 steps/sec buckets (default).
+//   1 - Log, 50 to 10000 steps/sec.
+//   2 - Sparse, 25 steps/sec buckets from 500 steps/sec.
+#ifndef ANALYZER_HISTOGRAM_LAYOUT
+#define ANALYZER_HISTOGRAM_LAYOUT 0
+#endif
+
+#if ANALYZER_HISTOGRAM_LAYOUT == 0
+constexpr HistogramLayoutSettings kDefaultHistogramLayout = {
+    HISTOGRAM_LAYOUT_LINEAR, acq_consts::kBucketStepsPerSecond, 0};
+#elif ANALYZER_HISTOGRAM_LAYOUT == 1
+constexpr HistogramLayoutSettings kDefaultHistogramLayout = {
+    HISTOGRAM_LAYOUT_LOG, 50, 10000};
+#elif ANALYZER_HISTOGRAM_LAYOUT == 2
+constexpr HistogramLayoutSettings kDefaultHistogramLayout = {
+    HISTOGRAM_LAYOUT_SPARSE, 500, 25};
+#else
+#error "Unknown ANALYZER_HISTOGRAM_LAYOUT."
+#endif
+
 // Helpers for dumping aquisition sate. For debugging.
 void dump_state(const State& state);
 void dump_adc_capture_buffer(const AdcCaptureBuffer& adc_capture_buffer);
+// Dumps the counts of lock free sampling reads and retries.
+void dump_stats();
 
 // Called once during program initialization, before enabling
 // ADC interrupts.
 void setup(const nvs_config::AcquistionSettings& settings);
 
-void get_last_capture_snapshot(AdcCaptureBuffer* buffer);
+// Takes the last completed capture, and returns the previously taken
+// one to the acquisition. Lock free and without copying. The returned
+// buffer is linearized (see CircularBuffer::linear_items()) and stays
+// valid and unchanged until the next call. If no capture completed
+// since the last call, returns the same buffer again. Should be called
+// from a single task only.
+const AdcCaptureBuffer* take_last_capture_snapshot();
+
+// Returns the last items of a completed capture for the spectrum
+// analysis, or null if none is pending. Captures that complete while
+// one is pending are skipped, as are envelope mode and segmented
+// captures, whose items are not evenly spaced samples. The capture
+// stays valid until release_spectrum_capture() is called. Should be
+// called from a single task only.
+const SpectrumCapture* peek_spectrum_capture();
+void release_spectrum_capture();
 
 // Sample histogram. Does not resets or mutate the
-// histogram tracking.
+// histogram tracking. Lock free, does not block the acquisition.
+// Updated at most every 20ms, the state snapshot period.
 void sample_histogram(Histogram* histogram);
 
+// Sample the histogram of the last completed slices. Lock free, does
+// not block the acquisition. Updated once per slice.
+void sample_histogram_window(HistogramWindow* window);
+
+// Sets the number of slices of the histogram window, in [1,
+// kMaxHistogramWindowSlices]. Takes effect immediately, over the slices
+// completed so far. Returns false if out of range. Not persisted, the
+// default is kMaxHistogramWindowSlices.
+bool set_histogram_window(uint8_t num_slices);
+
+// Sample the step quantiles of all the histogram buckets. Lock free,
+// does not block the acquisition. Updated at most every 100ms.
+void sample_step_quantiles(StepQuantilesTable* table);
+
 // Sample capture steps items since last call to this function.
 // Returns a pointer to an internal buffer with the consumed
 // items, if any.
 const StepsCaptureBuffer* sample_steps_capture();
 
-// Sample the current state into given buffer.
+// Sample the current state into given buffer. Lock free, does not
+// block the acquisition. Reflects the acquisition as of the last
+// processed frame.
 void sample_state(State* state);
 
 // For notification. Blocking.
 bool pop_next_state(State* state);
 
+// Returns the oldest step event that was not popped yet. Non blocking.
+// Returns false if there are no pending events. Should be called by a
+// single task.
+bool pop_step_event(StepEvent* event);
+
+// Returns the oldest stall event that was not popped yet. Non blocking.
+// Returns false if there are no pending events. Should be called by a
+// single task.
+bool pop_stall_event(StallEvent* event);
+
+// Starts the waveform stream with every n'th sample, or stops it if
+// decimation is 0. max_block_bytes limits the encoded samples per
+// block, e.g. to fit the negotiated MTU, and is clipped to
+// kWaveformBlockMaxBytes. The block in progress is completed.
+void set_waveform_stream(uint8_t decimation, uint16_t max_block_bytes);
+
+// Returns the oldest completed waveform block, or null if none. The
+// block stays valid until release_waveform_block() is called. Non
+// blocking. Should be called by a single task.
+const WaveformBlock* peek_waveform_block();
+void release_waveform_block();
+
+// Sets the histogram layout and clears the histogram. Returns false if
+// the settings are invalid, e.g. buckets that are not increasing,
+// exceed 65535 steps/sec or, for the log and sparse layouts, that no
+// step can fill. Not persisted, the default is
+// kDefaultHistogramLayout.
+bool set_histogram_layout(const HistogramLayoutSettings& settings);
+
+// Returns the current layout and, if not null, the min speed of each
+// bucket in steps/sec.
+void get_histogram_layout(HistogramLayoutSettings* settings,
+    uint16_t min_speeds[acq_consts::kNumHistogramBuckets]);
+
 // Clears state and histogram data. This resets counters, min/max values,
 // histograms, etc. This does not reset the tick counter
 // which provides a consistent time base since initialization, nor the
@@ -211,6 +613,36 @@ bool get_is_reversed_direction();
 // Clipped internally to allowed range.
 void set_signal_capture_divider(uint8_t divider);
 
+// Returns false if the mode is invalid.
+bool set_signal_capture_mode(uint8_t mode);
+
+// Sets the number of capture segments, 1 for a regular capture, and
+// restarts the capture. The capture is ready when all the segments are
+// filled. Returns false if not in [1, kMaxCaptureSegments]. Not
+// persisted.
+bool set_capture_segments(uint8_t num_segments);
+
+// Sets the trigger and restarts the capture. Returns false if the
+// settings are invalid. Not persisted, the default is
+// kDefaultTriggerSettings.
+bool set_capture_trigger(const TriggerSettings& settings);
+
+void get_capture_trigger(TriggerSettings* settings);
+
+// Frees the current deep capture, if any, and arms a new one of up to
+// num_items items. The buffer is clipped to the heap that is available.
+// num_items of 0 just frees the buffer. Returns the item capacity of
+// the new capture. The divider and mode that are set while the capture
+// is armed or filled restart it. Should not be called concurrently with
+// reading the deep capture values.
+uint32_t arm_deep_capture(uint32_t num_items);
+
+// Samples the deep capture info and returns the values of its items,
+// see deep_capture_values_per_item(), or null if idle. Lock free, does
+// not block the acquisition. Items below info->size are valid and
+// don't change until the next arm_deep_capture().
+const int16_t* sample_deep_capture(DeepCaptureInfo* info);
+
 // Return a copy of the internal settings. Used after
 // calibrate_zeros() to save the current settings in the
 // EEPROM.
@@ -1,14 +1,46 @@
 // Private analyzer API for the ADC task.
 #pragma once
 
+#include <stdint.h>
 #include <string.h>
 
+#include "esp_adc/adc_continuous.h"
+
 namespace analyzer {
 
+// Pair classification counts of a frame.
+struct FrameStats {
+  // Pairs in the channel order 6, 7.
+  uint32_t good_67_pairs;
+  // Pairs in the channel order 7, 6.
+  uint32_t good_76_pairs;
+  // Pairs that don't have one value of each channel. Skipped.
+  uint32_t bad_pairs;
+};
+
 void enter_mutex();
 void exit_mutex();
 
+// Processes a DMA frame of num_pairs pairs of channel 6, 7 values,
+// in either order. Equivalent to calling isr_handle_one_sample() with
+// each good pair, but faster. Bad pairs are accounted for as in
+// isr_handle_lost_pairs(), except for lost_pairs. Adds the pair counts
+// to stats.
+void isr_handle_frame(const adc_digi_output_data_t* values,
+    uint16_t num_pairs, FrameStats* stats);
+
 void isr_handle_one_sample(const uint16_t raw_v1, const uint16_t raw_v2);
+
+// Accounts for num_pairs pairs that were lost before reaching the
+// analyzer, e.g. due to a DMA pool overflow, such that tick_count
+// stays a time base. They advance the tick driven counters and are
+// counted as ticks with errors. The signal captures have no items for
+// them, so their items are not evenly spaced around the gap.
+void isr_handle_lost_pairs(uint32_t num_pairs);
 void isr_snapshot_state();
 
+// Publishes the state, histogram, step quantiles and deep capture for
+// the sample_*() functions. Call after processing a frame.
+void isr_publish_data();
+
 }  // namespace analyzer
@@ -0,0 +1,46 @@
+// Fixed point CORDIC angle computation. Used to compute the fractional
+// step position in the acquisition path, without floating point.
+
+#pragma once
+
+#include <inttypes.h>
+
+namespace cordic {
+
+// A quarter turn (90 degrees, one full step) in angle units.
+constexpr uint32_t kQuarterTurn = 1 << 16;
+
+// atan(2^-i) in angle units.
+constexpr int32_t kAtanTable[] = {32768, 19344, 10221, 5188, 2604, 1303, 652,
+    326, 163, 81, 41, 20, 10, 5};
+
+constexpr int kIterations = sizeof(kAtanTable) / sizeof(kAtanTable[0]);
+
+// Returns the angle of the vector (x, y) in the range [0, kQuarterTurn],
+// with an error of a few units. x and y are 12 bit magnitudes. Returns
+// zero if both are zero.
+inline uint32_t quarter_turn_angle(uint16_t x, uint16_t y) {
+  // Scaled up to preserve precision in the shifts. The vector's
+  // length grows by up to 1.65 during the rotations, which still fits
+  // in 31 bits.
+  int32_t cx = ((int32_t)x) << 16;
+  int32_t cy = ((int32_t)y) << 16;
+  int32_t angle = 0;
+  // Rotate the vector toward the x axis, accumulating the rotation.
+  for (int i = 0; i < kIterations; i++) {
+    const int32_t dx = cx >> i;
+    const int32_t dy = cy >> i;
+    if (cy > 0) {
+      cx += dy;
+      cy -= dx;
+      angle += kAtanTable[i];
+    } else {
+      cx -= dy;
+      cy += dx;
+      angle -= kAtanTable[i];
+    }
+  }
+  return angle < 0 ? 0 : angle > (int32_t)kQuarterTurn ? kQuarterTurn : angle;
+}
+
+}  // namespace cordic
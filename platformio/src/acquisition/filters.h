@@ -1,4 +1,19 @@
-// First order ADC 12 bit signal filter.
+// ADC 12 bit signal filters.
+//
+// All the filters have the same interface, such that the analyzer can
+// select one at compile time:
+//
+//   uint16_t update(uint16_t adc_12_bit_value)
+//     Filters one sample and returns the filtered 12 bit value.
+//
+//   void update_block(uint16_t* values, uint16_t n)
+//     Filters n consecutive samples of the same channel, in place.
+//     Same results as calling update() on each of them, but keeps the
+//     filter state in registers for the duration of the block.
+//
+// Internally, each filter keeps its state in a Vars struct that is
+// updated by a static step() function, which allows DualChannelFilter
+// to interleave the two channels in a single loop.
 
 #pragma once
 
@@ -6,27 +21,188 @@
 
 namespace filters {
 
+// No filtering.
+class BypassFilter {
+ public:
+  struct Vars {};
+
+  inline uint16_t update(uint16_t adc_12_bit_value) {
+    return adc_12_bit_value;
+  }
+
+  inline void update_block(uint16_t* values, uint16_t n) {}
+
+  inline Vars& vars() { return vars_; }
+
+  static inline uint16_t step(uint16_t adc_12_bit_value, Vars* vars) {
+    return adc_12_bit_value;
+  }
+
+ private:
+  Vars vars_;
+};
+
+// First order IIR low pass filter.
+//
 // K is in the range (0, 1024). The higher the value of K, the more the filter
 // smooths the signal. We use fixed point integers for efficiency since
 // this filter is used by the acquisition interrut routine.
 template <uint32_t k>
 class Adc12BitsLowPassFilter {
  public:
-  Adc12BitsLowPassFilter() : scaled_12bit_value_(0 << 10) { }
+  struct Vars {
+    // The current value with additional 10 bits representing the
+    // fraction.
+    uint32_t scaled_12bit_value = 0;  // current value << 10
+  };
 
   // Accepts the new 12 bit sample and update and return the new
   // filter values.
   inline uint16_t update(uint16_t adc_12_bit_value) {
+    return step(adc_12_bit_value, &vars_);
+  }
+
+  inline void update_block(uint16_t* values, uint16_t n) {
+    Vars vars = vars_;
+    for (uint16_t i = 0; i < n; i++) {
+      values[i] = step(values[i], &vars);
+    }
+    vars_ = vars;
+  }
+
+  inline Vars& vars() { return vars_; }
+
+  static inline uint16_t step(uint16_t adc_12_bit_value, Vars* vars) {
     const uint32_t t1 = ((uint32_t)adc_12_bit_value) << 10;
-    const uint32_t t2 = (t1 * (1024 - k)) + (scaled_12bit_value_ * k);
-    scaled_12bit_value_ = t2 >> 10;
-    return scaled_12bit_value_ >> 10;
+    const uint32_t t2 = (t1 * (1024 - k)) + (vars->scaled_12bit_value * k);
+    vars->scaled_12bit_value = t2 >> 10;
+    return vars->scaled_12bit_value >> 10;
+  }
+
+ private:
+  Vars vars_;
+};
+
+// Average of the last two samples. A zero at half the sampling rate
+// and no feedback, so the cheapest filter that still removes sample
+// to sample noise.
+class Adc12BitsBoxcar2Filter {
+ public:
+  struct Vars {
+    uint16_t prev_value = 0;
+  };
+
+  inline uint16_t update(uint16_t adc_12_bit_value) {
+    return step(adc_12_bit_value, &vars_);
+  }
+
+  inline void update_block(uint16_t* values, uint16_t n) {
+    Vars vars = vars_;
+    for (uint16_t i = 0; i < n; i++) {
+      values[i] = step(values[i], &vars);
+    }
+    vars_ = vars;
+  }
+
+  inline Vars& vars() { return vars_; }
+
+  static inline uint16_t step(uint16_t adc_12_bit_value, Vars* vars) {
+    const uint16_t result = (adc_12_bit_value + vars->prev_value + 1) >> 1;
+    vars->prev_value = adc_12_bit_value;
+    return result;
+  }
+
+ private:
+  Vars vars_;
+};
+
+// Second order IIR filter, direct form I, with coefficients in Q14
+// fixed point, normalized such that a0 = 1. The internal values have
+// 2 additional fraction bits. The output is clipped to the 12 bits
+// range since the step response may overshoot.
+template <int32_t b0, int32_t b1, int32_t b2, int32_t a1, int32_t a2>
+class Adc12BitsBiquadFilter {
+  // Keeps the accumulator within 32 bits with some overshoot margin.
+  static_assert(b0 >= 0 && b1 >= 0 && b2 >= 0 && b0 + b1 + b2 <= 4 * 16384);
+  static_assert(-a1 <= 2 * 16384 && a1 <= 2 * 16384);
+  static_assert(-a2 <= 16384 && a2 <= 16384);
+
+ public:
+  // Previous inputs and outputs, with 2 fraction bits.
+  struct Vars {
+    int32_t x1 = 0;
+    int32_t x2 = 0;
+    int32_t y1 = 0;
+    int32_t y2 = 0;
+  };
+
+  inline uint16_t update(uint16_t adc_12_bit_value) {
+    Vars vars = vars_;
+    const uint16_t result = step(adc_12_bit_value, &vars);
+    vars_ = vars;
+    return result;
+  }
+
+  inline void update_block(uint16_t* values, uint16_t n) {
+    Vars vars = vars_;
+    for (uint16_t i = 0; i < n; i++) {
+      values[i] = step(values[i], &vars);
+    }
+    vars_ = vars;
+  }
+
+  inline Vars& vars() { return vars_; }
+
+  static inline uint16_t step(uint16_t adc_12_bit_value, Vars* vars) {
+    const int32_t x0 = ((int32_t)adc_12_bit_value) << 2;
+    const int32_t acc = (b0 * x0) + (b1 * vars->x1) + (b2 * vars->x2) -
+        (a1 * vars->y1) - (a2 * vars->y2);
+    const int32_t y0 = (acc + (1 << 13)) >> 14;
+    vars->x2 = vars->x1;
+    vars->x1 = x0;
+    vars->y2 = vars->y1;
+    vars->y1 = y0;
+    const int32_t result = (y0 + 2) >> 2;
+    return result < 0 ? 0 : result > 4095 ? 4095 : result;
+  }
+
+ private:
+  Vars vars_;
+};
+
+// Butterworth low pass with a 2.5kHz cutoff at 40k samples per second,
+// about the same cutoff as Adc12BitsLowPassFilter<700> but with a
+// 40dB/decade rolloff. Unity DC gain.
+using Adc12BitsButterworthFilter =
+    Adc12BitsBiquadFilter<491, 982, 491, -23826, 9406>;
+
+// A pair of filters, one per signal.
+template <class F>
+class DualChannelFilter {
+ public:
+  inline void update(
+      uint16_t* adc_12_bit_value1, uint16_t* adc_12_bit_value2) {
+    *adc_12_bit_value1 = filter1_.update(*adc_12_bit_value1);
+    *adc_12_bit_value2 = filter2_.update(*adc_12_bit_value2);
+  }
+
+  // Filters n pairs of samples, in place. The two channels are
+  // stepped in the same loop since their computations are independent
+  // and can overlap.
+  inline void update_block(uint16_t* values1, uint16_t* values2, uint16_t n) {
+    typename F::Vars vars1 = filter1_.vars();
+    typename F::Vars vars2 = filter2_.vars();
+    for (uint16_t i = 0; i < n; i++) {
+      values1[i] = F::step(values1[i], &vars1);
+      values2[i] = F::step(values2[i], &vars2);
+    }
+    filter1_.vars() = vars1;
+    filter2_.vars() = vars2;
   }
 
  private:
-  // The current value with additional 10 bits representing the
-  // fraction.
-  uint32_t scaled_12bit_value_;  // current value << 10
+  F filter1_;
+  F filter2_;
 };
 
 }  // namespace filters
@@ -0,0 +1,112 @@
+#include "profiler.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+namespace profiler {
+
+static constexpr auto TAG = "profiler";
+
+// Protects stage_stats.
+static SemaphoreHandle_t stats_mutex;
+static StageStats stage_stats[kNumStages];
+
+static const char* kStageNames[kNumStages] = {
+    "frame",
+    "pair_validation",
+    "filter",
+    "capture",
+    "decoding",
+    "histogram",
+    "snapshot",
+    "acquire",
+    "trigger",
+};
+
+const char* stage_name(Stage stage) {
+  return (stage >= 0 && stage < kNumStages) ? kStageNames[stage] : "?";
+}
+
+// Called with the stats mutex held.
+static void clear_stats() {
+  memset(stage_stats, 0, sizeof(stage_stats));
+  for (int i = 0; i < kNumStages; i++) {
+    stage_stats[i].min_cycles = UINT32_MAX;
+  }
+}
+
+void setup() {
+  stats_mutex = xSemaphoreCreateMutex();
+  assert(stats_mutex);
+  clear_stats();
+}
+
+void reset() {
+  xSemaphoreTake(stats_mutex, portMAX_DELAY);
+  { clear_stats(); }
+  xSemaphoreGive(stats_mutex);
+}
+
+void get_stage_stats(Stage stage, StageStats* stats) {
+  assert(stage >= 0 && stage < kNumStages);
+  xSemaphoreTake(stats_mutex, portMAX_DELAY);
+  { *stats = stage_stats[stage]; }
+  xSemaphoreGive(stats_mutex);
+  // Normalize the min of an empty stage.
+  if (!stats->count) {
+    stats->min_cycles = 0;
+  }
+}
+
+void dump_stats() {
+  StageStats stats;
+  for (int i = 0; i < kNumStages; i++) {
+    get_stage_stats((Stage)i, &stats);
+    ESP_LOGI(TAG, "%-16s n:%lu min:%lu mean:%lu max:%lu", kStageNames[i],
+        stats.count, stats.min_cycles,
+        stats.count ? (uint32_t)(stats.total_cycles / stats.count) : 0,
+        stats.max_cycles);
+  }
+}
+
+#if ANALYZER_PROFILER
+
+uint32_t isr_frame_cycles[kNumStages] = {};
+
+// Index of the log2 bucket of the given cycles.
+static inline int bucket_index(uint32_t cycles) {
+  if (cycles <= 1) {
+    return 0;
+  }
+  const int log2 = 31 - __builtin_clz(cycles);
+  return log2 < kNumBuckets ? log2 : kNumBuckets - 1;
+}
+
+void isr_end_frame() {
+  xSemaphoreTake(stats_mutex, portMAX_DELAY);
+  {
+    for (int i = 0; i < kNumStages; i++) {
+      const uint32_t cycles = isr_frame_cycles[i];
+      StageStats& stats = stage_stats[i];
+      stats.count++;
+      stats.total_cycles += cycles;
+      if (cycles < stats.min_cycles) {
+        stats.min_cycles = cycles;
+      }
+      if (cycles > stats.max_cycles) {
+        stats.max_cycles = cycles;
+      }
+      stats.buckets[bucket_index(cycles)]++;
+    }
+  }
+  xSemaphoreGive(stats_mutex);
+  memset(isr_frame_cycles, 0, sizeof(isr_frame_cycles));
+}
+
+#endif
+
+}  // namespace profiler
@@ -0,0 +1,118 @@
+// CPU cycles profiler of the acquisition path.
+//
+// The acquisition code accumulates the cycles of each stage of a frame
+// with the PROFILER_XXX() macros below, and the adc task records them
+// once per frame with isr_end_frame(). For each stage the profiler
+// keeps the min, max and mean cycles per frame and a log2 histogram,
+// which are exposed over BLE. This allows to see the worst case frame
+// cost in the field.
+//
+// The instrumentation can be removed at compile time with
+// -DANALYZER_PROFILER=0, in which case the stats stay empty.
+
+#pragma once
+
+#include <stdint.h>
+
+#ifndef ANALYZER_PROFILER
+#define ANALYZER_PROFILER 1
+#endif
+
+#if ANALYZER_PROFILER
+#include "esp_cpu.h"
+#endif
+
+namespace profiler {
+
+enum Stage {
+  // The entire processing of a frame, including all the stages below.
+  STAGE_FRAME = 0,
+  // Sorting the frame values into channel pairs.
+  STAGE_PAIR_VALIDATION,
+  // Signal filtering.
+  STAGE_FILTER,
+  // ADC signal capture, excluding the trigger.
+  STAGE_CAPTURE,
+  // Energized detection, quadrant decoding and steps tracking.
+  STAGE_DECODING,
+  // Adding steps to the histogram.
+  STAGE_HISTOGRAM,
+  // Publishing and snapshotting the state.
+  STAGE_SNAPSHOT,
+  // Getting the frame from the ADC driver, excluding the wait for it.
+  // The read and its copy, or the zero copy handoff (ADC_ZERO_COPY).
+  // Not included in STAGE_FRAME.
+  STAGE_ACQUIRE,
+  // Evaluating the capture trigger, once per captured item while
+  // waiting for a trigger.
+  STAGE_TRIGGER,
+  kNumStages
+};
+
+// Bucket i counts frames with [2^i, 2^(i+1)) cycles. The first bucket
+// also counts zero cycles and the last one counts everything above.
+// At 240Mhz, the last bucket starts at 2.2ms, above the 1.25ms of a
+// frame.
+constexpr int kNumBuckets = 20;
+
+struct StageStats {
+  // Number of frames recorded.
+  uint32_t count;
+  uint32_t min_cycles;
+  uint32_t max_cycles;
+  uint64_t total_cycles;
+  uint32_t buckets[kNumBuckets];
+};
+
+const char* stage_name(Stage stage);
+
+void setup();
+// Clears the stats of all the stages.
+void reset();
+void get_stage_stats(Stage stage, StageStats* stats);
+void dump_stats();
+
+#if ANALYZER_PROFILER
+
+// Cycles of each stage of the current frame. Accessed by the
+// acquisition task only.
+extern uint32_t isr_frame_cycles[kNumStages];
+
+// Records isr_frame_cycles as a single frame and clears them. Called
+// by the adc task, not under the analyzer's mutex.
+void isr_end_frame();
+
+// Declares a variable with the current cycle count.
+#define PROFILER_START(var) const uint32_t var = esp_cpu_get_cycle_count()
+
+// Adds the cycles since PROFILER_START(var) to a stage.
+#define PROFILER_ADD(stage, var) \
+  profiler::isr_frame_cycles[stage] += esp_cpu_get_cycle_count() - (var)
+
+// The cycles since PROFILER_START(var).
+#define PROFILER_ELAPSED(var) (esp_cpu_get_cycle_count() - (var))
+
+// Adds cycles that were measured with PROFILER_ELAPSED() to a stage.
+#define PROFILER_ADD_CYCLES(stage, cycles) \
+  profiler::isr_frame_cycles[stage] += (cycles)
+
+// Same as PROFILER_ADD() but also moves the cycles out of an enclosing
+// stage, such that the enclosing stage reports only its own cycles.
+#define PROFILER_ADD_NESTED(stage, outer_stage, var)            \
+  {                                                              \
+    const uint32_t cycles = esp_cpu_get_cycle_count() - (var);   \
+    profiler::isr_frame_cycles[stage] += cycles;                 \
+    profiler::isr_frame_cycles[outer_stage] -= cycles;           \
+  }
+
+#else
+
+#define PROFILER_START(var)
+#define PROFILER_ADD(stage, var)
+#define PROFILER_ELAPSED(var) 0
+#define PROFILER_ADD_CYCLES(stage, cycles)
+#define PROFILER_ADD_NESTED(stage, outer_stage, var)
+
+#endif
+
+}  // namespace profiler
@@ -0,0 +1,179 @@
+#include "spectrum.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+namespace spectrum {
+
+// The windowed samples are scaled up by this number of bits such that
+// 12 bit signals use most of the Q15 range. With the Hann window's
+// coherent gain of 1/2 and the 1/kFftSize scaling of fft(), the bin of
+// a sine with amplitude A is then A.
+static constexpr int kInputShift = 2;
+static constexpr int32_t kMaxInput = (1 << 14) - 1;
+
+// Channels with a weaker fundamental, in ADC counts, are reported as
+// having no signal, rather than the frequency of the noise.
+static constexpr uint32_t kMinFundamentalAmplitude = 16;
+
+// The harmonic amplitudes sum the power of this number of bins on each
+// side of the harmonic, most of the main lobe of the Hann window, such
+// that they hardly depend on the harmonic's position within a bin. A
+// wider sum would overlap the fundamental at low frequencies.
+static constexpr int kHarmonicHalfBins = 1;
+
+// cos(2 * pi * k / kFftSize) in Q15, for k in [0, kFftSize).
+static inline int32_t cos_q15(int k) {
+  k = k <= kFftSize / 2 ? k : kFftSize - k;
+  return k <= kFftSize / 4 ? kQuarterSineTable[kFftSize / 4 - k]
+                           : -kQuarterSineTable[k - kFftSize / 4];
+}
+
+// sin(2 * pi * k / kFftSize) in Q15, for k in [0, kFftSize / 2].
+static inline int32_t sin_q15(int k) {
+  return k <= kFftSize / 4 ? kQuarterSineTable[k]
+                           : kQuarterSineTable[kFftSize / 2 - k];
+}
+
+static uint32_t isqrt(uint64_t value) {
+  uint64_t result = 0;
+  uint64_t bit = (uint64_t)1 << 62;
+  while (bit > value) {
+    bit >>= 2;
+  }
+  while (bit) {
+    if (value >= result + bit) {
+      value -= result + bit;
+      result = (result >> 1) + bit;
+    } else {
+      result >>= 1;
+    }
+    bit >>= 2;
+  }
+  return (uint32_t)result;
+}
+
+static inline uint16_t saturated_uint16(uint32_t value) {
+  return std::min<uint32_t>(value, UINT16_MAX);
+}
+
+// Decimation in time. The complex magnitudes never grow, since each
+// butterfly halves its sums, so the values stay within the input's
+// range.
+void fft(int16_t* re, int16_t* im) {
+  // Bit reversal permutation.
+  for (int i = 1, j = 0; i < kFftSize; i++) {
+    int bit = kFftSize >> 1;
+    for (; j & bit; bit >>= 1) {
+      j ^= bit;
+    }
+    j ^= bit;
+    if (i < j) {
+      std::swap(re[i], re[j]);
+      std::swap(im[i], im[j]);
+    }
+  }
+
+  for (int len = 2; len <= kFftSize; len <<= 1) {
+    const int half = len >> 1;
+    const int twiddle_step = kFftSize / len;
+    for (int k = 0; k < half; k++) {
+      // exp(-2 * pi * i * k / len).
+      const int32_t c = cos_q15(k * twiddle_step);
+      const int32_t s = sin_q15(k * twiddle_step);
+      for (int i = k; i < kFftSize; i += len) {
+        const int j = i + half;
+        const int32_t tr = (re[j] * c + im[j] * s + (1 << 14)) >> 15;
+        const int32_t ti = (im[j] * c - re[j] * s + (1 << 14)) >> 15;
+        re[j] = (re[i] - tr) >> 1;
+        im[j] = (im[i] - ti) >> 1;
+        re[i] = (re[i] + tr) >> 1;
+        im[i] = (im[i] + ti) >> 1;
+      }
+    }
+  }
+}
+
+void analyze(const int16_t* samples, uint32_t samples_per_sec, int16_t* re,
+    int16_t* im, ChannelSpectrum* result) {
+  memset(result, 0, sizeof(*result));
+
+  // Remove the DC component, which would otherwise leak into the low
+  // bins, and apply a periodic Hann window.
+  int32_t sum = 0;
+  for (int i = 0; i < kFftSize; i++) {
+    sum += samples[i];
+  }
+  const int32_t mean = sum / kFftSize;
+  for (int i = 0; i < kFftSize; i++) {
+    const int32_t window = (32768 - cos_q15(i)) >> 1;
+    const int32_t value =
+        ((samples[i] - mean) * window) >> (15 - kInputShift);
+    re[i] = std::clamp(value, -kMaxInput, kMaxInput);
+    im[i] = 0;
+  }
+
+  fft(re, im);
+
+  auto power = [&](int k) -> uint32_t {
+    return re[k] * re[k] + im[k] * im[k];
+  };
+
+  // The fundamental is the strongest bin, excluding DC.
+  int peak = 1;
+  for (int k = 2; k < kFftSize / 2; k++) {
+    if (power(k) > power(peak)) {
+      peak = k;
+    }
+  }
+  const uint32_t a = isqrt(power(peak - 1));
+  const uint32_t b = isqrt(power(peak));
+  const uint32_t c = isqrt(power(peak + 1));
+  if (b < kMinFundamentalAmplitude) {
+    return;
+  }
+
+  // Position of the fundamental in 1/256 bins, from the ratio of the
+  // peak bin and its larger neighbour. Exact for a pure sine with the
+  // Hann window (Grandke's interpolation).
+  int32_t delta = 0;
+  if (c >= a) {
+    delta = 256 * ((int32_t)(2 * c) - (int32_t)b) / (int32_t)(c + b);
+    delta = std::clamp<int32_t>(delta, 0, 128);
+  } else {
+    delta = -256 * ((int32_t)(2 * a) - (int32_t)b) / (int32_t)(a + b);
+    delta = std::clamp<int32_t>(delta, -128, 0);
+  }
+  const uint32_t position = peak * 256 + delta;
+  result->fundamental_millihz = (uint32_t)((uint64_t)position *
+      samples_per_sec * 1000 / (kFftSize * 256));
+
+  // The sum of the main lobe's bin powers of a sine with amplitude A
+  // is 3/2 A^2, within 2% regardless of its position within a bin.
+  uint64_t harmonics_power = 0;
+  for (int h = 0; h < kNumHarmonics; h++) {
+    const int center = ((h + 1) * position + 128) >> 8;
+    if (center + kHarmonicHalfBins >= kFftSize / 2) {
+      break;
+    }
+    uint64_t lobe_power = 0;
+    for (int k = std::max(1, center - kHarmonicHalfBins);
+         k <= center + kHarmonicHalfBins; k++) {
+      lobe_power += power(k);
+    }
+    const uint32_t amplitude = isqrt(lobe_power * 2 / 3);
+    result->harmonic_amplitudes[h] = saturated_uint16(amplitude);
+    if (h > 0) {
+      harmonics_power += (uint64_t)amplitude * amplitude;
+    }
+  }
+
+  const uint32_t fundamental = result->harmonic_amplitudes[0];
+  if (fundamental) {
+    result->thd_per_mille =
+        saturated_uint16(isqrt(harmonics_power) * 1000 / fundamental);
+  }
+}
+
+}  // namespace spectrum
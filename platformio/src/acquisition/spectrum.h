@@ -0,0 +1,59 @@
+// Fixed point spectrum analysis of the captured coil currents. Computes
+// the fundamental electrical frequency, the amplitudes of its first
+// harmonics and the total harmonic distortion of a channel, such that
+// clients can poll a small summary rather than transfer and FFT the
+// captures themselves. Not for ISR use, see spectrum_task.h.
+
+#pragma once
+
+#include <inttypes.h>
+
+namespace spectrum {
+
+// Number of samples per FFT. A power of 2.
+constexpr int kLog2FftSize = 8;
+constexpr int kFftSize = 1 << kLog2FftSize;
+
+// Number of harmonics in the summary, including the fundamental.
+constexpr int kNumHarmonics = 8;
+
+// sin(2 * pi * k / kFftSize) in Q15, for k in [0, kFftSize / 4].
+constexpr int16_t kQuarterSineTable[] = {0, 804, 1608, 2410, 3212, 4011,
+    4808, 5602, 6393, 7179, 7962, 8739, 9512, 10278, 11039, 11793, 12539,
+    13279, 14010, 14732, 15446, 16151, 16846, 17530, 18204, 18868, 19519,
+    20159, 20787, 21403, 22005, 22594, 23170, 23731, 24279, 24811, 25329,
+    25832, 26319, 26790, 27245, 27683, 28105, 28510, 28898, 29268, 29621,
+    29956, 30273, 30571, 30852, 31113, 31356, 31580, 31785, 31971, 32137,
+    32285, 32412, 32521, 32609, 32678, 32728, 32757, 32767};
+
+static_assert(sizeof(kQuarterSineTable) / sizeof(kQuarterSineTable[0]) ==
+    kFftSize / 4 + 1);
+
+// The spectrum summary of a channel.
+struct ChannelSpectrum {
+  // Frequency of the fundamental, in mHz. 0 if the channel has no
+  // signal.
+  uint32_t fundamental_millihz;
+  // Amplitude of the fundamental, [0], and of its harmonics, in ADC
+  // counts. 0 for harmonics above the Nyquist frequency.
+  uint16_t harmonic_amplitudes[kNumHarmonics];
+  // Total harmonic distortion, in per mille of the fundamental.
+  uint16_t thd_per_mille;
+};
+
+// In place radix-2 FFT of kFftSize complex Q15 values. Each stage
+// scales by 1/2 to avoid overflows, so the result is the transform
+// divided by kFftSize.
+void fft(int16_t* re, int16_t* im);
+
+// Analyzes kFftSize samples of a channel, in ADC counts, with the
+// given sample rate. re and im are work buffers of kFftSize values.
+// The frequency resolution is samples_per_sec / kFftSize. The samples
+// should span at least 5 cycles of the fundamental, otherwise its
+// leakage inflates the 2nd harmonic. E.g. with 40k samples/sec, above
+// 800Hz, a full step rate of 3200 steps/sec. Slower moves need a
+// larger capture divider.
+void analyze(const int16_t* samples, uint32_t samples_per_sec, int16_t* re,
+    int16_t* im, ChannelSpectrum* result);
+
+}  // namespace spectrum
@@ -0,0 +1,70 @@
+#include "spectrum_task.h"
+
+#include "acq_consts.h"
+#include "analyzer.h"
+#include "esp_cpu.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "misc/seqlock.h"
+
+namespace spectrum_task {
+
+static constexpr auto TAG = "spectrum_task";
+
+static_assert(analyzer::kSpectrumCaptureItems == spectrum::kFftSize);
+
+// Bounds the analysis rate, and thus its CPU load, regardless of the
+// capture rate. Captures that complete in between are skipped.
+static constexpr uint32_t kPollPeriodMs = 100;
+
+// Below the BLE tasks, such that the analysis never delays them.
+static constexpr UBaseType_t kTaskPriority = 2;
+
+// Accessed only by the spectrum task.
+static int16_t work_re[spectrum::kFftSize];
+static int16_t work_im[spectrum::kFftSize];
+static CaptureSpectrum result;
+
+static SeqLock<CaptureSpectrum> published_spectrum;
+
+static void spectrum_task(void* ignored) {
+  for (;;) {
+    vTaskDelay(pdMS_TO_TICKS(kPollPeriodMs));
+
+    const analyzer::SpectrumCapture* capture =
+        analyzer::peek_spectrum_capture();
+    if (!capture) {
+      continue;
+    }
+    const uint32_t start_cycles = esp_cpu_get_cycle_count();
+    const uint32_t samples_per_sec =
+        acq_consts::kTimeTicksPerSec / capture->divider;
+    spectrum::analyze(
+        capture->v1, samples_per_sec, work_re, work_im, &result.channels[0]);
+    spectrum::analyze(
+        capture->v2, samples_per_sec, work_re, work_im, &result.channels[1]);
+    result.seq_number++;
+    result.capture_seq_number = capture->seq_number;
+    result.capture_divider = capture->divider;
+    analyzer::release_spectrum_capture();
+    result.analysis_cycles = esp_cpu_get_cycle_count() - start_cycles;
+
+    published_spectrum.write(result);
+  }
+}
+
+void setup() {
+  TaskHandle_t task_handle = nullptr;
+  xTaskCreate(spectrum_task, "SPECTRUM", 3000, nullptr, kTaskPriority,
+      &task_handle);
+  configASSERT(task_handle);
+  ESP_LOGI(TAG, "Spectrum analysis of %d items per capture.",
+      spectrum::kFftSize);
+}
+
+void sample_spectrum(CaptureSpectrum* spectrum) {
+  published_spectrum.read(spectrum);
+}
+
+}  // namespace spectrum_task
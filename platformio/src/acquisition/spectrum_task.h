@@ -0,0 +1,31 @@
+// A low priority task that runs the spectrum analysis, see spectrum.h,
+// on the completed signal captures and publishes a summary of each
+// channel. Clients can poll the summary rather than transfer and FFT
+// the captures.
+
+#pragma once
+
+#include <stdint.h>
+
+#include "spectrum.h"
+
+namespace spectrum_task {
+
+struct CaptureSpectrum {
+  // Number of analyzed captures since boot, 0 if none yet.
+  uint32_t seq_number;
+  // Of the analyzed capture, see analyzer::AdcCaptureBuffer.
+  uint16_t capture_seq_number;
+  uint8_t capture_divider;
+  // CPU cycles of the analysis of both channels.
+  uint32_t analysis_cycles;
+  // Of v1 and v2.
+  spectrum::ChannelSpectrum channels[2];
+};
+
+void setup();
+
+// Sample the summary of the last analyzed capture. Lock free.
+void sample_spectrum(CaptureSpectrum* spectrum);
+
+}  // namespace spectrum_task
@@ -15,11 +15,16 @@
 #include "freertos/event_groups.h"
 #include "freertos/semphr.h"
 #include "freertos/task.h"
+#include "sdkconfig.h"
 
 #include "acquisition/acq_consts.h"
+#include "acquisition/adc_task.h"
 #include "acquisition/analyzer.h"
+#include "acquisition/profiler.h"
+#include "acquisition/spectrum_task.h"
 #include "ble_util.h"
 #include "misc/util.h"
+#include "misc/zigzag_varint.h"
 #include "settings/controls.h"
 
 // Based on the sexample at
@@ -48,6 +53,8 @@ static SemaphoreHandle_t protected_vars_mutex;
 // the client so can be in practice lower that this max.
 static constexpr uint16_t kMaxRequestedMtu = 247;
 static constexpr uint16_t kMtuOverhead = 3;
+// Length of the waveform notification header, see waveform_task().
+static constexpr uint16_t kWaveformHeaderLen = 18;
 
 // Invalid connection id (0xffff);
 constexpr uint16_t kInvalidConnId = -1;
@@ -65,6 +72,14 @@ static const uint8_t time_histogram_uuid[] = {ENCODE_UUID_16(0xff04)};
 static const uint8_t distance_histogram_uuid[] = {ENCODE_UUID_16(0xff05)};
 static const uint8_t command_uuid[] = {ENCODE_UUID_16(0xff06)};
 static const uint8_t capture_uuid[] = {ENCODE_UUID_16(0xff07)};
+static const uint8_t step_events_uuid[] = {ENCODE_UUID_16(0xff08)};
+static const uint8_t diagnostics_uuid[] = {ENCODE_UUID_16(0xff09)};
+static const uint8_t profiler_uuid[] = {ENCODE_UUID_16(0xff0a)};
+static const uint8_t waveform_uuid[] = {ENCODE_UUID_16(0xff0b)};
+static const uint8_t current_heatmap_uuid[] = {ENCODE_UUID_16(0xff0c)};
+static const uint8_t step_quantiles_uuid[] = {ENCODE_UUID_16(0xff0d)};
+static const uint8_t stall_events_uuid[] = {ENCODE_UUID_16(0xff0e)};
+static const uint8_t capture_spectrum_uuid[] = {ENCODE_UUID_16(0xff0f)};
 
 // The length of constructed adv and scan respn data must be
 // less than 31 bytes. For this reason we split the device
@@ -130,11 +145,41 @@ struct Vars {
   uint16_t conn_mtu = 0;
   analyzer::State stepper_state_buffer = {};
   analyzer::Histogram histogram_buffer = {};
+  analyzer::HistogramWindow histogram_window_buffer = {};
+  // True if the histogram reads return the histogram window rather
+  // than the histogram since the last reset. Selected per connection
+  // by the host.
+  bool histogram_window_selected = false;
   // Number of capture points already read from the current
   // snapshot. Resets each time a new snapshot is taken.
-  // Sould be in [0, adc_capture_snapshot.items.size()].
+  // Sould be in [0, adc_capture_snapshot->items.size()].
   uint16_t adc_capture_items_read_so_far = 0;
-  analyzer::AdcCaptureBuffer adc_capture_snapshot;
+  // Owned by us until the next snapshot is taken. Null if no
+  // snapshot was taken yet.
+  const analyzer::AdcCaptureBuffer* adc_capture_snapshot = nullptr;
+  // The format of the capture snapshot reads, 0x40 or 0x42. Selected
+  // per connection by the host.
+  uint8_t capture_format = 0x40;
+  // True if capture reads return the deep capture rather than the
+  // snapshot.
+  bool deep_capture_selected = false;
+  // Index of the next deep capture item to read.
+  uint32_t deep_capture_read_index = 0;
+  // The profiler stage to return in the next profiler read.
+  uint8_t profiler_next_stage = 0;
+  // The heatmap snapshot that is read in pages, and the row of its next
+  // page. A new snapshot is taken when the next row is 0.
+  analyzer::Histogram heatmap_snapshot = {};
+  uint8_t heatmap_next_row = 0;
+  // Incremented on each heatmap snapshot.
+  uint16_t heatmap_seq_number = 0;
+  // The step quantiles snapshot that is read in pages, and the
+  // histogram bucket of its next page. A new snapshot is taken when the
+  // next bucket is 0.
+  analyzer::StepQuantilesTable step_quantiles_snapshot = {};
+  uint8_t step_quantiles_next_bucket = 0;
+  // Buffer for the capture spectrum reads.
+  spectrum_task::CaptureSpectrum capture_spectrum_buffer = {};
   esp_gatt_rsp_t rsp = {};
 };
 
@@ -147,6 +192,14 @@ struct ProtextedVars {
   // Set per connection.
   uint16_t conn_id = kInvalidConnId;
   bool state_notifications_enabled = false;
+  bool step_events_notifications_enabled = false;
+  bool waveform_notifications_enabled = false;
+  bool stall_events_notifications_enabled = false;
+  // True while the BLE stack reports that the connection is congested.
+  bool congested = false;
+  // The negotiated MTU. Same as vars.conn_mtu but accessible to other
+  // tasks.
+  uint16_t conn_mtu = 0;
   // Track the optional connection WDT feature.
   // WDT is disabled if conn_wdt_period_millis is zero.
   uint32_t conn_wdt_period_millis = 0;
@@ -171,12 +224,16 @@ static const uint8_t kChrConfigDeclUuid[] = {
 static const uint8_t kChrPropertyReadNotify =
     ESP_GATT_CHAR_PROP_BIT_READ | ESP_GATT_CHAR_PROP_BIT_NOTIFY;
 static const uint8_t kChrPropertyReadOnly = ESP_GATT_CHAR_PROP_BIT_READ;
+static const uint8_t kChrPropertyNotifyOnly = ESP_GATT_CHAR_PROP_BIT_NOTIFY;
 // Caller can either use write request with or without response.
 static const uint8_t kChrPropertyWriteOptionalResponse =
     ESP_GATT_CHAR_PROP_BIT_WRITE_NR | ESP_GATT_CHAR_PROP_BIT_WRITE;
 
 // TODO: what does it do?
 static uint8_t state_ccc_val[2] = {};
+static uint8_t step_events_ccc_val[2] = {};
+static uint8_t waveform_ccc_val[2] = {};
+static uint8_t stall_events_ccc_val[2] = {};
 
 // TODO: why do we need this?
 static uint8_t command_val[1] = {};
@@ -227,6 +284,33 @@ enum {
   ATTR_IDX_CAPTURE,
   ATTR_IDX_CAPTURE_VAL,
 
+  ATTR_IDX_STEP_EVENTS,
+  ATTR_IDX_STEP_EVENTS_VAL,
+  ATTR_IDX_STEP_EVENTS_CCC,
+
+  ATTR_IDX_DIAGNOSTICS,
+  ATTR_IDX_DIAGNOSTICS_VAL,
+
+  ATTR_IDX_PROFILER,
+  ATTR_IDX_PROFILER_VAL,
+
+  ATTR_IDX_WAVEFORM,
+  ATTR_IDX_WAVEFORM_VAL,
+  ATTR_IDX_WAVEFORM_CCC,
+
+  ATTR_IDX_CURRENT_HEATMAP,
+  ATTR_IDX_CURRENT_HEATMAP_VAL,
+
+  ATTR_IDX_STEP_QUANTILES,
+  ATTR_IDX_STEP_QUANTILES_VAL,
+
+  ATTR_IDX_STALL_EVENTS,
+  ATTR_IDX_STALL_EVENTS_VAL,
+  ATTR_IDX_STALL_EVENTS_CCC,
+
+  ATTR_IDX_CAPTURE_SPECTRUM,
+  ATTR_IDX_CAPTURE_SPECTRUM_VAL,
+
   ATTR_IDX_COUNT,  // Attributes count.
 };
 
@@ -359,6 +443,112 @@ static const esp_gatts_attr_db_t attr_table[ATTR_IDX_COUNT] = {
     [ATTR_IDX_CAPTURE_VAL] = {{ESP_GATT_RSP_BY_APP},
         {LEN_BYTES(capture_uuid), ESP_GATT_PERM_READ, 0, 0, nullptr}},
 
+    // ----- Step events. Notification only.
+    //
+    // Characteristic
+    [ATTR_IDX_STEP_EVENTS] = {{ESP_GATT_AUTO_RSP},
+        {LEN_BYTES(kCharDeclUuid), ESP_GATT_PERM_READ,
+            LEN_LEN_BYTES(kChrPropertyNotifyOnly)}},
+    // Value
+    [ATTR_IDX_STEP_EVENTS_VAL] = {{ESP_GATT_RSP_BY_APP},
+        {LEN_BYTES(step_events_uuid), ESP_GATT_PERM_READ, 0, 0, nullptr}},
+
+    // Client Characteristic Configuration Descriptor
+    [ATTR_IDX_STEP_EVENTS_CCC] = {{ESP_GATT_AUTO_RSP},
+        {LEN_BYTES(kChrConfigDeclUuid),
+            ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE,
+            LEN_LEN_BYTES(step_events_ccc_val)}},
+
+    // ----- Acquisition diagnostics.
+    //
+    // Characteristic
+    [ATTR_IDX_DIAGNOSTICS] = {{ESP_GATT_AUTO_RSP},
+        {LEN_BYTES(kCharDeclUuid), ESP_GATT_PERM_READ,
+            LEN_LEN_BYTES(kChrPropertyReadOnly)}},
+
+    // Value
+    [ATTR_IDX_DIAGNOSTICS_VAL] = {{ESP_GATT_RSP_BY_APP},
+        {LEN_BYTES(diagnostics_uuid), ESP_GATT_PERM_READ, 0, 0, nullptr}},
+
+    // ----- Acquisition profiler.
+    //
+    // Characteristic
+    [ATTR_IDX_PROFILER] = {{ESP_GATT_AUTO_RSP},
+        {LEN_BYTES(kCharDeclUuid), ESP_GATT_PERM_READ,
+            LEN_LEN_BYTES(kChrPropertyReadOnly)}},
+
+    // Value
+    [ATTR_IDX_PROFILER_VAL] = {{ESP_GATT_RSP_BY_APP},
+        {LEN_BYTES(profiler_uuid), ESP_GATT_PERM_READ, 0, 0, nullptr}},
+
+    // ----- Compressed waveform stream. Notification only.
+    //
+    // Characteristic
+    [ATTR_IDX_WAVEFORM] = {{ESP_GATT_AUTO_RSP},
+        {LEN_BYTES(kCharDeclUuid), ESP_GATT_PERM_READ,
+            LEN_LEN_BYTES(kChrPropertyNotifyOnly)}},
+    // Value
+    [ATTR_IDX_WAVEFORM_VAL] = {{ESP_GATT_RSP_BY_APP},
+        {LEN_BYTES(waveform_uuid), ESP_GATT_PERM_READ, 0, 0, nullptr}},
+
+    // Client Characteristic Configuration Descriptor
+    [ATTR_IDX_WAVEFORM_CCC] = {{ESP_GATT_AUTO_RSP},
+        {LEN_BYTES(kChrConfigDeclUuid),
+            ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE,
+            LEN_LEN_BYTES(waveform_ccc_val)}},
+
+    // ----- Speed x peak current histogram.
+    //
+    // Characteristic
+    [ATTR_IDX_CURRENT_HEATMAP] = {{ESP_GATT_AUTO_RSP},
+        {LEN_BYTES(kCharDeclUuid), ESP_GATT_PERM_READ,
+            LEN_LEN_BYTES(kChrPropertyReadOnly)}},
+
+    // Value
+    [ATTR_IDX_CURRENT_HEATMAP_VAL] = {{ESP_GATT_RSP_BY_APP},
+        {LEN_BYTES(current_heatmap_uuid), ESP_GATT_PERM_READ, 0, 0,
+            nullptr}},
+
+    // ----- Step quantiles by speed.
+    //
+    // Characteristic
+    [ATTR_IDX_STEP_QUANTILES] = {{ESP_GATT_AUTO_RSP},
+        {LEN_BYTES(kCharDeclUuid), ESP_GATT_PERM_READ,
+            LEN_LEN_BYTES(kChrPropertyReadOnly)}},
+
+    // Value
+    [ATTR_IDX_STEP_QUANTILES_VAL] = {{ESP_GATT_RSP_BY_APP},
+        {LEN_BYTES(step_quantiles_uuid), ESP_GATT_PERM_READ, 0, 0,
+            nullptr}},
+
+    // ----- Stall events. Notification only.
+    //
+    // Characteristic
+    [ATTR_IDX_STALL_EVENTS] = {{ESP_GATT_AUTO_RSP},
+        {LEN_BYTES(kCharDeclUuid), ESP_GATT_PERM_READ,
+            LEN_LEN_BYTES(kChrPropertyNotifyOnly)}},
+    // Value
+    [ATTR_IDX_STALL_EVENTS_VAL] = {{ESP_GATT_RSP_BY_APP},
+        {LEN_BYTES(stall_events_uuid), ESP_GATT_PERM_READ, 0, 0, nullptr}},
+
+    // Client Characteristic Configuration Descriptor
+    [ATTR_IDX_STALL_EVENTS_CCC] = {{ESP_GATT_AUTO_RSP},
+        {LEN_BYTES(kChrConfigDeclUuid),
+            ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE,
+            LEN_LEN_BYTES(stall_events_ccc_val)}},
+
+    // ----- Spectrum summary of the last analyzed capture.
+    //
+    // Characteristic
+    [ATTR_IDX_CAPTURE_SPECTRUM] = {{ESP_GATT_AUTO_RSP},
+        {LEN_BYTES(kCharDeclUuid), ESP_GATT_PERM_READ,
+            LEN_LEN_BYTES(kChrPropertyReadOnly)}},
+
+    // Value
+    [ATTR_IDX_CAPTURE_SPECTRUM_VAL] = {{ESP_GATT_RSP_BY_APP},
+        {LEN_BYTES(capture_spectrum_uuid), ESP_GATT_PERM_READ, 0, 0,
+            nullptr}},
+
 };
 
 // Parallel to the entries of attr_table.  Accessed only
@@ -370,24 +560,135 @@ static esp_gatt_status_t on_probe_info_read(
     const gatts_read_evt_param& read_param, ble_util::Serializer* ser) {
   ESP_LOGI(TAG, "on_probe_info_read() called");
 
+  analyzer::HistogramLayoutSettings histogram_layout;
+  uint16_t bucket_min_speeds[acq_consts::kNumHistogramBuckets];
+  analyzer::get_histogram_layout(&histogram_layout, bucket_min_speeds);
+
   assert(ser->size() == 0);
   ser->append_uint8(0x1);  // Packet format version
   ser->append_uint8(vars.hardware_config);
   ser->append_uint16(vars.adc_ticks_per_amp);
   ser->append_uint24(acq_consts::kTimeTicksPerSec);
-  ser->append_uint16(acq_consts::kBucketStepsPerSecond);
+  // The width of the first bucket above zero, for hosts that assume a
+  // linear layout.
+  ser->append_uint16(bucket_min_speeds[1]);
   assert(ser->size() == 9);
 
   // Added March 2023. Not available in older versions.
   const char* app_info_str = util::app_version_str();
   ser->append_str(app_info_str);
 
+  // The histogram layout. Not available in older versions, which have
+  // only the linear layout.
+  //   uint8   layout, see analyzer::HistogramLayout
+  //   uint8   number of buckets, n
+  //   n x uint16  the min speed of each bucket in steps/sec
+  ser->append_uint8(histogram_layout.layout);
+  ser->append_uint8(acq_consts::kNumHistogramBuckets);
+  for (int i = 0; i < acq_consts::kNumHistogramBuckets; i++) {
+    ser->append_uint16(bucket_min_speeds[i]);
+  }
+
   return ESP_GATT_OK;
 }
 
 // The max number of bytes in the response prefix.
 static constexpr uint16_t kCaptureValuePrefixMaxLen = 9;
 
+// Delta codes capture items into buffer, up to max_bytes. Each value is
+// encoded as the zigzag varint delta from the same value of the
+// previous item, starting from zero in each read such that reads are
+// independent. Returns the number of items encoded and sets num_bytes.
+static int pack_capture_items(const analyzer::AdcCaptureItem* items,
+    int num_items, bool is_envelope, uint8_t* buffer, int max_bytes,
+    int* num_bytes) {
+  const int values_per_item = is_envelope ? 4 : 2;
+  const int max_bytes_per_item =
+      values_per_item * zigzag_varint::kMaxInt16Bytes;
+  int16_t last[4] = {};
+  uint8_t* p = buffer;
+  int i = 0;
+  for (; i < num_items && (p - buffer) + max_bytes_per_item <= max_bytes;
+       i++) {
+    const int16_t values[4] = {
+        items[i].v1, items[i].v2, items[i].min_v1, items[i].min_v2};
+    for (int j = 0; j < values_per_item; j++) {
+      p = zigzag_varint::append(p, values[j] - last[j]);
+      last[j] = values[j];
+    }
+  }
+  *num_bytes = p - buffer;
+  return i;
+}
+
+// The max number of bytes in the deep capture response prefix.
+static constexpr uint16_t kDeepCaptureValuePrefixMaxLen = 26;
+
+// A chunk of the deep capture, selected with command 0x0c. Format 0x41:
+//   uint8   format id (0x41)
+//   uint8   flags. 0x80 items included, 0x01 more items are available
+//           now, 0x02 envelope items.
+//   uint8   state, see analyzer::DeepCaptureState
+//   uint16  deep capture sequence number
+//   uint8   divider
+//   uint32  item capacity
+//   uint32  items filled so far
+//   uint48  tick_count of the trigger
+//   uint32  index of the first item
+//   uint16  number of items, n
+//   n items of int16 v1, v2, followed in envelope mode by int16 min_v1,
+//   min_v2.
+// Reading resumes from the next item. The host can restart at any index
+// with command 0x0c, e.g. after a failed read.
+static esp_gatt_status_t on_deep_capture_read(
+    const gatts_read_evt_param& read_param, ble_util::Serializer* ser,
+    uint16_t max_bytes) {
+  analyzer::DeepCaptureInfo info;
+  const int16_t* values = analyzer::sample_deep_capture(&info);
+
+  const uint32_t start_item_index =
+      std::min(vars.deep_capture_read_index, info.size);
+  const uint8_t values_per_item =
+      analyzer::deep_capture_values_per_item(info.mode);
+  const uint32_t desired_item_count = info.size - start_item_index;
+  const uint32_t available_item_count =
+      (max_bytes - kDeepCaptureValuePrefixMaxLen) /
+      (values_per_item * sizeof(int16_t));
+  const uint16_t actual_item_count =
+      std::min(desired_item_count, available_item_count);
+
+  uint8_t flags = 0x00;
+  if (actual_item_count) {
+    flags = flags | 0x80;  // Items included.
+    if (actual_item_count < desired_item_count) {
+      flags = flags | 0x01;  // More items are available now.
+    }
+  }
+  if (info.mode == analyzer::CAPTURE_MODE_ENVELOPE) {
+    flags = flags | 0x02;  // Envelope items.
+  }
+
+  ser->append_uint8(0x41);  // Format id.
+  ser->append_uint8(flags);
+  ser->append_uint8(info.state);
+  ser->append_uint16(info.seq_number);
+  ser->append_uint8(info.divider);
+  ser->append_uint32(info.capacity);
+  ser->append_uint32(info.size);
+  ser->append_uint48(info.trigger_tick_count);
+  ser->append_uint32(start_item_index);
+  ser->append_uint16(actual_item_count);
+  assert(ser->size() == kDeepCaptureValuePrefixMaxLen);
+
+  const int16_t* item_values = &values[start_item_index * values_per_item];
+  for (int i = 0; i < actual_item_count * values_per_item; i++) {
+    ser->append_int16(item_values[i]);
+  }
+  vars.deep_capture_read_index = start_item_index + actual_item_count;
+
+  return ESP_GATT_OK;
+}
+
 static esp_gatt_status_t on_capture_read(
     const gatts_read_evt_param& read_param, ble_util::Serializer* ser) {
   ESP_LOGD(TAG, "on_capture_read() called");
@@ -405,22 +706,50 @@ static esp_gatt_status_t on_capture_read(
     return ESP_GATT_OUT_OF_RANGE;
   }
 
+  if (vars.deep_capture_selected) {
+    return on_deep_capture_read(read_param, ser, max_bytes);
+  }
+
+  const analyzer::AdcCaptureBuffer* snapshot = vars.adc_capture_snapshot;
   // Index of first item to transfer.
   const int start_item_index = vars.adc_capture_items_read_so_far;
   // How many left to transfer.
   const int desired_item_count =
-      vars.adc_capture_snapshot.items.size() - start_item_index;
-  // How many can we transfer now. Using 4 bytes per entry.
-  const int available_item_count = (max_bytes - kCaptureValuePrefixMaxLen) / 4;
+      (snapshot ? snapshot->items.size() : 0) - start_item_index;
+  // Envelope items carry also the min values.
+  const bool is_envelope =
+      snapshot && snapshot->mode == analyzer::CAPTURE_MODE_ENVELOPE;
+  const int bytes_per_item = is_envelope ? 8 : 4;
+  // The first read of a segmented capture has also the segments info,
+  // between the prefix and the items.
+  const bool has_segments_info = snapshot && snapshot->num_segments > 1 &&
+      start_item_index == 0 && desired_item_count > 0;
+  const int segments_info_len =
+      has_segments_info ? 5 + 6 * snapshot->num_segments : 0;
+  const int max_items_bytes =
+      max_bytes - kCaptureValuePrefixMaxLen - segments_info_len;
+  // How many can we transfer now.
+  const int available_item_count = max_items_bytes / bytes_per_item;
   // How many we are going to transfer now.
-  const int actual_item_count = (desired_item_count <= available_item_count)
+  int actual_item_count = (desired_item_count <= available_item_count)
       ? desired_item_count
       : available_item_count;
 
+  // With format 0x42 the items are delta coded, typically in about half
+  // the bytes, and the item count is known only after packing them.
+  const bool is_packed = vars.capture_format == 0x42;
+  uint8_t packed_items[kMaxRequestedMtu];
+  int packed_bytes = 0;
+  if (is_packed && desired_item_count > 0) {
+    actual_item_count = pack_capture_items(
+        &snapshot->items.linear_items()[start_item_index], desired_item_count,
+        is_envelope, packed_items, max_items_bytes, &packed_bytes);
+  }
+
   ESP_LOGD(TAG, "Capture read: start=%d, desired=%d, actual=%d",
       start_item_index, desired_item_count, actual_item_count);
 
-  ser->append_uint8(0x40);  // format id.
+  ser->append_uint8(vars.capture_format);  // format id.
 
   // Flags (uint8)
   uint8_t flags = 0x00;
@@ -429,23 +758,52 @@ static esp_gatt_status_t on_capture_read(
     if (actual_item_count < desired_item_count) {
       flags = flags | 0x01;  // Needs at least one more read.
     }
+    if (is_envelope) {
+      flags = flags | 0x02;  // Envelope items.
+    }
+    if (has_segments_info) {
+      flags = flags | 0x04;  // Segments info.
+    }
   }
 
   ser->append_uint8(flags);
 
   if (actual_item_count) {
-    ser->append_uint16(vars.adc_capture_snapshot.seq_number);
-    ser->append_uint8(vars.adc_capture_snapshot.divider);
+    ser->append_uint16(snapshot->seq_number);
+    ser->append_uint8(snapshot->divider);
     ser->append_uint16((uint16_t)actual_item_count);
     ser->append_uint16((uint16_t)start_item_index);
 
-    // Encode data points as pairs of int16_t.
-    for (int i = start_item_index; i < start_item_index + actual_item_count;
-         i++) {
-      const analyzer::AdcCaptureItem* item =
-          vars.adc_capture_snapshot.items.get(i);
-      ser->append_int16(item->v1);
-      ser->append_int16(item->v2);
+    // Segments info:
+    //   uint8   number of segments, n
+    //   uint16  items per segment
+    //   uint16  items per segment up to and including the trigger
+    //   n x uint48  tick_count of the trigger of each segment
+    if (has_segments_info) {
+      ser->append_uint8(snapshot->num_segments);
+      ser->append_uint16(snapshot->segment_items);
+      ser->append_uint16(snapshot->pre_trigger_items);
+      for (int i = 0; i < snapshot->num_segments; i++) {
+        ser->append_uint48(snapshot->trigger_tick_counts[i]);
+      }
+    }
+
+    // Encode data points as pairs of int16_t. Envelope items are
+    // followed by the pair of min values, such that their first pair is
+    // the upper envelope. The snapshot is linearized so the items are a
+    // contiguous range. Format 0x42 has the same values, delta coded.
+    if (is_packed) {
+      ser->append_bytes(packed_items, packed_bytes);
+    }
+    const analyzer::AdcCaptureItem* items =
+        &snapshot->items.linear_items()[start_item_index];
+    for (int i = 0; !is_packed && i < actual_item_count; i++) {
+      ser->append_int16(items[i].v1);
+      ser->append_int16(items[i].v2);
+      if (is_envelope) {
+        ser->append_int16(items[i].min_v1);
+        ser->append_int16(items[i].min_v2);
+      }
     }
 
     // Update for next chunk read.
@@ -476,7 +834,15 @@ static void serialize_state(
   ser->append_int16(state.v1);
   ser->append_int16(state.v2);
   ser->append_uint32(state.non_energized_count);
-  assert(ser->size() == 19);
+  // Added in Oct 2026. Position within the full step, in 1/256 steps.
+  // Readers should accept the 19 bytes format without it.
+  ser->append_int16(state.step_fraction);
+  // Added in Oct 2026. Stall suspects since the last reset and the
+  // tick_count of the last one. Readers should accept the 21 bytes
+  // format without them.
+  ser->append_uint32(state.stall_suspects);
+  ser->append_uint48(state.last_stall_suspect_tick_count);
+  assert(ser->size() == 31);
 }
 
 static esp_gatt_status_t on_stepper_state_read(
@@ -489,11 +855,126 @@ static esp_gatt_status_t on_stepper_state_read(
   return ESP_GATT_OK;
 }
 
+// Acquisition health counters, to tell when the BLE load starves the
+// acquisition. Format 0x60:
+//   uint8   format id (0x60)
+//   uint48  tick_count
+//   uint32  ticks_with_errors, bad and lost pairs
+//   uint32  lost_pairs
+//   uint32  bad pairs since boot
+//   uint32  frames dropped on DMA pool overflow, since boot
+//   uint32  frames dropped by the adc task, since boot
+//   uint32  short reads, since boot
+//   uint32  read errors, since boot
+//   uint16  DMA pool backlog, in frames
+//   uint16  max DMA pool backlog, in frames
+//   uint16  DMA pool capacity, in frames
+//   uint8   DMA frame profile
+//   uint16  pairs per DMA frame
+//   uint32  driver restarts, since boot
+//   uint8   acquisition mode, 0 = copy, 1 = zero copy
+//   uint32  frames overwritten while processed, zero copy mode only
+static esp_gatt_status_t on_diagnostics_read(
+    const gatts_read_evt_param& read_param, ble_util::Serializer* ser) {
+  ESP_LOGD(TAG, "on_diagnostics_read() called");
+
+  analyzer::sample_state(&vars.stepper_state_buffer);
+  const analyzer::State& state = vars.stepper_state_buffer;
+  adc_task::AdcTaskStats adc_stats;
+  adc_task::get_stats(&adc_stats);
+
+  assert(ser->size() == 0);
+  ser->append_uint8(0x60);  // Format id.
+  ser->append_uint48(state.tick_count);
+  ser->append_uint32(state.ticks_with_errors);
+  ser->append_uint32(state.lost_pairs);
+  ser->append_uint32(adc_stats.bad_pairs);
+  ser->append_uint32(adc_stats.pool_overflow_frames);
+  ser->append_uint32(adc_stats.dropped_frames);
+  ser->append_uint32(adc_stats.short_reads);
+  ser->append_uint32(adc_stats.read_errors);
+  ser->append_uint16(adc_stats.backlog_frames);
+  ser->append_uint16(adc_stats.max_backlog_frames);
+  ser->append_uint16(adc_stats.pool_frames);
+  ser->append_uint8(adc_stats.frame_profile);
+  ser->append_uint16(adc_stats.pairs_per_frame);
+  ser->append_uint32(adc_stats.driver_restarts);
+  ser->append_uint8(ADC_ZERO_COPY);
+  ser->append_uint32(adc_stats.overwritten_frames);
+  assert(ser->size() == 53);
+
+  return ESP_GATT_OK;
+}
+
+// The stats of a single profiler stage. Each read returns the next
+// stage, cyclically, starting from the first stage on connection and
+// after a profiler reset. Format 0x70:
+//   uint8   format id (0x70)
+//   uint8   stage index
+//   uint8   number of stages
+//   uint16  CPU clock in MHz, to convert cycles to time
+//   uint32  number of frames recorded
+//   uint32  min cycles per frame
+//   uint32  mean cycles per frame
+//   uint32  max cycles per frame
+//   uint8   number of log2 buckets, n
+//   uint32  x n, number of frames with [2^i, 2^(i+1)) cycles
+static esp_gatt_status_t on_profiler_read(
+    const gatts_read_evt_param& read_param, ble_util::Serializer* ser) {
+  ESP_LOGD(TAG, "on_profiler_read() called");
+
+#if ANALYZER_PROFILER
+  constexpr uint16_t kValueLen = 22 + 4 * profiler::kNumBuckets;
+  if (vars.conn_mtu - kMtuOverhead < kValueLen) {
+    ESP_LOGE(TAG, "Profiler read: mtu %hu is too small", vars.conn_mtu);
+    return ESP_GATT_OUT_OF_RANGE;
+  }
+
+  const profiler::Stage stage = (profiler::Stage)vars.profiler_next_stage;
+  vars.profiler_next_stage = (stage + 1) % profiler::kNumStages;
+  profiler::StageStats stats;
+  profiler::get_stage_stats(stage, &stats);
+
+  assert(ser->size() == 0);
+  ser->append_uint8(0x70);  // Format id.
+  ser->append_uint8(stage);
+  ser->append_uint8(profiler::kNumStages);
+  ser->append_uint16(CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ);
+  ser->append_uint32(stats.count);
+  ser->append_uint32(stats.min_cycles);
+  ser->append_uint32(
+      stats.count ? (uint32_t)(stats.total_cycles / stats.count) : 0);
+  ser->append_uint32(stats.max_cycles);
+  ser->append_uint8(profiler::kNumBuckets);
+  for (int i = 0; i < profiler::kNumBuckets; i++) {
+    ser->append_uint32(stats.buckets[i]);
+  }
+  assert(ser->size() == kValueLen);
+
+  return ESP_GATT_OK;
+#else
+  return ESP_GATT_REQ_NOT_SUPPORTED;
+#endif
+}
+
+// Samples the histogram buckets of the histogram reads into
+// vars.histogram_buffer.
+static void sample_selected_histogram() {
+  if (vars.histogram_window_selected) {
+    analyzer::sample_histogram_window(&vars.histogram_window_buffer);
+    memcpy(vars.histogram_buffer.buckets,
+        vars.histogram_window_buffer.buckets,
+        sizeof(vars.histogram_buffer.buckets));
+  } else {
+    analyzer::sample_histogram(&vars.histogram_buffer);
+  }
+}
+
 static esp_gatt_status_t on_current_histogram_read(
     const gatts_read_evt_param& read_param, ble_util::Serializer* ser) {
   ESP_LOGD(TAG, "on_current_histogram_read() called");
 
-  analyzer::sample_histogram(&vars.histogram_buffer);
+  sample_selected_histogram();
 
   assert(ser->size() == 0);
   ser->append_uint8(0x10);  // format id.
@@ -519,11 +1000,157 @@ static esp_gatt_status_t on_current_histogram_read(
   return ESP_GATT_OK;
 }
 
+// Returns the next page of rows of the speed x peak current histogram.
+// The pages of a snapshot are consistent with each other, and a read
+// after the last page starts a new snapshot.
+static esp_gatt_status_t on_current_heatmap_read(
+    const gatts_read_evt_param& read_param, ble_util::Serializer* ser) {
+  ESP_LOGD(TAG, "on_current_heatmap_read() called");
+
+  constexpr int kNumRows = acq_consts::kNumHistogramBuckets;
+  constexpr int kNumBins = acq_consts::kNumPeakCurrentBins;
+  constexpr uint16_t kHeaderLen = 10;
+  constexpr uint16_t kRowLen = 2 * kNumBins;
+  const uint16_t max_bytes =
+      std::min(vars.conn_mtu - kMtuOverhead, ser->capacity());
+  if (max_bytes < kHeaderLen + kRowLen) {
+    ESP_LOGE(TAG, "Heatmap read: mtu %hu is too small", vars.conn_mtu);
+    return ESP_GATT_OUT_OF_RANGE;
+  }
+
+  if (vars.heatmap_next_row == 0) {
+    analyzer::sample_histogram(&vars.heatmap_snapshot);
+    vars.heatmap_seq_number++;
+  }
+  const int first_row = vars.heatmap_next_row;
+  const int num_rows =
+      std::min((max_bytes - kHeaderLen) / kRowLen, kNumRows - first_row);
+  const bool has_more = first_row + num_rows < kNumRows;
+  vars.heatmap_next_row = has_more ? first_row + num_rows : 0;
+
+  assert(ser->size() == 0);
+  ser->append_uint8(0x90);  // Format id.
+  ser->append_uint8(has_more ? 0x01 : 0x00);  // Flags.
+  ser->append_uint16(vars.heatmap_seq_number);
+  ser->append_uint8(kNumRows);
+  ser->append_uint8(kNumBins);
+  ser->append_uint16(1 << acq_consts::kPeakCurrentBinShift);
+  ser->append_uint8(first_row);
+  ser->append_uint8(num_rows);
+  assert(ser->size() == kHeaderLen);
+  for (int i = first_row; i < first_row + num_rows; i++) {
+    for (int j = 0; j < kNumBins; j++) {
+      ser->append_uint16(vars.heatmap_snapshot.peak_current_steps[i][j]);
+    }
+  }
+
+  return ESP_GATT_OK;
+}
+
+// Returns the step quantiles of the next page of histogram buckets. A
+// read after the last page starts again from the first bucket.
+static esp_gatt_status_t on_step_quantiles_read(
+    const gatts_read_evt_param& read_param, ble_util::Serializer* ser) {
+  ESP_LOGD(TAG, "on_step_quantiles_read() called");
+
+  constexpr int kNumBuckets = acq_consts::kNumHistogramBuckets;
+  constexpr int kNumQuantiles = analyzer::kNumStepQuantiles;
+  constexpr uint16_t kHeaderLen = 6 + 2 * kNumQuantiles;
+  constexpr uint16_t kBucketLen = 4 * kNumQuantiles;
+  const uint16_t max_bytes =
+      std::min(vars.conn_mtu - kMtuOverhead, ser->capacity());
+  if (max_bytes < kHeaderLen + kBucketLen) {
+    ESP_LOGE(TAG, "Step quantiles read: mtu %hu is too small", vars.conn_mtu);
+    return ESP_GATT_OUT_OF_RANGE;
+  }
+
+  const int first_bucket = vars.step_quantiles_next_bucket;
+  if (first_bucket == 0) {
+    analyzer::sample_step_quantiles(&vars.step_quantiles_snapshot);
+  }
+  const int num_buckets = std::min(
+      (max_bytes - kHeaderLen) / kBucketLen, kNumBuckets - first_bucket);
+  const bool has_more = first_bucket + num_buckets < kNumBuckets;
+  vars.step_quantiles_next_bucket = has_more ? first_bucket + num_buckets : 0;
+
+  assert(ser->size() == 0);
+  ser->append_uint8(0xa0);  // Format id.
+  ser->append_uint8(has_more ? 0x01 : 0x00);  // Flags.
+  ser->append_uint8(kNumBuckets);
+  ser->append_uint8(kNumQuantiles);
+  for (int i = 0; i < kNumQuantiles; i++) {
+    ser->append_uint16(analyzer::kStepQuantilesPerMille[i]);
+  }
+  ser->append_uint8(first_bucket);
+  ser->append_uint8(num_buckets);
+  assert(ser->size() == kHeaderLen);
+  for (int i = first_bucket; i < first_bucket + num_buckets; i++) {
+    const analyzer::StepQuantiles& quantiles =
+        vars.step_quantiles_snapshot.buckets[i];
+    for (int j = 0; j < kNumQuantiles; j++) {
+      ser->append_uint16(quantiles.ticks_in_step[j]);
+    }
+    for (int j = 0; j < kNumQuantiles; j++) {
+      ser->append_uint16(quantiles.peak_current[j]);
+    }
+  }
+
+  return ESP_GATT_OK;
+}
+
+// The spectrum summary of the last analyzed capture, see spectrum_task.h.
+// Format 0xc0:
+//   uint8   format id (0xc0)
+//   uint32  analysis sequence number, 0 if none yet
+//   uint16  capture sequence number
+//   uint8   capture divider
+//   uint32  CPU cycles of the analysis
+//   uint8   number of harmonics, n
+//   2 x channel, v1 then v2:
+//     uint32  fundamental frequency, in mHz, 0 if no signal
+//     uint16  THD, in per mille of the fundamental
+//     n x uint16  amplitudes of the fundamental and its harmonics, in
+//                 ADC counts
+static esp_gatt_status_t on_capture_spectrum_read(
+    const gatts_read_evt_param& read_param, ble_util::Serializer* ser) {
+  ESP_LOGD(TAG, "on_capture_spectrum_read() called");
+
+  constexpr int kNumHarmonics = spectrum::kNumHarmonics;
+  constexpr uint16_t kValueLen = 13 + 2 * (6 + 2 * kNumHarmonics);
+  if (vars.conn_mtu - kMtuOverhead < kValueLen) {
+    ESP_LOGE(
+        TAG, "Capture spectrum read: mtu %hu is too small", vars.conn_mtu);
+    return ESP_GATT_OUT_OF_RANGE;
+  }
+
+  spectrum_task::sample_spectrum(&vars.capture_spectrum_buffer);
+  const spectrum_task::CaptureSpectrum& spectrum =
+      vars.capture_spectrum_buffer;
+
+  assert(ser->size() == 0);
+  ser->append_uint8(0xc0);  // Format id.
+  ser->append_uint32(spectrum.seq_number);
+  ser->append_uint16(spectrum.capture_seq_number);
+  ser->append_uint8(spectrum.capture_divider);
+  ser->append_uint32(spectrum.analysis_cycles);
+  ser->append_uint8(kNumHarmonics);
+  for (const spectrum::ChannelSpectrum& channel : spectrum.channels) {
+    ser->append_uint32(channel.fundamental_millihz);
+    ser->append_uint16(channel.thd_per_mille);
+    for (int i = 0; i < kNumHarmonics; i++) {
+      ser->append_uint16(channel.harmonic_amplitudes[i]);
+    }
+  }
+  assert(ser->size() == kValueLen);
+
+  return ESP_GATT_OK;
+}
+
 static esp_gatt_status_t on_time_histogram_read(
     const gatts_read_evt_param& read_param, ble_util::Serializer* ser) {
   ESP_LOGD(TAG, "on_time_histogram_read() called");
 
-  analyzer::sample_histogram(&vars.histogram_buffer);
+  sample_selected_histogram();
 
   assert(ser->size() == 0);
   ser->append_uint8(0x20);  // format id.
@@ -559,7 +1186,7 @@ static esp_gatt_status_t on_distance_histogram_read(
     const gatts_read_evt_param& read_param, ble_util::Serializer* ser) {
   ESP_LOGD(TAG, "on_distance_histogram_read() called");
 
-  analyzer::sample_histogram(&vars.histogram_buffer);
+  sample_selected_histogram();
 
   assert(ser->size() == 0);
   ser->append_uint8(0x30);  // Format id.
@@ -590,8 +1217,13 @@ static esp_gatt_status_t on_distance_histogram_read(
   return ESP_GATT_OK;
 }
 
-static esp_gatt_status_t on_state_notification_control_write(
-    const gatts_write_evt_param& write_param) {
+// Handles a write to the client characteristic configuration
+// descriptor of a notifying characteristic. flag is the characteristic's
+// notifications enabled field in protected_vars, and name is for the
+// log.
+static esp_gatt_status_t on_notification_control_write(
+    const gatts_write_evt_param& write_param, const char* name,
+    bool ProtextedVars::*flag) {
   if (write_param.len != 2 || write_param.is_prep) {
     return ESP_GATT_ERROR;
   }
@@ -600,9 +1232,9 @@ static esp_gatt_status_t on_state_notification_control_write(
   const bool notifications_enabled = descr_value & 0x0001;
 
   ENTER_MUTEX {
-    ESP_LOGI(TAG, "Notifications 0x%04x: %d -> %d", descr_value,
-        protected_vars.state_notifications_enabled, notifications_enabled);
-    protected_vars.state_notifications_enabled = notifications_enabled;
+    ESP_LOGI(TAG, "%s notifications 0x%04x: %d -> %d", name, descr_value,
+        protected_vars.*flag, notifications_enabled);
+    protected_vars.*flag = notifications_enabled;
   }
   EXIT_MUTEX
 
@@ -644,8 +1276,9 @@ static esp_gatt_status_t on_command_write(
         ESP_LOGE(TAG, "Signal capture command too long: %hu", len);
         return ESP_GATT_INVALID_ATTR_LEN;
       }
-      analyzer::get_last_capture_snapshot(&vars.adc_capture_snapshot);
+      vars.adc_capture_snapshot = analyzer::take_last_capture_snapshot();
       vars.adc_capture_items_read_so_far = 0;
+      vars.deep_capture_selected = false;
       ESP_LOGD(TAG, "ADC signal captured.");
       return ESP_GATT_OK;
 
@@ -750,6 +1383,182 @@ static esp_gatt_status_t on_command_write(
       return ESP_GATT_OK;
     }
 
+    // Command = set the ADC DMA frame profile. See adc_task.h. The
+    // new profile is persisted.
+    case 0x09:
+      if (len != 2) {
+        ESP_LOGE(TAG, "Frame profile command wrong length : %hu", len);
+        return ESP_GATT_INVALID_ATTR_LEN;
+      }
+      if (!controls::set_adc_frame_profile(data[1])) {
+        ESP_LOGE(TAG, "Frame profile change failed");
+        return ESP_GATT_WRITE_NOT_PERMIT;
+      }
+      return ESP_GATT_OK;
+
+    // Command = Set ADC capture mode. See analyzer::CaptureMode. Not
+    // persisted.
+    case 0x0a:
+      if (len != 2) {
+        ESP_LOGE(TAG, "Set capture mode command wrong length : %hu", len);
+        return ESP_GATT_INVALID_ATTR_LEN;
+      }
+      if (!analyzer::set_signal_capture_mode(data[1])) {
+        ESP_LOGE(TAG, "Invalid capture mode %hhu", data[1]);
+        return ESP_GATT_OUT_OF_RANGE;
+      }
+      return ESP_GATT_OK;
+
+    // Command = Arm a deep capture of up to the given uint32 number of
+    // items, or free it if zero. The actual capacity, which is clipped
+    // to the available heap, is reported by the deep capture reads.
+    case 0x0b: {
+      if (len != 5) {
+        ESP_LOGE(TAG, "Deep capture command wrong length : %hu", len);
+        return ESP_GATT_INVALID_ATTR_LEN;
+      }
+      const uint32_t num_items = ((uint32_t)data[1] << 24) |
+          ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 8) | data[4];
+      vars.deep_capture_read_index = 0;
+      const uint32_t capacity = analyzer::arm_deep_capture(num_items);
+      if (num_items && !capacity) {
+        return ESP_GATT_NO_RESOURCES;
+      }
+      return ESP_GATT_OK;
+    }
+
+    // Command = Select the deep capture for the capture reads, starting
+    // from the given uint32 item index. Command 0x02 selects back the
+    // capture snapshot.
+    case 0x0c:
+      if (len != 5) {
+        ESP_LOGE(TAG, "Deep capture read command wrong length : %hu", len);
+        return ESP_GATT_INVALID_ATTR_LEN;
+      }
+      vars.deep_capture_selected = true;
+      vars.deep_capture_read_index = ((uint32_t)data[1] << 24) |
+          ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 8) | data[4];
+      return ESP_GATT_OK;
+
+    // Command = Select the capture snapshot read format, 0x40 (default)
+    // or 0x42 (delta coded). Reset on connection.
+    case 0x0e:
+      if (len != 2) {
+        ESP_LOGE(TAG, "Capture format command wrong length : %hu", len);
+        return ESP_GATT_INVALID_ATTR_LEN;
+      }
+      if (data[1] != 0x40 && data[1] != 0x42) {
+        ESP_LOGE(TAG, "Invalid capture format 0x%02hhx", data[1]);
+        return ESP_GATT_OUT_OF_RANGE;
+      }
+      vars.capture_format = data[1];
+      return ESP_GATT_OK;
+
+    // Command = Set the capture trigger, see analyzer::TriggerSettings.
+    // Not persisted. Arguments:
+    //   uint8   source
+    //   uint8   mode
+    //   uint8   channel
+    //   uint8   flags. 0x01 falling edge.
+    //   int16   level
+    //   uint16  hysteresis
+    //   uint16  pre trigger items
+    //   uint16  holdoff items
+    case 0x0f: {
+      if (len != 13) {
+        ESP_LOGE(TAG, "Capture trigger command wrong length : %hu", len);
+        return ESP_GATT_INVALID_ATTR_LEN;
+      }
+      const analyzer::TriggerSettings settings = {
+          .source = (analyzer::TriggerSource)data[1],
+          .mode = (analyzer::TriggerMode)data[2],
+          .channel = data[3],
+          .is_falling_edge = (data[4] & 0x01) != 0,
+          .level = (int16_t)(data[5] << 8 | data[6]),
+          .hysteresis = (uint16_t)(data[7] << 8 | data[8]),
+          .pre_trigger_items = (uint16_t)(data[9] << 8 | data[10]),
+          .holdoff_items = (uint16_t)(data[11] << 8 | data[12]),
+      };
+      if (!analyzer::set_capture_trigger(settings)) {
+        ESP_LOGE(TAG, "Invalid capture trigger settings");
+        return ESP_GATT_OUT_OF_RANGE;
+      }
+      return ESP_GATT_OK;
+    }
+
+    // Command = Set the number of capture segments, 1 for a regular
+    // capture. Not persisted.
+    case 0x10:
+      if (len != 2) {
+        ESP_LOGE(TAG, "Capture segments command wrong length : %hu", len);
+        return ESP_GATT_INVALID_ATTR_LEN;
+      }
+      if (!analyzer::set_capture_segments(data[1])) {
+        ESP_LOGE(TAG, "Invalid capture segments %hhu", data[1]);
+        return ESP_GATT_OUT_OF_RANGE;
+      }
+      return ESP_GATT_OK;
+
+    // Command = Set the histogram layout and clear the histogram. The
+    // host rereads the probe info for the new buckets. Not persisted.
+    //   uint8   layout, see analyzer::HistogramLayout
+    //   uint16  param1
+    //   uint16  param2
+    case 0x11: {
+      if (len != 6) {
+        ESP_LOGE(TAG, "Histogram layout command wrong length : %hu", len);
+        return ESP_GATT_INVALID_ATTR_LEN;
+      }
+      const analyzer::HistogramLayoutSettings settings = {
+          .layout = (analyzer::HistogramLayout)data[1],
+          .param1 = (uint16_t)(data[2] << 8 | data[3]),
+          .param2 = (uint16_t)(data[4] << 8 | data[5]),
+      };
+      if (!analyzer::set_histogram_layout(settings)) {
+        ESP_LOGE(TAG, "Invalid histogram layout");
+        return ESP_GATT_OUT_OF_RANGE;
+      }
+      return ESP_GATT_OK;
+    }
+
+    // Command = Select the histogram of the histogram reads. 0 for the
+    // histogram since the last reset (the default), or n in [1, 60]
+    // for the histogram of the last n seconds. The window length is not
+    // persisted.
+    case 0x12:
+      if (len != 2) {
+        ESP_LOGE(TAG, "Histogram window command wrong length : %hu", len);
+        return ESP_GATT_INVALID_ATTR_LEN;
+      }
+      if (data[1] && !analyzer::set_histogram_window(data[1])) {
+        ESP_LOGE(TAG, "Invalid histogram window %hhu", data[1]);
+        return ESP_GATT_OUT_OF_RANGE;
+      }
+      vars.histogram_window_selected = data[1] != 0;
+      return ESP_GATT_OK;
+
+    // Command = Set the waveform stream decimation, 0 to stop it. The
+    // blocks are sized to the current MTU.
+    case 0x0d:
+      if (len != 2) {
+        ESP_LOGE(TAG, "Waveform stream command wrong length : %hu", len);
+        return ESP_GATT_INVALID_ATTR_LEN;
+      }
+      analyzer::set_waveform_stream(
+          data[1], vars.conn_mtu - kMtuOverhead - kWaveformHeaderLen);
+      return ESP_GATT_OK;
+
+    // Command = reset the acquisition profiler.
+    case 0x08:
+      if (len != 1) {
+        ESP_LOGE(TAG, "Profiler reset command too long: %hu", len);
+        return ESP_GATT_INVALID_ATTR_LEN;
+      }
+      profiler::reset();
+      vars.profiler_next_stage = 0;
+      ESP_LOGI(TAG, "Profiler reset.");
+      return ESP_GATT_OK;
+
     default:
       ESP_LOGE(TAG, "on_command_write: unknown opcode: %02lx", opcode);
       return ESP_GATT_REQ_NOT_SUPPORTED;
@@ -932,6 +1741,20 @@ static void gatts_event_handler(esp_gatts_cb_event_t event,
         status = on_distance_histogram_read(read_param, &ser);
       } else if (read_param.handle == handle_table[ATTR_IDX_CAPTURE_VAL]) {
         status = on_capture_read(read_param, &ser);
+      } else if (read_param.handle ==
+          handle_table[ATTR_IDX_DIAGNOSTICS_VAL]) {
+        status = on_diagnostics_read(read_param, &ser);
+      } else if (read_param.handle == handle_table[ATTR_IDX_PROFILER_VAL]) {
+        status = on_profiler_read(read_param, &ser);
+      } else if (read_param.handle ==
+          handle_table[ATTR_IDX_CURRENT_HEATMAP_VAL]) {
+        status = on_current_heatmap_read(read_param, &ser);
+      } else if (read_param.handle ==
+          handle_table[ATTR_IDX_STEP_QUANTILES_VAL]) {
+        status = on_step_quantiles_read(read_param, &ser);
+      } else if (read_param.handle ==
+          handle_table[ATTR_IDX_CAPTURE_SPECTRUM_VAL]) {
+        status = on_capture_spectrum_read(read_param, &ser);
       }
 
       const uint16_t len = (status == ESP_GATT_OK) ? ser.size() : 0;
@@ -966,7 +1789,19 @@ static void gatts_event_handler(esp_gatts_cb_event_t event,
         status = ESP_GATT_INVALID_OFFSET;
       } else if (handle_table[ATTR_IDX_STEPPER_STATE_CCC] ==
           write_param.handle) {
-        status = on_state_notification_control_write(write_param);
+        status = on_notification_control_write(write_param, "State",
+            &ProtextedVars::state_notifications_enabled);
+      } else if (handle_table[ATTR_IDX_STEP_EVENTS_CCC] ==
+          write_param.handle) {
+        status = on_notification_control_write(write_param, "Step events",
+            &ProtextedVars::step_events_notifications_enabled);
+      } else if (handle_table[ATTR_IDX_WAVEFORM_CCC] == write_param.handle) {
+        status = on_notification_control_write(write_param, "Waveform",
+            &ProtextedVars::waveform_notifications_enabled);
+      } else if (handle_table[ATTR_IDX_STALL_EVENTS_CCC] ==
+          write_param.handle) {
+        status = on_notification_control_write(write_param, "Stall events",
+            &ProtextedVars::stall_events_notifications_enabled);
       } else if (handle_table[ATTR_IDX_COMMAND_VAL] == write_param.handle) {
         ESP_LOGD(TAG,
             "Command write:  is_prep=%d, need_rsp=%d, "
@@ -995,6 +1830,16 @@ static void gatts_event_handler(esp_gatts_cb_event_t event,
     case ESP_GATTS_MTU_EVT:
       ESP_LOGI(TAG, "ESP_GATTS_MTU_EVT, mtu set to %d", param->mtu.mtu);
       vars.conn_mtu = param->mtu.mtu;
+      ENTER_MUTEX { protected_vars.conn_mtu = param->mtu.mtu; }
+      EXIT_MUTEX
+      break;
+
+    // The step events task doesn't send notifications while congested.
+    case ESP_GATTS_CONGEST_EVT:
+      ESP_LOGD(TAG, "ESP_GATTS_CONGEST_EVT, congested: %d",
+          param->congest.congested);
+      ENTER_MUTEX { protected_vars.congested = param->congest.congested; }
+      EXIT_MUTEX
       break;
 
     case ESP_GATTS_START_EVT:
@@ -1013,12 +1858,23 @@ static void gatts_event_handler(esp_gatts_cb_event_t event,
       ENTER_MUTEX {
         protected_vars.conn_id = param->connect.conn_id;
         protected_vars.state_notifications_enabled = false;
+        protected_vars.step_events_notifications_enabled = false;
+        protected_vars.waveform_notifications_enabled = false;
+        protected_vars.stall_events_notifications_enabled = false;
+        protected_vars.congested = false;
+        protected_vars.conn_mtu = 23;
         protected_vars.conn_wdt_period_millis = 0;
         protected_vars.conn_wdt_timestamp_millis = 0;
       }
       EXIT_MUTEX
 
       vars.conn_mtu = 23;  // Initial BLE MTU.
+      vars.profiler_next_stage = 0;
+      vars.heatmap_next_row = 0;
+      vars.step_quantiles_next_bucket = 0;
+      vars.histogram_window_selected = false;
+      vars.capture_format = 0x40;
+      vars.deep_capture_selected = false;
       esp_ble_conn_update_params_t conn_params = {};
       memcpy(conn_params.bda, param->connect.remote_bda, sizeof(esp_bd_addr_t));
       // For the iOS system, please refer to Apple official documents about
@@ -1036,10 +1892,16 @@ static void gatts_event_handler(esp_gatts_cb_event_t event,
       ESP_LOGI(TAG, "ESP_GATTS_DISCONNECT_EVT, reason = 0x%x",
           param->disconnect.reason);
       vars.conn_mtu = 0;
+      analyzer::set_waveform_stream(0, 0);
 
       ENTER_MUTEX {
         protected_vars.conn_id = kInvalidConnId;
         protected_vars.state_notifications_enabled = false;
+        protected_vars.step_events_notifications_enabled = false;
+        protected_vars.waveform_notifications_enabled = false;
+        protected_vars.stall_events_notifications_enabled = false;
+        protected_vars.congested = false;
+        protected_vars.conn_mtu = 0;
         protected_vars.conn_wdt_period_millis = 0;
         protected_vars.conn_wdt_timestamp_millis = 0;
       }
@@ -1097,6 +1959,271 @@ static void gatts_event_handler(esp_gatts_cb_event_t event,
   }
 }
 
+// Step events notification format:
+//
+//   uint8   format id (0x50)
+//   uint32  sequence number of the first event
+//   uint8   number of events, n
+//   n x 12 bytes events:
+//     uint48  tick_count at the end of the step
+//     int8    full_steps increment, +1 or -1
+//     uint24  ticks_in_step, saturated at 0xffffff
+//     uint16  max_current_in_step, in ADC counts
+//
+// The events of a notification have consecutive sequence numbers. A
+// gap between notifications indicates dropped events.
+static constexpr uint16_t kStepEventsHeaderLen = 6;
+static constexpr uint16_t kStepEventLen = 12;
+// Fits in a notification with the max MTU.
+static constexpr uint16_t kMaxStepEventsPerBatch =
+    (kMaxRequestedMtu - kMtuOverhead - kStepEventsHeaderLen) / kStepEventLen;
+// Bounds the burst of notifications per task cycle.
+static constexpr int kMaxStepEventsNotificationsPerCycle = 8;
+
+// Accessed only by the step events task.
+struct StepEventsVars {
+  // The batch to send. Kept until it's sent successfully.
+  analyzer::StepEvent batch[kMaxStepEventsPerBatch];
+  uint16_t batch_size = 0;
+  // An event that was popped but couldn't be added to the batch.
+  analyzer::StepEvent lookahead;
+  bool has_lookahead = false;
+  // A stall event that was popped. Kept until it's sent successfully.
+  analyzer::StallEvent stall_event;
+  bool has_stall_event = false;
+  uint8_t buffer[kMaxRequestedMtu];
+};
+
+static StepEventsVars step_events_vars;
+
+// Fills the batch with up to max_size events with consecutive sequence
+// numbers.
+static void fill_step_events_batch(uint16_t max_size) {
+  StepEventsVars& v = step_events_vars;
+  while (v.batch_size < max_size) {
+    if (!v.has_lookahead) {
+      v.has_lookahead = analyzer::pop_step_event(&v.lookahead);
+      if (!v.has_lookahead) {
+        return;
+      }
+    }
+    if (v.batch_size > 0 &&
+        v.lookahead.seq_number != v.batch[v.batch_size - 1].seq_number + 1) {
+      // A gap. Keep for the next batch.
+      return;
+    }
+    v.batch[v.batch_size++] = v.lookahead;
+    v.has_lookahead = false;
+  }
+}
+
+static void serialize_step_events_batch(ble_util::Serializer* ser) {
+  const StepEventsVars& v = step_events_vars;
+  assert(ser->size() == 0);
+  ser->append_uint8(0x50);  // Format id.
+  ser->append_uint32(v.batch[0].seq_number);
+  ser->append_uint8(v.batch_size);
+  for (int i = 0; i < v.batch_size; i++) {
+    const analyzer::StepEvent& event = v.batch[i];
+    ser->append_uint48(event.tick_count);
+    ser->append_uint8((uint8_t)event.increment);
+    ser->append_uint24(std::min(event.ticks_in_step, (uint32_t)0xffffff));
+    ser->append_uint16(event.max_current_in_step);
+  }
+  assert(ser->size() == kStepEventsHeaderLen + v.batch_size * kStepEventLen);
+}
+
+// Stall event notification, format 0xb0, one event per notification:
+//
+//   uint8   format id (0xb0)
+//   uint48  tick_count at the end of the step that raised it
+//   uint32  sequence number, see State::stall_suspects
+//   uint8   reasons, see analyzer::StallReason
+//   uint16  peak current of the step, in ADC counts
+//   uint16  baseline peak current of its speed bucket, in ADC counts
+//   uint24  ticks_in_step, saturated at 0xffffff
+//   uint24  baseline ticks_in_step, saturated at 0xffffff
+static constexpr uint16_t kStallEventLen = 22;
+
+// Sends the analyzer's stall events as notifications, or discards them
+// if not subscribed. Stall events are rare so they share the step
+// events task.
+static void send_stall_events(const ProtextedVars& prot_vars) {
+  StepEventsVars& v = step_events_vars;
+  for (;;) {
+    if (!v.has_stall_event) {
+      v.has_stall_event = analyzer::pop_stall_event(&v.stall_event);
+      if (!v.has_stall_event) {
+        return;
+      }
+    }
+    if (!prot_vars.stall_events_notifications_enabled) {
+      v.has_stall_event = false;
+      continue;
+    }
+    if (prot_vars.congested ||
+        kStallEventLen > prot_vars.conn_mtu - kMtuOverhead) {
+      return;
+    }
+
+    const analyzer::StallEvent& event = v.stall_event;
+    ble_util::Serializer ser(v.buffer, sizeof(v.buffer));
+    ser.append_uint8(0xb0);  // Format id.
+    ser.append_uint48(event.tick_count);
+    ser.append_uint32(event.seq_number);
+    ser.append_uint8(event.reasons);
+    ser.append_uint16(event.peak_current);
+    ser.append_uint16(event.baseline_peak_current);
+    ser.append_uint24(std::min(event.ticks_in_step, (uint32_t)0xffffff));
+    ser.append_uint24(
+        std::min(event.baseline_ticks_in_step, (uint32_t)0xffffff));
+    assert(ser.size() == kStallEventLen);
+    const esp_err_t err = esp_ble_gatts_send_indicate(prot_vars.gatts_if,
+        prot_vars.conn_id, handle_table[ATTR_IDX_STALL_EVENTS_VAL],
+        ser.size(), v.buffer, false);
+    if (err) {
+      // Keep the event and retry in the next cycle.
+      ESP_LOGW(TAG, "Stall event notification failed: 0x%x %s", err,
+          esp_err_to_name(err));
+      return;
+    }
+    v.has_stall_event = false;
+  }
+}
+
+// Drains the analyzer's step and stall events and sends them as
+// notifications.
+static void step_events_task(void* ignored) {
+  StepEventsVars& v = step_events_vars;
+  for (;;) {
+    vTaskDelay(pdMS_TO_TICKS(20));
+
+    ProtextedVars prot_vars;
+    ENTER_MUTEX { prot_vars = protected_vars; }
+    EXIT_MUTEX
+
+    send_stall_events(prot_vars);
+
+    // When not subscribed, discard the events. The subscriber will
+    // start with the next event.
+    if (!prot_vars.step_events_notifications_enabled) {
+      v.batch_size = 0;
+      v.has_lookahead = false;
+      analyzer::StepEvent event;
+      while (analyzer::pop_step_event(&event)) {
+      }
+      continue;
+    }
+
+    if (prot_vars.congested) {
+      continue;
+    }
+
+    const uint16_t max_batch_size = std::min<int>(kMaxStepEventsPerBatch,
+        (prot_vars.conn_mtu - kMtuOverhead - kStepEventsHeaderLen) /
+            kStepEventLen);
+    if (max_batch_size == 0) {
+      continue;
+    }
+
+    for (int i = 0; i < kMaxStepEventsNotificationsPerCycle; i++) {
+      fill_step_events_batch(max_batch_size);
+      if (!v.batch_size) {
+        break;
+      }
+
+      ble_util::Serializer ser(v.buffer, sizeof(v.buffer));
+      serialize_step_events_batch(&ser);
+      const esp_err_t err = esp_ble_gatts_send_indicate(prot_vars.gatts_if,
+          prot_vars.conn_id, handle_table[ATTR_IDX_STEP_EVENTS_VAL],
+          ser.size(), v.buffer, false);
+      if (err) {
+        // Keep the batch and retry in the next cycle.
+        ESP_LOGW(TAG, "Step events notification failed: 0x%x %s", err,
+            esp_err_to_name(err));
+        break;
+      }
+      v.batch_size = 0;
+    }
+  }
+}
+
+// Waveform notification, format 0x80:
+//
+//   uint8   format id (0x80)
+//   uint32  block sequence number
+//   uint32  blocks dropped since boot
+//   uint48  tick_count of the first sample
+//   uint8   decimation
+//   uint16  number of samples, n
+//   n x (v1, v2) zigzag varint deltas, see analyzer::WaveformBlock.
+//
+// Consecutive notifications have consecutive sequence numbers unless
+// blocks were dropped.
+// Bounds the burst of notifications per task cycle.
+static constexpr int kMaxWaveformNotificationsPerCycle = 16;
+
+// Accessed only by the waveform task.
+static uint8_t waveform_buffer[kMaxRequestedMtu];
+
+// Drains the analyzer's waveform blocks and sends them as
+// notifications, back to back.
+static void waveform_task(void* ignored) {
+  for (;;) {
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    ProtextedVars prot_vars;
+    ENTER_MUTEX { prot_vars = protected_vars; }
+    EXIT_MUTEX
+
+    // When not subscribed, discard the blocks.
+    if (!prot_vars.waveform_notifications_enabled) {
+      while (analyzer::peek_waveform_block()) {
+        analyzer::release_waveform_block();
+      }
+      continue;
+    }
+
+    if (prot_vars.congested) {
+      continue;
+    }
+
+    for (int i = 0; i < kMaxWaveformNotificationsPerCycle; i++) {
+      const analyzer::WaveformBlock* block = analyzer::peek_waveform_block();
+      if (!block) {
+        break;
+      }
+      // The block was sized to the MTU when the stream was started.
+      if (kWaveformHeaderLen + block->num_bytes >
+          prot_vars.conn_mtu - kMtuOverhead) {
+        ESP_LOGW(
+            TAG, "Waveform block too long for MTU %hu", prot_vars.conn_mtu);
+        analyzer::release_waveform_block();
+        continue;
+      }
+      ble_util::Serializer ser(waveform_buffer, sizeof(waveform_buffer));
+      ser.append_uint8(0x80);  // Format id.
+      ser.append_uint32(block->seq_number);
+      ser.append_uint32(block->dropped_blocks);
+      ser.append_uint48(block->tick_count);
+      ser.append_uint8(block->decimation);
+      ser.append_uint16(block->num_samples);
+      assert(ser.size() == kWaveformHeaderLen);
+      ser.append_bytes(block->bytes, block->num_bytes);
+      const esp_err_t err = esp_ble_gatts_send_indicate(prot_vars.gatts_if,
+          prot_vars.conn_id, handle_table[ATTR_IDX_WAVEFORM_VAL], ser.size(),
+          waveform_buffer, false);
+      if (err) {
+        // Keep the block and retry in the next cycle.
+        ESP_LOGW(TAG, "Waveform notification failed: 0x%x %s", err,
+            esp_err_to_name(err));
+        break;
+      }
+      analyzer::release_waveform_block();
+    }
+  }
+}
+
 bool is_connected() {
 
   ProtextedVars prot_vars;
@@ -1195,6 +2322,16 @@ void setup(uint8_t hardware_config, uint16_t adc_ticks_per_amp) {
     ESP_LOGE(TAG, "set local  MTU failed, error code = %x", ret);
     assert(0);
   }
+
+  // Lower priority than the acquisition tasks.
+  TaskHandle_t step_events_task_handle = nullptr;
+  xTaskCreate(step_events_task, "STEPEVT", 3000, nullptr, 5,
+      &step_events_task_handle);
+  configASSERT(step_events_task_handle);
+  TaskHandle_t waveform_task_handle = nullptr;
+  xTaskCreate(
+      waveform_task, "WAVEFORM", 3000, nullptr, 5, &waveform_task_handle);
+  configASSERT(waveform_task_handle);
 }
 
 static uint8_t state_notification_buffer[50] = {};
@@ -1228,4 +2365,4 @@ void notify_state_if_enabled(const analyzer::State& state) {
   }
 }
 
-}  // namespace ble_host
\ No newline at end of file
+}  // namespace ble_host
@@ -93,6 +93,12 @@ class Serializer {
     *_p_next++ = v >> 0;
   }
 
+  inline void append_bytes(const uint8_t* bytes, uint16_t len) {
+    check_avail(len);
+    memcpy(_p_next, bytes, len);
+    _p_next += len;
+  }
+
   // Length <= 255.
   inline void append_str(const char* str) {
     size_t len = strlen(str);
@@ -4,6 +4,7 @@
 #include "acquisition/acq_consts.h"
 #include "acquisition/adc_task.h"
 #include "acquisition/analyzer.h"
+#include "acquisition/spectrum_task.h"
 #include "ble/ble_host.h"
 #include "driver/gpio.h"
 #include "esp_event.h"
@@ -23,8 +24,6 @@ static constexpr auto TAG = "main";
 
 static analyzer::State state;
 
-static analyzer::AdcCaptureBuffer capture_buffer;
-
 // Used to blink N times LED 2.
 static Elapsed led2_timer;
 // Down counter. If value > 0, then led2 blinks and bit 0 controls
@@ -84,9 +83,18 @@ static void setup() {
   ESP_LOGI(TAG, "Acqusition settings: %d, %d, %d", settings.offset1,
       settings.offset2, settings.is_reverse_direction);
 
+  // Fetch the ADC settings.
+  nvs_config::AdcSettings adc_settings;
+  if (!nvs_config::read_adc_settings(&adc_settings)) {
+    ESP_LOGW(TAG, "Failed to read ADC settings, will use default.");
+    adc_settings = nvs_config::kDefaultAdcSettings;
+  }
+  ESP_LOGI(TAG, "ADC frame profile: %hhu", adc_settings.frame_profile);
+
   // Init acquisition.
   analyzer::setup(settings);
-  adc_task::setup();
+  adc_task::setup(adc_settings.frame_profile);
+  spectrum_task::setup();
 
   // Determine the hardware confiuration to pass to ble host.
   const uint8_t hardware_config = io::read_hardware_config();
@@ -157,6 +165,7 @@ static void loop() {
   // Dump ADC state
   if (analyzer_counter % 100 == 0) {
     analyzer::dump_state(state);
+    analyzer::dump_stats();
     // adc_task::dump_stats();
   }
 }
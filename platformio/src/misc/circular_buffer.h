@@ -4,6 +4,8 @@
 
 #include <stdint.h>
 
+#include <algorithm>
+
 // Implements a cyclic array with a static max size. Used in
 // IRQ routines and thus optimized for speed.
 template <class T, uint16_t n>
@@ -68,6 +70,20 @@ class CircularBuffer {
     return &items_[i1];
   }
 
+  // Rotates the internal array such that the items are stored in
+  // order, oldest first, at the beginning of the array. O(capacity),
+  // so not for IRQ routines.
+  inline void linearize() {
+    const uint16_t oldest =
+        (next_ >= size_) ? next_ - size_ : next_ + n - size_;
+    std::rotate(&items_[0], &items_[oldest], &items_[n]);
+    next_ = (size_ >= n) ? 0 : size_;
+  }
+
+  // The items as a contiguous array, oldest first. Valid only after
+  // linearize() and until the next mutation.
+  inline const T* linear_items() const { return &items_[0]; }
+
   // Keep up to this number of newest items.
   inline void keep_at_most(uint16_t max_size) {
     // Nothing to do.
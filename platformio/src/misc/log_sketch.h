@@ -0,0 +1,110 @@
+// A fixed memory quantile sketch of non negative integer values, in the
+// style of DDSketch. Values are counted in log spaced bins, each 1/8 of
+// an octave wide, such that a quantile is returned within about 6% of
+// the actual value. The bin of a value is the position of its leading
+// one bit and the 3 bits that follow it, so adding a value is a count
+// leading zeros, two shifts and an increment, without a loop or a
+// division.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+
+class LogSketch {
+ public:
+  // Bins up to 12 bit values, such as ADC counts and step ticks.
+  // Larger values are counted in the last bin.
+  static constexpr int kNumBins = 80;
+  static constexpr uint32_t kMaxValue = 4095;
+
+  LogSketch() { clear(); }
+
+  void clear() { memset(counts_, 0, sizeof(counts_)); }
+
+  // The bin of a value. Values below 8 have a bin each.
+  static inline int bin(uint32_t value) {
+    value = std::min(value, kMaxValue);
+    if (value < 8) {
+      return value;
+    }
+    const int msb = 31 - __builtin_clz(value);
+    return (msb - 2) * 8 + ((value >> (msb - 3)) & 0x7);
+  }
+
+  // The mid value of a bin.
+  static inline uint32_t bin_value(int bin) {
+    if (bin < 8) {
+      return bin;
+    }
+    const int shift = bin / 8 - 1;
+    const uint32_t low = (uint32_t)(8 + bin % 8) << shift;
+    return low + ((1u << shift) >> 1);
+  }
+
+  // A count that reaches the max halves all the counts, which keeps the
+  // quantiles and gives more weight to recent values.
+  inline void add(uint32_t value) {
+    uint16_t& count = counts_[bin(value)];
+    if (++count == UINT16_MAX) {
+      halve();
+    }
+  }
+
+  uint32_t total() const {
+    uint32_t result = 0;
+    for (int i = 0; i < kNumBins; i++) {
+      result += counts_[i];
+    }
+    return result;
+  }
+
+  // The value at the given quantile, in per mille, or 0 if empty.
+  uint32_t quantile(uint16_t per_mille) const {
+    const uint32_t n = total();
+    if (!n) {
+      return 0;
+    }
+    // The rank of the value, in [1, n].
+    const uint32_t rank =
+        std::max<uint32_t>(1, ((uint64_t)n * per_mille + 999) / 1000);
+    uint32_t count = 0;
+    for (int i = 0; i < kNumBins; i++) {
+      count += counts_[i];
+      if (count >= rank) {
+        return bin_value(i);
+      }
+    }
+    return bin_value(kNumBins - 1);
+  }
+
+  // Same as quantile() for each of n ascending per mille values, in a
+  // single pass over the bins.
+  void quantiles(const uint16_t* per_mille, int n, uint16_t* result) const {
+    const uint32_t total_count = total();
+    int q = 0;
+    uint32_t count = 0;
+    for (int i = 0; i < kNumBins && q < n && total_count; i++) {
+      count += counts_[i];
+      while (q < n &&
+          count >= std::max<uint32_t>(1,
+              ((uint64_t)total_count * per_mille[q] + 999) / 1000)) {
+        result[q++] = bin_value(i);
+      }
+    }
+    for (; q < n; q++) {
+      result[q] = total_count ? bin_value(kNumBins - 1) : 0;
+    }
+  }
+
+ private:
+  void halve() {
+    for (int i = 0; i < kNumBins; i++) {
+      counts_[i] >>= 1;
+    }
+  }
+
+  uint16_t counts_[kNumBins];
+};
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <type_traits>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+// Publishes a value from a single writer to multiple readers without
+// locking. The writer never blocks. A reader that overlaps with a
+// write discards its copy and retries.
+//
+// NOTE: Readers may have a higher priority than the writer (e.g. the
+// BLE tasks vs. the ADC task). On a single core the writer can't
+// progress while a reader spins, so a reader that finds a write in
+// progress sleeps for a tick to let the writer complete. With two
+// cores the writer may run on the other core, so the reader first
+// spins for a while, which outlasts a write, before it sleeps.
+template <class T>
+class SeqLock {
+  static_assert(std::is_trivially_copyable<T>::value);
+
+#if CONFIG_FREERTOS_UNICORE
+  static constexpr int kMaxSpins = 0;
+#else
+  // A few tens of microseconds.
+  static constexpr int kMaxSpins = 1000;
+#endif
+
+ public:
+  // Called by the single writer only.
+  inline void write(const T& value) {
+    const uint32_t seq = seq_.load(std::memory_order_relaxed);
+    // Odd value indicates a write in progress.
+    seq_.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(&value_, &value, sizeof(T));
+    seq_.store(seq + 2, std::memory_order_release);
+  }
+
+  // Safe to call from any task.
+  inline void read(T* value) {
+    int spins = 0;
+    for (;;) {
+      const uint32_t seq1 = seq_.load(std::memory_order_acquire);
+      if (!(seq1 & 1)) {
+        memcpy(value, &value_, sizeof(T));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seq_.load(std::memory_order_relaxed) == seq1) {
+          reads_.fetch_add(1, std::memory_order_relaxed);
+          return;
+        }
+      }
+      if (!(seq1 & 1)) {
+        retries_.fetch_add(1, std::memory_order_relaxed);
+      } else if (spins < kMaxSpins) {
+        spins++;
+      } else {
+        retries_.fetch_add(1, std::memory_order_relaxed);
+        vTaskDelay(1);
+      }
+    }
+  }
+
+  // Number of completed reads.
+  inline uint32_t reads() const {
+    return reads_.load(std::memory_order_relaxed);
+  }
+
+  // Number of times a reader had to discard a copy, or to sleep for a
+  // write in progress, and retry. Spins are not counted.
+  inline uint32_t retries() const {
+    return retries_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  // Incremented before and after each write. Odd while a write
+  // is in progress.
+  std::atomic<uint32_t> seq_ = 0;
+  std::atomic<uint32_t> reads_ = 0;
+  std::atomic<uint32_t> retries_ = 0;
+  T value_;
+};
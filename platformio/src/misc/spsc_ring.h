@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+
+// A lock free FIFO between a single producer task and a single
+// consumer task, possibly running on different cores. Items can be
+// filled and consumed in place, without copying. Unlike CircularBuffer,
+// a full ring rejects new items rather than dropping the oldest one.
+//
+// n should be a power of 2.
+template <class T, uint16_t n>
+class SpscRing {
+  static_assert(n && !(n & (n - 1)), "n should be a power of 2");
+
+ public:
+  static constexpr uint16_t capacity = n;
+
+  // Producer only. Returns the slot of the next item to fill in place,
+  // or null if the ring is full. The item is added when
+  // producer_commit() is called.
+  inline T* producer_slot() {
+    const uint32_t head = head_.load(std::memory_order_relaxed);
+    const uint32_t tail = tail_.load(std::memory_order_acquire);
+    return (head - tail >= n) ? nullptr : &items_[head & kMask];
+  }
+
+  // Producer only. Adds the item filled at producer_slot().
+  inline void producer_commit() {
+    head_.store(
+        head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  // Producer only. Returns false if the ring is full.
+  inline bool push(const T& item) {
+    T* slot = producer_slot();
+    if (!slot) {
+      return false;
+    }
+    *slot = item;
+    producer_commit();
+    return true;
+  }
+
+  // Consumer only. Returns the oldest item, or null if the ring is
+  // empty. The item stays valid until consumer_release() is called.
+  inline const T* consumer_slot() {
+    const uint32_t tail = tail_.load(std::memory_order_relaxed);
+    const uint32_t head = head_.load(std::memory_order_acquire);
+    return (tail == head) ? nullptr : &items_[tail & kMask];
+  }
+
+  // Consumer only. Removes the item returned by consumer_slot().
+  inline void consumer_release() {
+    tail_.store(
+        tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  // Consumer only. Returns false if the ring is empty.
+  inline bool pop(T* item) {
+    const T* slot = consumer_slot();
+    if (!slot) {
+      return false;
+    }
+    *item = *slot;
+    consumer_release();
+    return true;
+  }
+
+  // Number of items. A snapshot that may be outdated by the time
+  // it's used.
+  inline uint16_t size() const {
+    return head_.load(std::memory_order_acquire) -
+        tail_.load(std::memory_order_acquire);
+  }
+
+  // Direct access to the internal array. i < capacity. The item may
+  // be concurrently modified by the producer.
+  inline const T* get_internal(uint16_t i) const { return &items_[i]; }
+
+ private:
+  static constexpr uint32_t kMask = n - 1;
+
+  // Free running counters. The difference is the number of items.
+  // head_ is modified only by the producer and tail_ only by the
+  // consumer.
+  std::atomic<uint32_t> head_ = 0;
+  std::atomic<uint32_t> tail_ = 0;
+  T items_[n];
+};
@@ -0,0 +1,52 @@
+// Compact encoding of small signed values, e.g. the deltas between
+// consecutive signal samples. A value is zigzag mapped to an unsigned
+// value (0, -1, 1, -2, ... -> 0, 1, 2, 3, ...) which is then encoded as
+// a little endian base 128 varint, 7 bits per byte, with the MSB set in
+// all bytes but the last.
+
+#pragma once
+
+#include <stdint.h>
+
+namespace zigzag_varint {
+
+// Max encoded length of an int16_t value, and of a delta of two
+// int16_t values.
+constexpr int kMaxInt16Bytes = 3;
+
+inline uint32_t zigzag(int32_t value) {
+  return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+inline int32_t unzigzag(uint32_t value) {
+  return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+// Appends the encoded value at p and returns the position after it.
+inline uint8_t* append(uint8_t* p, int32_t value) {
+  uint32_t v = zigzag(value);
+  while (v >= 0x80) {
+    *p++ = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  *p++ = (uint8_t)v;
+  return p;
+}
+
+// Decodes the value at p, which should not exceed end. Returns the
+// position after it, or null if the value is truncated.
+inline const uint8_t* parse(
+    const uint8_t* p, const uint8_t* end, int32_t* value) {
+  uint32_t v = 0;
+  for (int shift = 0; p < end && shift < 32; shift += 7) {
+    const uint8_t b = *p++;
+    v |= (uint32_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      *value = unzigzag(v);
+      return p;
+    }
+  }
+  return nullptr;
+}
+
+}  // namespace zigzag_varint
@@ -2,6 +2,7 @@
 
 #include "controls.h"
 
+#include "acquisition/adc_task.h"
 #include "acquisition/analyzer.h"
 #include "esp_log.h"
 #include "settings/nvs_config.h"
@@ -37,4 +38,16 @@ bool toggle_direction(bool* new_reversed_direction) {
       write_ok ? "OK" : "FAILED");
   return write_ok;
 }
+
+bool set_adc_frame_profile(uint8_t frame_profile) {
+  if (!adc_task::set_frame_profile(frame_profile)) {
+    ESP_LOGE(TAG, "Invalid frame profile: %hhu", frame_profile);
+    return false;
+  }
+  const nvs_config::AdcSettings settings = {.frame_profile = frame_profile};
+  const bool write_ok = nvs_config::write_adc_settings(settings);
+  ESP_LOGI(TAG, "Frame profile %hhu. Write %s", frame_profile,
+      write_ok ? "OK" : "FAILED");
+  return write_ok;
+}
 }  // namespace controls
@@ -1,9 +1,14 @@
 
 #pragma once
 
+#include <stdint.h>
+
 namespace controls {
 
 bool zero_calibration();
 bool toggle_direction(bool* new_reversed_direction);
+// Applies and persists a DMA frame profile. Returns false if the
+// profile is invalid or if it couldn't be persisted.
+bool set_adc_frame_profile(uint8_t frame_profile);
 
 }  // namespace controls
@@ -2,8 +2,6 @@
 #include "settings/nvs_config.h"
 
 #include "esp_log.h"
-#include "freertos/FreeRTOS.h"
-#include "freertos/task.h"
 #include "io/io.h"
 #include "nvs.h"
 #include "nvs_flash.h"
@@ -17,9 +15,24 @@ static constexpr auto TAG = "nvs_config";
 
 static constexpr auto kStorageNamespace = "settings";
 
+// NOTE: The writes below rely on ESP-IDF's flash operations to keep the
+// rest of the system safe, on one or two cores. While flash is written
+// the caches are disabled, the other core, if any, is stalled in an
+// IRAM loop, and the interrupts that are not IRAM safe are masked, for
+// up to 10ms as measured on an oscilloscope. That stalls the adc and
+// analyzer tasks wherever they are pinned, and defers the ADC driver's
+// interrupt, which is not IRAM safe (CONFIG_ADC_CONTINUOUS_ISR_IRAM_SAFE
+// is not set). The ADC frames that the DMA completes meanwhile may be
+// lost. We used to also call taskDISABLE_INTERRUPTS around the writes,
+// which masked only the current core, and with two cores blocks the
+// IPC that ESP-IDF uses to stall the other core.
+
 const AcquistionSettings kDefaultAcquisitionSettings = {
     .offset1 = 1800, .offset2 = 1800, .is_reverse_direction = false};
 
+// Same as adc_task::kDefaultFrameProfile.
+const AdcSettings kDefaultAdcSettings = {.frame_profile = 1};
+
 const BleSettings kDefaultBleDefaultSetting = {.nickname = ""};
 
 [[nodiscard]] bool read_acquisition_settings(AcquistionSettings* settings) {
@@ -80,19 +93,9 @@ const BleSettings kDefaultBleDefaultSetting = {.nickname = ""};
     return false;
   }
 
-  // TODO: What is the recomanded way to avoid crashing while
-  // writing to flash while interrupts are active? Currently we use
-  // taskDISABLE_INTERRUPTS, which disables only on the current
-  // core, and configure menuconfig for a single core FreeRTOS.
-  //
-  // Interrupts are disabled here for up to 10ms as measured
-  // on osciloscope.
-
   // Write offset1.
   if (err == ESP_OK) {
-    taskDISABLE_INTERRUPTS();
     err = nvs_set_i16(my_handle, "offset1", settings.offset1);
-    taskENABLE_INTERRUPTS();
     if (err != ESP_OK) {
       ESP_LOGE(TAG,
           "write_acquisition_settings() failed to write offset1: %04x", err);
@@ -101,9 +104,7 @@ const BleSettings kDefaultBleDefaultSetting = {.nickname = ""};
 
   // Write offset2.
   if (err == ESP_OK) {
-    taskDISABLE_INTERRUPTS();
     err = nvs_set_i16(my_handle, "offset2", settings.offset2);
-    taskENABLE_INTERRUPTS();
     if (err != ESP_OK) {
       ESP_LOGE(TAG,
           "write_acquisition_settings() failed to write offset2: %04x", err);
@@ -112,10 +113,8 @@ const BleSettings kDefaultBleDefaultSetting = {.nickname = ""};
 
   // Write is_reverse flag.
   if (err == ESP_OK) {
-    taskDISABLE_INTERRUPTS();
     err = nvs_set_u8(
         my_handle, "is_reverse", settings.is_reverse_direction ? 0 : 1);
-    taskENABLE_INTERRUPTS();
     if (err != ESP_OK) {
       ESP_LOGE(TAG,
           "write_acquisition_settings() failed to write is_reverse: %04x", err);
@@ -124,9 +123,7 @@ const BleSettings kDefaultBleDefaultSetting = {.nickname = ""};
 
   // Commit updates.
   if (err == ESP_OK) {
-    taskDISABLE_INTERRUPTS();
     err = nvs_commit(my_handle);
-    taskENABLE_INTERRUPTS();
     if (err != ESP_OK) {
       ESP_LOGE(TAG, "write_acquisition_settings() failed to commit: %04x", err);
     }
@@ -137,6 +134,64 @@ const BleSettings kDefaultBleDefaultSetting = {.nickname = ""};
   return err == ESP_OK;
 }
 
+[[nodiscard]] bool read_adc_settings(AdcSettings* settings) {
+  // Open
+  nvs_handle_t my_handle = -1;
+  esp_err_t err = nvs_open(kStorageNamespace, NVS_READONLY, &my_handle);
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "read_adc_settings() failed to open nvs: %04x", err);
+    return false;
+  }
+
+  // Read frame profile.
+  uint8_t frame_profile;
+  err = nvs_get_u8(my_handle, "frame_profile", &frame_profile);
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "read_adc_settings() failed read frame_profile: %04x", err);
+  }
+
+  // Close.
+  nvs_close(my_handle);
+
+  // Handle results.
+  if (err != ESP_OK) {
+    return false;
+  }
+  settings->frame_profile = frame_profile;
+  return true;
+}
+
+[[nodiscard]] bool write_adc_settings(const AdcSettings& settings) {
+  // Open
+  nvs_handle_t my_handle = -1;
+  esp_err_t err = nvs_open(kStorageNamespace, NVS_READWRITE, &my_handle);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "write_adc_settings() failed to open nvs: %04x", err);
+    return false;
+  }
+
+  // Write frame profile.
+  if (err == ESP_OK) {
+    err = nvs_set_u8(my_handle, "frame_profile", settings.frame_profile);
+    if (err != ESP_OK) {
+      ESP_LOGE(TAG,
+          "write_adc_settings() failed to write frame_profile: %04x", err);
+    }
+  }
+
+  // Commit updates.
+  if (err == ESP_OK) {
+    err = nvs_commit(my_handle);
+    if (err != ESP_OK) {
+      ESP_LOGE(TAG, "write_adc_settings() failed to commit: %04x", err);
+    }
+  }
+
+  // Close.
+  nvs_close(my_handle);
+  return err == ESP_OK;
+}
+
 [[nodiscard]] bool write_ble_settings(const BleSettings& settings) {
   // Open
   nvs_handle_t my_handle = -1;
@@ -146,14 +201,6 @@ const BleSettings kDefaultBleDefaultSetting = {.nickname = ""};
     return false;
   }
 
-  // TODO: What is the recomanded way to avoid crashing while
-  // writing to flash while interrupts are active? Currently we use
-  // taskDISABLE_INTERRUPTS, which disables only on the current
-  // core, and configure menuconfig for a single core FreeRTOS.
-  //
-  // Interrupts are disabled here for up to 10ms as measured
-  // on osciloscope.
-
   // Verify that the string contains a null terminator.
   const int len = strlen(settings.nickname);
   if (len >= sizeof(settings.nickname)) {
@@ -163,9 +210,7 @@ const BleSettings kDefaultBleDefaultSetting = {.nickname = ""};
 
   // Write nickname.
   if (err == ESP_OK) {
-    taskDISABLE_INTERRUPTS();
     err = nvs_set_str(my_handle, "ble_nickname", settings.nickname);
-    taskENABLE_INTERRUPTS();
     if (err != ESP_OK) {
       ESP_LOGE(TAG, "write_ble_settings() failed to write nickname: %04x", err);
     } else {
@@ -176,9 +221,7 @@ const BleSettings kDefaultBleDefaultSetting = {.nickname = ""};
 
   // Commit updates.
   if (err == ESP_OK) {
-    taskDISABLE_INTERRUPTS();
     err = nvs_commit(my_handle);
-    taskENABLE_INTERRUPTS();
     if (err != ESP_OK) {
       ESP_LOGE(TAG, "write_ble_settings() failed to commit: %04x", err);
     } else {
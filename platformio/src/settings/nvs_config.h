@@ -24,6 +24,16 @@ extern const AcquistionSettings kDefaultAcquisitionSettings;
 [[nodiscard]] bool write_acquisition_settings(
     const AcquistionSettings& settings);
 
+struct AdcSettings {
+  // The DMA frame profile. See adc_task::kNumFrameProfiles.
+  uint8_t frame_profile;
+};
+
+extern const AdcSettings kDefaultAdcSettings;
+
+[[nodiscard]] bool read_adc_settings(AdcSettings* settings);
+[[nodiscard]] bool write_adc_settings(const AdcSettings& settings);
+
 // Null terminated str. Max len 16 chars.
 typedef char BleNickname[17];
 
@@ -98,6 +98,12 @@ parser.add_argument("--steps-per-unit",
                     type=float,
                     default=1.0,
                     help="Steps per unit")
+parser.add_argument("--histogram-window",
+                    dest="histogram_window",
+                    type=int,
+                    default=0,
+                    help="Show the histograms of the last n seconds, up to 60. "
+                    "0 for the histograms since the last reset.")
 # Per https://github.com/hbldh/bleak/issues/1223 client.disconnect() may be
 # problematic on some systems, so we provide this heuristics as a workaround,
 parser.add_argument("--cleanup-forcing",
@@ -160,6 +166,10 @@ if args.set_nickname is not None:
     print(f"Device updated with nickname [{args.set_nickname}].")
     sys.exit()
 
+if args.histogram_window:
+    main_event_loop.run_until_complete(
+        probe.write_command_set_histogram_window(args.histogram_window))
+
 # An object that tracks the incremental fetch of the capture
 # signal. We don't perform all of them at once to avoid choppy
 # state chart updates.
@@ -413,7 +423,7 @@ async def timer_handler_tasks(task_index: int) -> bool:
         task_read_current_histogram = None
         graph4.setOpts(x=histogram.centers(),
                        height=histogram.heights(),
-                       width=0.75 * histogram.bucket_width())
+                       width=[0.75 * w for w in histogram.bucket_widths()])
         return True
 
     # Read time histogram
@@ -431,7 +441,7 @@ async def timer_handler_tasks(task_index: int) -> bool:
         task_read_time_histogram = None
         graph5.setOpts(x=histogram.centers(),
                        height=histogram.heights(),
-                       width=0.75 * histogram.bucket_width())
+                       width=[0.75 * w for w in histogram.bucket_widths()])
         return True
 
     # Read distance histogram.
@@ -449,7 +459,7 @@ async def timer_handler_tasks(task_index: int) -> bool:
         task_read_distance_histogram = None
         graph6.setOpts(x=histogram.centers(),
                        height=histogram.heights(),
-                       width=0.75 * histogram.bucket_width())
+                       width=[0.75 * w for w in histogram.bucket_widths()])
         return True
 
     # Next chunk of fetching the capture signal.
@@ -473,6 +483,9 @@ async def timer_handler_tasks(task_index: int) -> bool:
         plot8.clear()
         plot8.plot(capture_signal.times_sec(), capture_signal.amps_a(), pen='yellow')
         plot8.plot(capture_signal.times_sec(), capture_signal.amps_b(), pen='skyblue')
+        if capture_signal.is_envelope():
+            plot8.plot(capture_signal.times_sec(), capture_signal.min_amps_a(), pen='yellow')
+            plot8.plot(capture_signal.times_sec(), capture_signal.min_amps_b(), pen='skyblue')
         plot7.clear()
         plot7.plot(capture_signal.amps_a(), capture_signal.amps_b(), pen='greenyellow')
         return True
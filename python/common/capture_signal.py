@@ -2,18 +2,44 @@
 
 from __future__ import annotations
 import logging
-from typing import List
+from typing import List, Optional
 from common.probe_info import ProbeInfo
+from common.waveform_stream import parse_zigzag_varint
 
 logger = logging.getLogger(__name__)
 
 
+# The segments of a segmented capture. The items of the capture are the
+# segments one after the other, each of items_per_segment items.
+class CaptureSegments:
+
+    def __init__(self, items_per_segment: int, pre_trigger_items: int,
+                 trigger_times_secs: List[float]):
+        self.items_per_segment = items_per_segment
+        # Items of each segment up to and including its trigger.
+        self.pre_trigger_items = pre_trigger_items
+        # The device time of the trigger of each segment.
+        self.trigger_times_secs = trigger_times_secs
+
+    def num_segments(self) -> int:
+        return len(self.trigger_times_secs)
+
+
 class CaptureSignal:
 
-    def __init__(self, times_sec: List[float], amps_a: List[float], amps_b: List[float]):
+    def __init__(self, times_sec: List[float], amps_a: List[float], amps_b: List[float],
+                 min_amps_a: Optional[List[float]] = None,
+                 min_amps_b: Optional[List[float]] = None,
+                 segments: Optional[CaptureSegments] = None):
         self.__times_sec = times_sec
+        # In envelope capture mode, the max of each divider window.
         self.__amps_a = amps_a
         self.__amps_b = amps_b
+        # The min of each divider window in envelope capture mode, else None.
+        self.__min_amps_a = min_amps_a
+        self.__min_amps_b = min_amps_b
+        # The segments of a segmented capture, else None.
+        self.__segments = segments
 
     @classmethod
     def decode(cls, packets: List[bytearray], probe_info: ProbeInfo) -> (CaptureSignal | None):
@@ -23,27 +49,80 @@ class CaptureSignal:
 
         divider = int.from_bytes(packets[0][4:5], byteorder='big', signed=False)
         time_step_secs = divider / probe_info.time_ticks_per_sec()
+        # Envelope items have also the min a/b pair.
+        is_envelope = (packets[0][1] & 0x02) != 0
+        bytes_per_item = 8 if is_envelope else 4
+
+        def amps(packet: bytearray, offset: int) -> float:
+            ticks = int.from_bytes(packet[offset:offset + 2], byteorder='big', signed=True)
+            return ticks / probe_info.current_ticks_per_amp()
+
+        # Format 0x42 has the same values as zigzag varint deltas from the
+        # previous item of the same packet.
+        def unpack(packet: bytearray, offset: int, n: int) -> (List[List[float]] | None):
+            values_per_item = bytes_per_item // 2
+            last = [0] * values_per_item
+            result = []
+            for _ in range(n):
+                for j in range(values_per_item):
+                    parsed = parse_zigzag_varint(packet, offset)
+                    if not parsed:
+                        return None
+                    last[j] += parsed[0]
+                    offset = parsed[1]
+                result.append([v / probe_info.current_ticks_per_amp() for v in last])
+            return result
 
         # Decode data points.
         time_sec_list = []
         amps_a_list = []
         amps_b_list = []
+        min_amps_a_list = [] if is_envelope else None
+        min_amps_b_list = [] if is_envelope else None
+        segments = None
         for packet in packets:
             # NOTE: For now we ignore the packet sequence number and offset field and
             # assume that the packets match.
             n = int.from_bytes(packet[5:7], byteorder='big', signed=False)
+            # 9 is the byte offset of the items in the packet, unless the
+            # packet has the segments info.
+            items_offset = 9
+            if packet[1] & 0x04:
+                num_segments = packet[9]
+                items_per_segment = int.from_bytes(packet[10:12], byteorder='big', signed=False)
+                pre_trigger_items = int.from_bytes(packet[12:14], byteorder='big', signed=False)
+                trigger_times_secs = []
+                for i in range(num_segments):
+                    offset = 14 + 6 * i
+                    ticks = int.from_bytes(packet[offset:offset + 6], byteorder='big',
+                                           signed=False)
+                    trigger_times_secs.append(ticks / probe_info.time_ticks_per_sec())
+                segments = CaptureSegments(items_per_segment, pre_trigger_items,
+                                           trigger_times_secs)
+                items_offset = 14 + 6 * num_segments
+            if packet[0] == 0x42:
+                items = unpack(packet, items_offset, n)
+                if items is None:
+                    logger.error(f"Truncated capture signal packet.")
+                    return None
+                for item in items:
+                    time_sec_list.append(len(amps_a_list) * time_step_secs)
+                    amps_a_list.append(item[0])
+                    amps_b_list.append(item[1])
+                    if is_envelope:
+                        min_amps_a_list.append(item[2])
+                        min_amps_b_list.append(item[3])
+                continue
             for i in range(n):
-                # 9 is the byte Offset of the a/b pair in the packet.
-                base = 9 + (i * 4)
-                ticks_a = int.from_bytes(packet[base:base + 2], byteorder='big', signed=True)
-                ticks_b = int.from_bytes(packet[base + 2:base + 4], byteorder='big', signed=True)
-                time_sec = len(amps_a_list) * time_step_secs
-                amps_a = ticks_a / probe_info.current_ticks_per_amp()
-                amps_b = ticks_b / probe_info.current_ticks_per_amp()
-                time_sec_list.append(time_sec)
-                amps_a_list.append(amps_a)
-                amps_b_list.append(amps_b)
-        return CaptureSignal(time_sec_list, amps_a_list, amps_b_list)
+                base = items_offset + (i * bytes_per_item)
+                time_sec_list.append(len(amps_a_list) * time_step_secs)
+                amps_a_list.append(amps(packet, base))
+                amps_b_list.append(amps(packet, base + 2))
+                if is_envelope:
+                    min_amps_a_list.append(amps(packet, base + 4))
+                    min_amps_b_list.append(amps(packet, base + 6))
+        return CaptureSignal(time_sec_list, amps_a_list, amps_b_list, min_amps_a_list,
+                             min_amps_b_list, segments)
 
     def times_sec(self) -> List[float]:
         return self.__times_sec
@@ -53,3 +132,15 @@ class CaptureSignal:
 
     def amps_b(self) -> List[float]:
         return self.__amps_b
+
+    def is_envelope(self) -> bool:
+        return self.__min_amps_a is not None
+
+    def min_amps_a(self) -> Optional[List[float]]:
+        return self.__min_amps_a
+
+    def min_amps_b(self) -> Optional[List[float]]:
+        return self.__min_amps_b
+
+    def segments(self) -> Optional[CaptureSegments]:
+        return self.__segments
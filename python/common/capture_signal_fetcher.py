@@ -17,6 +17,9 @@ class CaptureSignalFetcher:
         self.__probe = probe
         self.__packets = []
         self.__new_cycle = True
+        # Opt in to the delta coded capture format, if the device supports
+        # it, before the first snapshot.
+        self.__format_selected = False
 
     def reset(self):
         self.__packets = []
@@ -25,6 +28,9 @@ class CaptureSignalFetcher:
     async def loop(self) -> (CaptureSignal | None):
         # Send command to snap a new capture signal.
         if self.__new_cycle:
+            if not self.__format_selected:
+                await self.__probe.write_command_set_capture_format(0x42)
+                self.__format_selected = True
             await self.__probe.write_command_capture_signal_snapshot()
             self.__packets = []
             self.__new_cycle = False
@@ -37,7 +43,7 @@ class CaptureSignalFetcher:
             self.reset()
             return None
 
-        if (packet[0] != 0x40):
+        if (packet[0] not in (0x40, 0x42)):
             logger.error(f"Unexpected capture signal packet format id: {packet[0]}.")
             self.reset()
             return None
@@ -0,0 +1,83 @@
+# Represents the spectrum summary of a signal capture, which the device
+# computes with a fixed point FFT of each capture. Gives the fundamental
+# electrical frequency, the amplitudes of its harmonics and the THD of
+# each coil's current without transferring the capture itself.
+
+from __future__ import annotations
+
+import logging
+from typing import List
+
+from common.probe_info import ProbeInfo
+
+logger = logging.getLogger(__name__)
+
+
+class ChannelSpectrum:
+
+    def __init__(self, fundamental_hz: float, thd: float, harmonic_amps: List[float]):
+        # 0 if the channel has no signal.
+        self.fundamental_hz = fundamental_hz
+        # Total harmonic distortion, as a ratio of the fundamental.
+        self.thd = thd
+        # Of the fundamental, [0], and its harmonics. 0 for harmonics above
+        # the Nyquist frequency.
+        self.harmonic_amps = harmonic_amps
+
+    def __str__(self):
+        harmonics = ", ".join(f"{a:.3f}" for a in self.harmonic_amps)
+        return f"{self.fundamental_hz:8.1f}Hz, THD {self.thd * 100:5.1f}%, [{harmonics}]A"
+
+
+class CaptureSpectrum:
+
+    def __init__(self, seq_number: int, capture_seq_number: int, capture_divider: int,
+                 analysis_cycles: int, channels: List[ChannelSpectrum]):
+        # Number of analyzed captures, 0 if none yet. Unchanged if no
+        # capture was analyzed since the last read.
+        self.seq_number = seq_number
+        self.capture_seq_number = capture_seq_number
+        self.capture_divider = capture_divider
+        # Device CPU cycles of the analysis.
+        self.analysis_cycles = analysis_cycles
+        # Of the two coils.
+        self.channels = channels
+
+    @classmethod
+    def decode(cls, data: bytearray, probe_info: ProbeInfo) -> (CaptureSpectrum | None):
+        if len(data) < 13:
+            logger.error(f"Invalid capture spectrum data length {len(data)}.")
+            return None
+        format = data[0]
+        if format != 0xc0:
+            logger.error(f"Unexpected capture spectrum format {format}.")
+            return None
+        seq_number = int.from_bytes(data[1:5], byteorder='big', signed=False)
+        capture_seq_number = int.from_bytes(data[5:7], byteorder='big', signed=False)
+        capture_divider = data[7]
+        analysis_cycles = int.from_bytes(data[8:12], byteorder='big', signed=False)
+        num_harmonics = data[12]
+        channel_len = 6 + 2 * num_harmonics
+        if len(data) != 13 + 2 * channel_len:
+            logger.error(f"Invalid capture spectrum data length {len(data)} "
+                         f"for {num_harmonics} harmonics.")
+            return None
+        ticks_per_amp = probe_info.current_ticks_per_amp()
+        channels = []
+        for i in range(2):
+            offset = 13 + i * channel_len
+            millihz = int.from_bytes(data[offset:offset + 4], byteorder='big', signed=False)
+            thd_per_mille = int.from_bytes(data[offset + 4:offset + 6], byteorder='big',
+                                           signed=False)
+            harmonic_amps = []
+            for j in range(num_harmonics):
+                k = offset + 6 + 2 * j
+                amplitude = int.from_bytes(data[k:k + 2], byteorder='big', signed=False)
+                harmonic_amps.append(amplitude / ticks_per_amp)
+            channels.append(ChannelSpectrum(millihz / 1000, thd_per_mille / 1000, harmonic_amps))
+        return CaptureSpectrum(seq_number, capture_seq_number, capture_divider, analysis_cycles,
+                               channels)
+
+    def __str__(self):
+        return f"#{self.seq_number} capture {self.capture_seq_number}/{self.capture_divider}:" \
+            f" A: {self.channels[0]}, B: {self.channels[1]}"
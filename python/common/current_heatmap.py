@@ -0,0 +1,98 @@
+# Represents a fetched speed x peak current histogram. The device returns
+# it in pages of rows, one page per read.
+
+from __future__ import annotations
+
+import logging
+from typing import List
+from common.probe_info import ProbeInfo
+
+logger = logging.getLogger(__name__)
+
+
+class CurrentHeatmapPage:
+
+    def __init__(self, has_more: bool, seq_number: int, num_rows: int, num_bins: int,
+                 bin_width_ticks: int, first_row: int, rows: List[List[int]]):
+        self.has_more = has_more
+        # Pages of the same snapshot have the same sequence number.
+        self.seq_number = seq_number
+        # Total rows and bins of the histogram. A row per speed bucket.
+        self.num_rows = num_rows
+        self.num_bins = num_bins
+        # Peak current bin width in ADC ticks.
+        self.bin_width_ticks = bin_width_ticks
+        self.first_row = first_row
+        self.rows = rows
+
+    @classmethod
+    def decode(cls, data: bytearray) -> (CurrentHeatmapPage | None):
+        if len(data) < 10:
+            logger.error(f"Invalid heatmap data length {len(data)}.")
+            return None
+        format = data[0]
+        if format != 0x90:
+            logger.error(f"Unexpected heatmap format {format}.")
+            return None
+        has_more = (data[1] & 0x01) != 0
+        seq_number = int.from_bytes(data[2:4], byteorder='big', signed=False)
+        num_rows = data[4]
+        num_bins = data[5]
+        bin_width_ticks = int.from_bytes(data[6:8], byteorder='big', signed=False)
+        first_row = data[8]
+        page_rows = data[9]
+        if len(data) != 10 + 2 * num_bins * page_rows or first_row + page_rows > num_rows:
+            logger.error(f"Invalid heatmap page, length {len(data)}, rows {first_row}+{page_rows}.")
+            return None
+        rows = []
+        offset = 10
+        for i in range(page_rows):
+            row = []
+            for j in range(num_bins):
+                row.append(int.from_bytes(data[offset:offset + 2], byteorder='big', signed=False))
+                offset += 2
+            rows.append(row)
+        return CurrentHeatmapPage(has_more, seq_number, num_rows, num_bins, bin_width_ticks,
+                                  first_row, rows)
+
+
+class CurrentHeatmap:
+
+    def __init__(self, bucket_edges: List[float], bin_edges: List[float],
+                 counts: List[List[int]]):
+        # len(counts) + 1 speed edges, in units/sec.
+        self.__bucket_edges = bucket_edges
+        # Peak current bin edges in amps. The last bin is open ended.
+        self.__bin_edges = bin_edges
+        # counts[i][j] is the number of steps in speed bucket i with peak
+        # current in bin j. Saturated at 65535.
+        self.__counts = counts
+
+    # Assembles the pages of a single snapshot, in order from the first row.
+    @classmethod
+    def from_pages(cls, pages: List[CurrentHeatmapPage], probe_info: ProbeInfo,
+                   steps_per_unit: float) -> (CurrentHeatmap | None):
+        if not pages or pages[0].first_row != 0 or pages[-1].has_more:
+            logger.error(f"Incomplete heatmap pages.")
+            return None
+        counts = []
+        for page in pages:
+            if page.seq_number != pages[0].seq_number or page.first_row != len(counts):
+                logger.error(f"Inconsistent heatmap pages.")
+                return None
+            counts.extend(page.rows)
+        bucket_edges = [
+            e / steps_per_unit for e in probe_info.histogram_bucket_edges(len(counts))
+        ]
+        amps_per_bin = pages[0].bin_width_ticks / probe_info.current_ticks_per_amp()
+        bin_edges = [i * amps_per_bin for i in range(pages[0].num_bins + 1)]
+        return CurrentHeatmap(bucket_edges, bin_edges, counts)
+
+    def bucket_edges(self) -> List[float]:
+        return self.__bucket_edges
+
+    def bin_edges(self) -> List[float]:
+        return self.__bin_edges
+
+    def counts(self) -> List[List[int]]:
+        return self.__counts
@@ -0,0 +1,92 @@
+# Represents a chunk of a deep signal capture, as returned by a single
+# capture read after selecting the deep capture, and the assembled
+# capture.
+
+from __future__ import annotations
+
+import logging
+from typing import List, Optional
+
+from common.capture_signal import CaptureSignal
+from common.probe_info import ProbeInfo
+
+logger = logging.getLogger(__name__)
+
+# Values of DeepCaptureChunk.state.
+DEEP_CAPTURE_IDLE = 0
+DEEP_CAPTURE_ARMED = 1
+DEEP_CAPTURE_FILLING = 2
+DEEP_CAPTURE_DONE = 3
+
+
+class DeepCaptureChunk:
+
+    def __init__(self, has_more: bool, is_envelope: bool, state: int, seq_number: int,
+                 divider: int, capacity: int, size: int, trigger_tick_count: int,
+                 start_index: int, values: List[List[int]]):
+        # True if more items are available now, after this chunk.
+        self.has_more = has_more
+        self.is_envelope = is_envelope
+        self.state = state
+        self.seq_number = seq_number
+        self.divider = divider
+        # Item capacity and items filled so far.
+        self.capacity = capacity
+        self.size = size
+        self.trigger_tick_count = trigger_tick_count
+        self.start_index = start_index
+        # Per item, [v1, v2] or in envelope mode [v1, v2, min_v1, min_v2],
+        # in ADC ticks.
+        self.values = values
+
+    @classmethod
+    def decode(cls, data: bytearray) -> (DeepCaptureChunk | None):
+        if len(data) < 26:
+            logger.error(f"Invalid deep capture data length {len(data)}.")
+            return None
+        format = data[0]
+        if format != 0x41:
+            logger.error(f"Unexpected deep capture format {format}.")
+            return None
+        flags = data[1]
+        is_envelope = (flags & 0x02) != 0
+        values_per_item = 4 if is_envelope else 2
+        n = int.from_bytes(data[24:26], byteorder='big', signed=False)
+        if len(data) != 26 + 2 * values_per_item * n:
+            logger.error(f"Invalid deep capture data length {len(data)} for {n} items.")
+            return None
+        values = []
+        for i in range(n):
+            base = 26 + 2 * values_per_item * i
+            values.append([
+                int.from_bytes(data[offset:offset + 2], byteorder='big', signed=True)
+                for offset in range(base, base + 2 * values_per_item, 2)
+            ])
+        return DeepCaptureChunk(
+            has_more=(flags & 0x01) != 0,
+            is_envelope=is_envelope,
+            state=data[2],
+            seq_number=int.from_bytes(data[3:5], byteorder='big', signed=False),
+            divider=data[5],
+            capacity=int.from_bytes(data[6:10], byteorder='big', signed=False),
+            size=int.from_bytes(data[10:14], byteorder='big', signed=False),
+            trigger_tick_count=int.from_bytes(data[14:20], byteorder='big', signed=False),
+            start_index=int.from_bytes(data[20:24], byteorder='big', signed=False),
+            values=values)
+
+    @classmethod
+    def to_capture_signal(cls, chunks: List[DeepCaptureChunk],
+                          probe_info: ProbeInfo) -> Optional[CaptureSignal]:
+        """Assembles consecutive chunks, starting at item 0, to a capture signal."""
+        if not chunks:
+            return None
+        values = [item for chunk in chunks for item in chunk.values]
+        time_step_secs = chunks[0].divider / probe_info.time_ticks_per_sec()
+        ticks_per_amp = probe_info.current_ticks_per_amp()
+        times_sec = [i * time_step_secs for i in range(len(values))]
+        amps_a = [item[0] / ticks_per_amp for item in values]
+        amps_b = [item[1] / ticks_per_amp for item in values]
+        if not chunks[0].is_envelope:
+            return CaptureSignal(times_sec, amps_a, amps_b)
+        return CaptureSignal(times_sec, amps_a, amps_b, [item[2] / ticks_per_amp for item in values],
+                             [item[3] / ticks_per_amp for item in values])
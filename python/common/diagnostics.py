@@ -0,0 +1,76 @@
+# Represents a report of the acquisition health counters. Used to tell
+# when the BLE load starves the acquisition.
+
+from __future__ import annotations
+
+import logging
+
+from common.probe_info import ProbeInfo
+
+logger = logging.getLogger(__name__)
+
+
+class Diagnostics:
+
+    def __init__(self, timestamp_secs: float, ticks_with_errors: int, lost_pairs: int,
+                 bad_pairs: int, pool_overflow_frames: int, dropped_frames: int,
+                 short_reads: int, read_errors: int, backlog_frames: int,
+                 max_backlog_frames: int, pool_frames: int, frame_profile: int,
+                 pairs_per_frame: int, driver_restarts: int, zero_copy: bool,
+                 overwritten_frames: int):
+        self.timestamp_secs = timestamp_secs
+        # Since the last data reset. Ticks with errors include the lost pairs.
+        self.ticks_with_errors = ticks_with_errors
+        self.lost_pairs = lost_pairs
+        # Since the device boot.
+        self.bad_pairs = bad_pairs
+        self.pool_overflow_frames = pool_overflow_frames
+        self.dropped_frames = dropped_frames
+        self.short_reads = short_reads
+        self.read_errors = read_errors
+        # DMA pool usage, in frames.
+        self.backlog_frames = backlog_frames
+        self.max_backlog_frames = max_backlog_frames
+        self.pool_frames = pool_frames
+        # The DMA frame profile and its frame size.
+        self.frame_profile = frame_profile
+        self.pairs_per_frame = pairs_per_frame
+        self.driver_restarts = driver_restarts
+        # The acquisition mode. Overwritten frames apply to zero copy only.
+        self.zero_copy = zero_copy
+        self.overwritten_frames = overwritten_frames
+
+    @classmethod
+    def decode(cls, data: bytearray, probe_info: ProbeInfo) -> (Diagnostics | None):
+        if len(data) != 53:
+            logger.error(f"Invalid diagnostics data length {len(data)}.")
+            return None
+        format = data[0]
+        if format != 0x60:
+            logger.error(f"Unexpected diagnostics format {format}.")
+            return None
+        ticks = int.from_bytes(data[1:7], byteorder='big', signed=False)
+        u32 = [
+            int.from_bytes(data[offset:offset + 4], byteorder='big', signed=False)
+            for offset in range(7, 35, 4)
+        ]
+        u16 = [
+            int.from_bytes(data[offset:offset + 2], byteorder='big', signed=False)
+            for offset in range(35, 41, 2)
+        ]
+        frame_profile = data[41]
+        pairs_per_frame = int.from_bytes(data[42:44], byteorder='big', signed=False)
+        driver_restarts = int.from_bytes(data[44:48], byteorder='big', signed=False)
+        zero_copy = data[48] != 0
+        overwritten_frames = int.from_bytes(data[49:53], byteorder='big', signed=False)
+        return Diagnostics(ticks / probe_info.time_ticks_per_sec(), *u32, *u16, frame_profile,
+                           pairs_per_frame, driver_restarts, zero_copy, overwritten_frames)
+
+    def __str__(self):
+        return f"TS:{self.timestamp_secs:.3f}, errors:{self.ticks_with_errors}" \
+            f" (lost:{self.lost_pairs}), bad:{self.bad_pairs}," \
+            f" overflows:{self.pool_overflow_frames}, dropped:{self.dropped_frames}," \
+            f" short:{self.short_reads}, read_errors:{self.read_errors}," \
+            f" backlog:{self.backlog_frames}/{self.pool_frames} (max {self.max_backlog_frames})," \
+            f" profile:{self.frame_profile} ({self.pairs_per_frame} pairs)," \
+            f" zero_copy:{self.zero_copy} (overwritten:{self.overwritten_frames})"
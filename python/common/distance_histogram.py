@@ -2,6 +2,7 @@
 
 from __future__ import annotations
 import logging
+from typing import List
 from common.probe_info import ProbeInfo
 
 logger = logging.getLogger(__name__)
@@ -9,8 +10,9 @@ logger = logging.getLogger(__name__)
 
 class DistanceHistogram:
 
-    def __init__(self, bucket_width: int, buckets: List[float]):
-        self.__bucket_width: int = bucket_width
+    def __init__(self, bucket_edges: List[float], buckets: List[float]):
+        # len(buckets) + 1 edges, in units/sec.
+        self.__bucket_edges: List[float] = bucket_edges
         self.__buckets: List[float] = buckets
 
     @classmethod
@@ -33,20 +35,19 @@ class DistanceHistogram:
             buckets.append(distance_percents)
 
         # print("\n", flush=True)
-        return DistanceHistogram(probe_info.histogram_bucket_steps_per_sec() / steps_per_unit,
-                                 buckets)
+        bucket_edges = [
+            e / steps_per_unit for e in probe_info.histogram_bucket_edges(len(buckets))
+        ]
+        return DistanceHistogram(bucket_edges, buckets)
 
     def centers(self) -> List[float]:
-        w = self.__bucket_width
-        v = w / 2
-        result = []
-        for i in range(len(self.__buckets)):
-            result.append(v)
-            v += w
-        return result
+        e = self.__bucket_edges
+        return [(e[i] + e[i + 1]) / 2 for i in range(len(self.__buckets))]
 
     def heights(self) -> List[float]:
         return self.__buckets
 
-    def bucket_width(self) -> int:
-        return self.__bucket_width
+    # Bucket widths may differ, depending on the layout.
+    def bucket_widths(self) -> List[float]:
+        e = self.__bucket_edges
+        return [e[i + 1] - e[i] for i in range(len(self.__buckets))]
@@ -5,18 +5,29 @@
 from __future__ import annotations
 
 import logging
-from typing import Callable, Optional
+from typing import Callable, List, Optional
 
 from bleak import BleakClient, BleakScanner
 from bleak.backends.service import BleakGATTCharacteristic, BleakGATTService
+from bleak.exc import BleakError
 
 from common import ble_util
 
+from common.capture_signal import CaptureSignal
+from common.current_heatmap import CurrentHeatmap, CurrentHeatmapPage
 from common.current_histogram import CurrentHistogram
+from common.deep_capture import DEEP_CAPTURE_DONE, DeepCaptureChunk
+from common.capture_spectrum import CaptureSpectrum
+from common.diagnostics import Diagnostics
 from common.distance_histogram import DistanceHistogram
 from common.probe_info import ProbeInfo
 from common.probe_state import ProbeState
+from common.stall_events import StallEvent
+from common.profiler_stats import ProfilerStageStats
+from common.step_events import StepEvents
+from common.step_quantiles import StepQuantiles, StepQuantilesPage
 from common.time_histogram import TimeHistogram
+from common.waveform_stream import WaveformBlock
 
 logger = logging.getLogger(__name__)
 
@@ -28,12 +39,21 @@ class Probe:
         self.__name = name
         self.__nickname = nickname
         self.__probe_info = None
+        self.__probe_info_chrc = None
         self.__stepper_state_chrc = None
         self.__stepper_current_histogram_chrc = None
         self.__stepper_time_histogram_chrc = None
         self.__stepper_distance_histogram_chrc = None
         self.__stepper_command_chrc = None
         self.__capture_signal_chrc = None
+        self.__step_events_chrc = None
+        self.__diagnostics_chrc = None
+        self.__profiler_chrc = None
+        self.__waveform_chrc = None
+        self.__current_heatmap_chrc = None
+        self.__step_quantiles_chrc = None
+        self.__stall_events_chrc = None
+        self.__capture_spectrum_chrc = None
 
     def __str__(self) -> str:
         return self.__client.address
@@ -210,15 +230,56 @@ class Probe:
         if not capture_signal_chrc:
             return False
 
+        # Get step events characteristic. Optional, older firmware
+        # doesn't have it.
+        step_events_chrc = stepper_service.get_characteristic("ff08")
+
+        # Get diagnostics characteristic. Optional, older firmware
+        # doesn't have it.
+        diagnostics_chrc = stepper_service.get_characteristic("ff09")
+
+        # Get profiler characteristic. Optional, older firmware
+        # doesn't have it.
+        profiler_chrc = stepper_service.get_characteristic("ff0a")
+
+        # Get waveform characteristic. Optional, older firmware
+        # doesn't have it.
+        waveform_chrc = stepper_service.get_characteristic("ff0b")
+
+        # Get current heatmap characteristic. Optional, older firmware
+        # doesn't have it.
+        current_heatmap_chrc = stepper_service.get_characteristic("ff0c")
+
+        # Get step quantiles characteristic. Optional, older firmware
+        # doesn't have it.
+        step_quantiles_chrc = stepper_service.get_characteristic("ff0d")
+
+        # Get stall events characteristic. Optional, older firmware
+        # doesn't have it.
+        stall_events_chrc = stepper_service.get_characteristic("ff0e")
+
+        # Get capture spectrum characteristic. Optional, older firmware
+        # doesn't have it.
+        capture_spectrum_chrc = stepper_service.get_characteristic("ff0f")
+
         # Set this object.
         self.__probe_info = ProbeInfo.decode(probe_info_bytes, model_number_bytes.decode(),
                                              manufacturer_bytes.decode())
+        self.__probe_info_chrc = stepper_service.get_characteristic("ff01")
         self.__stepper_state_chrc = stepper_state_chrc
         self.__stepper_current_histogram_chrc = stepper_current_histogram_chrc
         self.__stepper_time_histogram_chrc = stepper_time_histogram_chrc
         self.__stepper_distance_histogram_chrc = stepper_distance_histogram_chrc
         self.__stepper_command_chrc = stepper_command_chrc
         self.__capture_signal_chrc = capture_signal_chrc
+        self.__step_events_chrc = step_events_chrc
+        self.__diagnostics_chrc = diagnostics_chrc
+        self.__profiler_chrc = profiler_chrc
+        self.__waveform_chrc = waveform_chrc
+        self.__current_heatmap_chrc = current_heatmap_chrc
+        self.__step_quantiles_chrc = step_quantiles_chrc
+        self.__stall_events_chrc = stall_events_chrc
+        self.__capture_spectrum_chrc = capture_spectrum_chrc
 
         logger.info(f"Connected to {self.address()}.")
         return True
@@ -237,6 +298,47 @@ class Probe:
         val_bytes = await self.__client.read_gatt_char(self.__stepper_state_chrc)
         return ProbeState.decode(val_bytes, self.__probe_info)
 
+    async def read_diagnostics(self) -> Optional[Diagnostics]:
+        if not self.is_connected():
+            logger.error(f"Not connected (read_diagnostics).")
+            return None
+        if not self.__diagnostics_chrc:
+            logger.error(f"Diagnostics not supported by the device firmware.")
+            return None
+        val_bytes = await self.__client.read_gatt_char(self.__diagnostics_chrc)
+        return Diagnostics.decode(val_bytes, self.__probe_info)
+
+    # Returns the spectrum summary of the last capture that the device
+    # analyzed. Cheaper than reading the capture and computing its FFT.
+    async def read_capture_spectrum(self) -> Optional[CaptureSpectrum]:
+        if not self.is_connected():
+            logger.error(f"Not connected (read_capture_spectrum).")
+            return None
+        if not self.__capture_spectrum_chrc:
+            logger.error(f"Capture spectrum not supported by the device firmware.")
+            return None
+        val_bytes = await self.__client.read_gatt_char(self.__capture_spectrum_chrc)
+        return CaptureSpectrum.decode(val_bytes, self.__probe_info)
+
+    # Returns the profiler stats of all the stages, ordered by stage.
+    # Each read returns the next stage, cyclically.
+    async def read_profiler(self) -> Optional[List[ProfilerStageStats]]:
+        if not self.is_connected():
+            logger.error(f"Not connected (read_profiler).")
+            return None
+        if not self.__profiler_chrc:
+            logger.error(f"Profiler not supported by the device firmware.")
+            return None
+        result = []
+        while True:
+            val_bytes = await self.__client.read_gatt_char(self.__profiler_chrc)
+            stage_stats = ProfilerStageStats.decode(val_bytes)
+            if not stage_stats:
+                return None
+            result.append(stage_stats)
+            if len(result) >= stage_stats.num_stages:
+                return sorted(result, key=lambda stats: stats.stage)
+
     async def read_current_histogram(self, steps_per_unit=1.0) -> Optional[CurrentHistogram]:
         if not self.is_connected():
             logger.error(f"Not connected (read_current_histogram).")
@@ -244,6 +346,51 @@ class Probe:
         val_bytes = await self.__client.read_gatt_char(self.__stepper_current_histogram_chrc)
         return CurrentHistogram.decode(val_bytes, self.__probe_info, steps_per_unit)
 
+    # Reads the speed x peak current histogram, a page of rows per read.
+    async def read_current_heatmap(self, steps_per_unit=1.0) -> Optional[CurrentHeatmap]:
+        if not self.is_connected():
+            logger.error(f"Not connected (read_current_heatmap).")
+            return None
+        if not self.__current_heatmap_chrc:
+            logger.error(f"Current heatmap not supported by the device firmware.")
+            return None
+        pages = []
+        # A previous partial read may leave the device in the middle of a
+        # snapshot. Its remaining pages are skipped.
+        while True:
+            val_bytes = await self.__client.read_gatt_char(self.__current_heatmap_chrc)
+            page = CurrentHeatmapPage.decode(val_bytes)
+            if not page:
+                return None
+            if page.first_row == 0:
+                pages = []
+            pages.append(page)
+            if not page.has_more and pages[0].first_row == 0:
+                return CurrentHeatmap.from_pages(pages, self.__probe_info, steps_per_unit)
+
+    # Reads the step quantiles of all the histogram buckets, a page of
+    # buckets per read.
+    async def read_step_quantiles(self) -> Optional[StepQuantiles]:
+        if not self.is_connected():
+            logger.error(f"Not connected (read_step_quantiles).")
+            return None
+        if not self.__step_quantiles_chrc:
+            logger.error(f"Step quantiles not supported by the device firmware.")
+            return None
+        pages = []
+        # A previous partial read may leave the device in the middle of the
+        # buckets. Its remaining pages are skipped.
+        while True:
+            val_bytes = await self.__client.read_gatt_char(self.__step_quantiles_chrc)
+            page = StepQuantilesPage.decode(val_bytes)
+            if not page:
+                return None
+            if page.first_bucket == 0:
+                pages = []
+            pages.append(page)
+            if not page.has_more and pages[0].first_bucket == 0:
+                return StepQuantiles.from_pages(pages, self.__probe_info)
+
     async def read_time_histogram(self, steps_per_unit=1.0) -> Optional[TimeHistogram]:
         if not self.is_connected():
             logger.error(f"Not connected (read_time_histogram).")
@@ -278,6 +425,111 @@ class Probe:
         arg = max(0, min(255, int(divider)))
         await self.__client.write_gatt_char(self.__stepper_command_chrc, bytearray([0x03, arg]))
 
+    # Selects the format of the capture signal packets, 0x40 (default) or
+    # 0x42 (delta coded, fewer packets per capture). Reset by the device on
+    # each connection. Returns False if the device doesn't support the format.
+    async def write_command_set_capture_format(self, format: int) -> bool:
+        if not self.is_connected():
+            logger.error(f"Not connected (write_command_set_capture_format).")
+            return False
+        try:
+            await self.__client.write_gatt_char(self.__stepper_command_chrc,
+                                                bytearray([0x0e, format]), response=True)
+        except BleakError as e:
+            logger.warning(f"Capture format 0x{format:02x} not supported: {e}")
+            return False
+        return True
+
+    # Sets the histogram layout and clears the histogram. Not persisted on the
+    # device. Rereads the probe info, which has the new buckets. Returns False
+    # if the device rejected the layout.
+    #   layout: 0 = linear, buckets of param1 steps/sec.
+    #           1 = log, from param1 to param2 steps/sec.
+    #           2 = sparse, buckets of param2 steps/sec from param1 steps/sec.
+    async def write_command_set_histogram_layout(self, layout: int, param1: int,
+                                                 param2: int) -> bool:
+        if not self.is_connected():
+            logger.error(f"Not connected (write_command_set_histogram_layout).")
+            return False
+        data = bytearray([0x11, layout])
+        data.extend(param1.to_bytes(2, byteorder='big', signed=False))
+        data.extend(param2.to_bytes(2, byteorder='big', signed=False))
+        try:
+            await self.__client.write_gatt_char(self.__stepper_command_chrc, data, response=True)
+        except BleakError as e:
+            logger.warning(f"Histogram layout {layout} ({param1}, {param2}) rejected: {e}")
+            return False
+        probe_info_bytes = await self.__client.read_gatt_char(self.__probe_info_chrc)
+        probe_info = ProbeInfo.decode(probe_info_bytes, self.__probe_info.model(),
+                                      self.__probe_info.manufacturer())
+        if probe_info:
+            self.__probe_info = probe_info
+        return True
+
+    # Selects the histogram that the histogram reads return. 0 for the
+    # histogram since the last reset (the default), or n in [1, 60] for the
+    # histogram of the last n seconds. Reset by the device on each connection.
+    async def write_command_set_histogram_window(self, secs: int) -> bool:
+        if not self.is_connected():
+            logger.error(f"Not connected (write_command_set_histogram_window).")
+            return False
+        try:
+            await self.__client.write_gatt_char(self.__stepper_command_chrc,
+                                                bytearray([0x12, secs]),
+                                                response=True)
+        except BleakError as e:
+            logger.warning(f"Histogram window {secs} not supported: {e}")
+            return False
+        return True
+
+    # Splits the capture into num_segments segments, each around its own
+    # trigger, or a regular capture if 1. A capture is ready when all its
+    # segments are filled. See CaptureSignal.segments(). Not persisted on
+    # the device.
+    async def write_command_set_capture_segments(self, num_segments: int):
+        if not self.is_connected():
+            logger.error(f"Not connected (write_command_set_capture_segments).")
+            return
+        await self.__client.write_gatt_char(self.__stepper_command_chrc,
+                                            bytearray([0x10, num_segments]))
+
+    # Sets the capture trigger. Not persisted on the device.
+    #   source: 0 = level, 1 = quadrature error, 2 = energized, 3 = step rate.
+    #   mode: 0 = auto, 1 = normal, 2 = single shot.
+    #   channel: 0 = A, 1 = B. Level source only.
+    #   level: In ADC counts, or steps/sec for the step rate source.
+    #   hysteresis: In ADC counts. Level source only.
+    #   pre_trigger_items: Capture items up to and including the trigger.
+    #   holdoff_items: Min capture items from the start of a capture to its trigger.
+    # Returns False if the device rejected the settings.
+    async def write_command_set_capture_trigger(self, source: int = 0, mode: int = 0,
+                                                channel: int = 0, falling_edge: bool = False,
+                                                level: int = 0, hysteresis: int = 10,
+                                                pre_trigger_items: int = 200,
+                                                holdoff_items: int = 0) -> bool:
+        if not self.is_connected():
+            logger.error(f"Not connected (write_command_set_capture_trigger).")
+            return False
+        cmd = bytearray([0x0f, source, mode, channel, 0x01 if falling_edge else 0x00])
+        cmd += level.to_bytes(2, 'big', signed=True)
+        cmd += hysteresis.to_bytes(2, 'big')
+        cmd += pre_trigger_items.to_bytes(2, 'big')
+        cmd += holdoff_items.to_bytes(2, 'big')
+        try:
+            await self.__client.write_gatt_char(self.__stepper_command_chrc, cmd, response=True)
+        except BleakError as e:
+            logger.error(f"Capture trigger rejected: {e}")
+            return False
+        return True
+
+    # Selects the capture mode. 0 = decimate, every n'th sample, 1 = envelope,
+    # the min and max of every n samples. Not persisted on the device.
+    async def write_command_set_capture_mode(self, mode: int):
+        if not self.is_connected():
+            logger.error(f"Not connected (write_command_set_capture_mode).")
+            return
+        await self.__client.write_gatt_char(self.__stepper_command_chrc, bytearray([0x0a, mode]))
+
     # Changes forward/backward direction interpretation. The new direction
     # is persisted on the device.
     async def write_command_toggle_direction(self):
@@ -315,6 +567,80 @@ class Probe:
         # print(f"cmd_bytes: {cmd_bytes}")
         await self.__client.write_gatt_char(self.__stepper_command_chrc, cmd_bytes, response=response)
 
+    # Selects the ADC DMA frame profile. 0 = low latency, 1 = default,
+    # 2 = low overhead. The new profile is persisted on the device.
+    async def write_command_set_frame_profile(self, frame_profile: int):
+        if not self.is_connected():
+            logger.error(f"Not connected (write_command_set_frame_profile).")
+            return
+        await self.__client.write_gatt_char(self.__stepper_command_chrc,
+                                            bytearray([0x09, frame_profile]))
+
+    async def write_command_reset_profiler(self):
+        if not self.is_connected():
+            logger.error(f"Not connected (write_command_reset_profiler).")
+            return
+        await self.__client.write_gatt_char(self.__stepper_command_chrc, bytearray([0x08]))
+
+    # Arms a deep capture of up to num_items items, clipped by the device to
+    # its available memory, or frees it if num_items is zero. The capture is
+    # filled from the next capture trigger on, with the current capture
+    # divider and mode.
+    async def write_command_arm_deep_capture(self, num_items: int):
+        if not self.is_connected():
+            logger.error(f"Not connected (write_command_arm_deep_capture).")
+            return
+        await self.__client.write_gatt_char(self.__stepper_command_chrc,
+                                            bytearray([0x0b]) + num_items.to_bytes(4, 'big'))
+
+    # Selects the deep capture for the following capture reads, starting at
+    # the given item index. write_command_capture_signal_snapshot() selects
+    # back the regular capture.
+    async def write_command_select_deep_capture(self, start_index: int):
+        if not self.is_connected():
+            logger.error(f"Not connected (write_command_select_deep_capture).")
+            return
+        await self.__client.write_gatt_char(self.__stepper_command_chrc,
+                                            bytearray([0x0c]) + start_index.to_bytes(4, 'big'))
+
+    # Starts the waveform stream, keeping one of every decimation ADC
+    # samples, or stops it if decimation is zero. The blocks are sized to
+    # the current MTU. See set_waveform_notifications().
+    async def write_command_set_waveform_stream(self, decimation: int):
+        if not self.is_connected():
+            logger.error(f"Not connected (write_command_set_waveform_stream).")
+            return
+        await self.__client.write_gatt_char(self.__stepper_command_chrc,
+                                            bytearray([0x0d, decimation]))
+
+    # Reads the next chunk of the selected deep capture.
+    async def read_deep_capture_chunk(self) -> Optional[DeepCaptureChunk]:
+        packet = await self.read_next_capture_signal_packet()
+        return DeepCaptureChunk.decode(packet) if packet else None
+
+    # Reads a completed deep capture. Returns None if it's not completed
+    # yet. A failed read is retried from the last item received.
+    async def read_deep_capture(self, max_retries=3) -> Optional[CaptureSignal]:
+        chunks = []
+        next_index = 0
+        retries = 0
+        await self.write_command_select_deep_capture(0)
+        while True:
+            chunk = await self.read_deep_capture_chunk()
+            if not chunk or chunk.start_index != next_index:
+                retries += 1
+                if retries > max_retries:
+                    return None
+                await self.write_command_select_deep_capture(next_index)
+                continue
+            if chunk.state != DEEP_CAPTURE_DONE:
+                logger.error(f"Deep capture not completed (state {chunk.state}).")
+                return None
+            chunks.append(chunk)
+            next_index += len(chunk.values)
+            if not chunk.has_more:
+                return DeepCaptureChunk.to_capture_signal(chunks, self.__probe_info)
+
     async def read_next_capture_signal_packet(self) -> Optional[bytearray]:
         if not self.is_connected():
             logger.error(f"Not connected (read_capture_signal_packet).")
@@ -334,6 +660,69 @@ class Probe:
         await self.__client.start_notify(self.__stepper_state_chrc, callback_handler)
         logger.info(f"Started device state notifications.")
 
+    # Starts the step events notifications. The handler is called with a
+    # StepEvents per notification. A gap in the sequence numbers between
+    # notifications indicates events that the device dropped. Returns False
+    # if the device doesn't support step events.
+    async def set_step_events_notifications(self, handler: Callable[[StepEvents], None]) -> bool:
+        # Adapter handler.
+        async def callback_handler(sender, data):
+            step_events = StepEvents.decode(data, self.__probe_info)
+            if handler and step_events:
+                handler(step_events)
+
+        if not self.is_connected():
+            logger.error(f"Not connected (set_step_events_notifications).")
+            return False
+        if not self.__step_events_chrc:
+            logger.error(f"Device doesn't support step events.")
+            return False
+        await self.__client.start_notify(self.__step_events_chrc, callback_handler)
+        logger.info(f"Started step events notifications.")
+        return True
+
+    # Starts the waveform notifications. The handler is called with a
+    # WaveformBlock per notification. A gap in the sequence numbers between
+    # blocks indicates blocks that the device dropped. Returns False if the
+    # device doesn't support the waveform stream.
+    async def set_waveform_notifications(self, handler: Callable[[WaveformBlock], None]) -> bool:
+        # Adapter handler.
+        async def callback_handler(sender, data):
+            block = WaveformBlock.decode(data, self.__probe_info)
+            if handler and block:
+                handler(block)
+
+        if not self.is_connected():
+            logger.error(f"Not connected (set_waveform_notifications).")
+            return False
+        if not self.__waveform_chrc:
+            logger.error(f"Device doesn't support the waveform stream.")
+            return False
+        await self.__client.start_notify(self.__waveform_chrc, callback_handler)
+        logger.info(f"Started waveform notifications.")
+        return True
+
+    # Starts the stall events notifications. The handler is called with a
+    # StallEvent per notification. A gap in the sequence numbers indicates
+    # events that the device dropped. Returns False if the device doesn't
+    # support stall events.
+    async def set_stall_events_notifications(self, handler: Callable[[StallEvent], None]) -> bool:
+        # Adapter handler.
+        async def callback_handler(sender, data):
+            event = StallEvent.decode(data, self.__probe_info)
+            if handler and event:
+                handler(event)
+
+        if not self.is_connected():
+            logger.error(f"Not connected (set_stall_events_notifications).")
+            return False
+        if not self.__stall_events_chrc:
+            logger.error(f"Device doesn't support stall events.")
+            return False
+        await self.__client.start_notify(self.__stall_events_chrc, callback_handler)
+        logger.info(f"Started stall events notifications.")
+        return True
+
     # NOTE: This used to be problematic under Windows per 
     # https://github.com/hbldh/bleak/issues/1223 but seems 
     # to be ok as of Apr 2023.
@@ -4,6 +4,7 @@ from __future__ import annotations
 
 import logging
 import sys
+from typing import List
 
 logger = logging.getLogger(__name__)
 
@@ -12,7 +13,9 @@ class ProbeInfo:
 
     def __init__(self, model: str, manufacturer: str, hardware_config: int,
                  current_ticks_per_amp: int, time_ticks_per_sec: int,
-                 histogram_bucket_steps_per_sec: int, app_version_str: str):
+                 histogram_bucket_steps_per_sec: int, app_version_str: str,
+                 histogram_layout: int = 0,
+                 histogram_bucket_min_speeds: List[int] | None = None):
         self.__model = model
         self.__manufacturer = manufacturer
         self.__hardware_config = hardware_config
@@ -20,6 +23,8 @@ class ProbeInfo:
         self.__time_ticks_per_sec = time_ticks_per_sec
         self.__histogram_bucket_steps_per_sec = histogram_bucket_steps_per_sec
         self.__app_version_str = app_version_str
+        self.__histogram_layout = histogram_layout
+        self.__histogram_bucket_min_speeds = histogram_bucket_min_speeds
 
     @classmethod
     def decode(cls, data: bytearray, model: str, manufacturer: str) -> (ProbeInfo | None):
@@ -47,8 +52,27 @@ class ProbeInfo:
         else:
             device_version_str = "NOT AVAILABLE"
 
+        # Added with the histogram layouts. Older versions have only the
+        # linear layout.
+        histogram_layout = 0
+        histogram_bucket_min_speeds = None
+        offset = 10 + data[9] if len(data) > 9 else len(data)
+        if len(data) >= offset + 2:
+            histogram_layout = data[offset]
+            num_buckets = data[offset + 1]
+            offset += 2
+            if len(data) < offset + num_buckets * 2:
+                logger.error(f"Invalid probe info histogram layout length {len(data)}.")
+                return None
+            histogram_bucket_min_speeds = []
+            for i in range(num_buckets):
+                histogram_bucket_min_speeds.append(
+                    int.from_bytes(data[offset:offset + 2], byteorder='big', signed=False))
+                offset += 2
+
         return ProbeInfo(model, manufacturer, hardware_config, current_ticks_per_amp,
-                         time_ticks_per_sec, histogram_bucket_steps_per_sec, device_version_str)
+                         time_ticks_per_sec, histogram_bucket_steps_per_sec, device_version_str,
+                         histogram_layout, histogram_bucket_min_speeds)
 
     def model(self) -> str:
         return self.__model
@@ -68,6 +92,21 @@ class ProbeInfo:
     def histogram_bucket_steps_per_sec(self) -> int:
         return self.__histogram_bucket_steps_per_sec
 
+    # 0 linear, 1 log, 2 sparse. See analyzer::HistogramLayout in the firmware.
+    def histogram_layout(self) -> int:
+        return self.__histogram_layout
+
+    # Returns the num_buckets + 1 edges of the histogram buckets in steps/sec.
+    # The last bucket is open ended and is given the width of the one before it.
+    def histogram_bucket_edges(self, num_buckets: int) -> List[int]:
+        min_speeds = self.__histogram_bucket_min_speeds
+        if min_speeds is None or len(min_speeds) != num_buckets:
+            w = self.__histogram_bucket_steps_per_sec
+            min_speeds = [i * w for i in range(num_buckets)]
+        if num_buckets < 2:
+            return [0, self.__histogram_bucket_steps_per_sec][:num_buckets + 1]
+        return min_speeds + [2 * min_speeds[-1] - min_speeds[-2]]
+
     def device_version_str(self) -> str:
         return self.__device_version_str
 
@@ -82,3 +121,8 @@ class ProbeInfo:
         print(f"Histogram bucket steps/sec: [{self.__histogram_bucket_steps_per_sec}]",
               file=file,
               flush=True)
+        print(f"Histogram layout: [{self.__histogram_layout}]", file=file, flush=True)
+        if self.__histogram_bucket_min_speeds is not None:
+            print(f"Histogram bucket min steps/sec: {self.__histogram_bucket_min_speeds}",
+                  file=file,
+                  flush=True)
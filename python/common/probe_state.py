@@ -15,7 +15,8 @@ class ProbeState:
 
     def __init__(self, timestamp_secs: float, steps: float, amps_a: float, amps_b: float,
                  ticks_a: int, ticks_b: int, quadrant: int, is_reversed_direction: bool,
-                 is_energized: bool, non_energized_count: int):
+                 is_energized: bool, non_energized_count: int, stall_suspects: int = 0,
+                 last_stall_suspect_secs: float = 0):
         self.timestamp_secs = timestamp_secs
         self.steps = steps
         self.amps_a = amps_a
@@ -27,10 +28,16 @@ class ProbeState:
         self.is_reversed_direction = is_reversed_direction
         self.is_energized = is_energized
         self.non_energized_count = non_energized_count
+        # Stall suspects since the last reset and the time of the last
+        # one. Zero with older firmware.
+        self.stall_suspects = stall_suspects
+        self.last_stall_suspect_secs = last_stall_suspect_secs
 
     @classmethod
     def decode(cls, data: bytearray, probe_info: ProbeInfo) -> (ProbeState | None):
-        if len(data) != 19:
+        # Newer firmware appends the step fraction, in 1/256 steps, and
+        # then the stall suspects.
+        if len(data) not in (19, 21, 31):
             print(f"Invalid state data length {len(data)}.", flush=True)
             return None
         ticks_timestamp = int.from_bytes(data[0:6], byteorder='big', signed=False)
@@ -47,9 +54,22 @@ class ProbeState:
         non_energized_count = int.from_bytes(data[15:19], byteorder='big', signed=True)
 
         # Compute steps with fractional resolution.
-        steps = ProbeState.microsteps(full_steps, quadrant, ticks_a, ticks_b, is_reversed_direction)
+        if len(data) >= 21:
+            step_fraction = int.from_bytes(data[19:21], byteorder='big', signed=True)
+            steps = full_steps + step_fraction / 256
+        else:
+            steps = ProbeState.microsteps(full_steps, quadrant, ticks_a, ticks_b,
+                                          is_reversed_direction)
+
+        stall_suspects = 0
+        last_stall_suspect_secs = 0
+        if len(data) >= 31:
+            stall_suspects = int.from_bytes(data[21:25], byteorder='big', signed=False)
+            last_stall_suspect_ticks = int.from_bytes(data[25:31], byteorder='big', signed=False)
+            last_stall_suspect_secs = last_stall_suspect_ticks / probe_info.time_ticks_per_sec()
         return ProbeState(timestamp_secs, steps, amps_a, amps_b, ticks_a, ticks_b, quadrant,
-                          is_reversed_direction, is_energized, non_energized_count)
+                          is_reversed_direction, is_energized, non_energized_count,
+                          stall_suspects, last_stall_suspect_secs)
 
     def __str__(self):
         direction = "Fwd"
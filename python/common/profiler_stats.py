@@ -0,0 +1,70 @@
+# Represents the acquisition profiler stats of a single processing
+# stage, in CPU cycles per frame. The device returns one stage per read.
+
+from __future__ import annotations
+
+import logging
+from typing import List
+
+logger = logging.getLogger(__name__)
+
+# Same order as profiler::Stage in the firmware.
+STAGE_NAMES = [
+    "frame", "pair_validation", "filter", "capture", "decoding", "histogram", "snapshot",
+    "acquire", "trigger"
+]
+
+
+class ProfilerStageStats:
+
+    def __init__(self, stage: int, num_stages: int, cpu_mhz: int, count: int, min_cycles: int,
+                 mean_cycles: int, max_cycles: int, buckets: List[int]):
+        self.stage = stage
+        self.num_stages = num_stages
+        self.cpu_mhz = cpu_mhz
+        # Number of frames recorded.
+        self.count = count
+        self.min_cycles = min_cycles
+        self.mean_cycles = mean_cycles
+        self.max_cycles = max_cycles
+        # buckets[i] is the number of frames with [2^i, 2^(i+1)) cycles.
+        self.buckets = buckets
+
+    def name(self) -> str:
+        return STAGE_NAMES[self.stage] if self.stage < len(STAGE_NAMES) else f"stage{self.stage}"
+
+    def cycles_to_usecs(self, cycles: int) -> float:
+        return cycles / self.cpu_mhz
+
+    @classmethod
+    def decode(cls, data: bytearray) -> (ProfilerStageStats | None):
+        if len(data) < 22:
+            logger.error(f"Invalid profiler data length {len(data)}.")
+            return None
+        format = data[0]
+        if format != 0x70:
+            logger.error(f"Unexpected profiler format {format}.")
+            return None
+        stage = data[1]
+        num_stages = data[2]
+        cpu_mhz = int.from_bytes(data[3:5], byteorder='big', signed=False)
+        count, min_cycles, mean_cycles, max_cycles = [
+            int.from_bytes(data[offset:offset + 4], byteorder='big', signed=False)
+            for offset in range(5, 21, 4)
+        ]
+        num_buckets = data[21]
+        if len(data) != 22 + 4 * num_buckets:
+            logger.error(f"Invalid profiler data length {len(data)} for {num_buckets} buckets.")
+            return None
+        buckets = [
+            int.from_bytes(data[offset:offset + 4], byteorder='big', signed=False)
+            for offset in range(22, 22 + 4 * num_buckets, 4)
+        ]
+        return ProfilerStageStats(stage, num_stages, cpu_mhz, count, min_cycles, mean_cycles,
+                                  max_cycles, buckets)
+
+    def __str__(self):
+        return f"{self.name():16s} n:{self.count}" \
+            f" min:{self.cycles_to_usecs(self.min_cycles):.1f}us" \
+            f" mean:{self.cycles_to_usecs(self.mean_cycles):.1f}us" \
+            f" max:{self.cycles_to_usecs(self.max_cycles):.1f}us"
@@ -0,0 +1,67 @@
+# Represents a stall suspect event, received via the stall events
+# notification. The device raises an event when a few consecutive steps
+# draw a higher peak current than is usual at their speed, or take much
+# longer than the steps before them, as when the motor skips steps.
+
+from __future__ import annotations
+
+import logging
+
+from common.probe_info import ProbeInfo
+
+logger = logging.getLogger(__name__)
+
+# Reason bits.
+STALL_REASON_PEAK_CURRENT = 0x01
+STALL_REASON_STEP_INTERVAL = 0x02
+
+
+class StallEvent:
+
+    def __init__(self, seq_number: int, timestamp_secs: float, reasons: int,
+                 peak_amps: float, baseline_peak_amps: float, step_secs: float,
+                 baseline_step_secs: float):
+        # Count of stall suspects since the last reset, including this one.
+        # A gap indicates events that the device dropped.
+        self.seq_number = seq_number
+        # Time of the end of the step that raised the event.
+        self.timestamp_secs = timestamp_secs
+        # STALL_REASON_* bits.
+        self.reasons = reasons
+        # The last step and the baselines it was compared to.
+        self.peak_amps = peak_amps
+        self.baseline_peak_amps = baseline_peak_amps
+        self.step_secs = step_secs
+        self.baseline_step_secs = baseline_step_secs
+
+    @classmethod
+    def decode(cls, data: bytearray, probe_info: ProbeInfo) -> (StallEvent | None):
+        if len(data) != 22:
+            logger.error(f"Invalid stall event data length {len(data)}.")
+            return None
+        format = data[0]
+        if format != 0xb0:
+            logger.error(f"Unexpected stall event format {format}.")
+            return None
+        ticks = int.from_bytes(data[1:7], byteorder='big', signed=False)
+        seq_number = int.from_bytes(data[7:11], byteorder='big', signed=False)
+        reasons = data[11]
+        peak_current = int.from_bytes(data[12:14], byteorder='big', signed=False)
+        baseline_peak_current = int.from_bytes(data[14:16], byteorder='big', signed=False)
+        ticks_in_step = int.from_bytes(data[16:19], byteorder='big', signed=False)
+        baseline_ticks_in_step = int.from_bytes(data[19:22], byteorder='big', signed=False)
+        ticks_per_sec = probe_info.time_ticks_per_sec()
+        ticks_per_amp = probe_info.current_ticks_per_amp()
+        return StallEvent(seq_number, ticks / ticks_per_sec, reasons, peak_current / ticks_per_amp,
+                          baseline_peak_current / ticks_per_amp, ticks_in_step / ticks_per_sec,
+                          baseline_ticks_in_step / ticks_per_sec)
+
+    def __str__(self):
+        reasons = []
+        if self.reasons & STALL_REASON_PEAK_CURRENT:
+            reasons.append("current")
+        if self.reasons & STALL_REASON_STEP_INTERVAL:
+            reasons.append("interval")
+        return f"#{self.seq_number} TS:{self.timestamp_secs:9.5f}, {'+'.join(reasons)}," \
+            f" {self.peak_amps:4.2f}A (baseline {self.baseline_peak_amps:4.2f}A)," \
+            f" {self.step_secs * 1000:8.3f}ms (baseline {self.baseline_step_secs * 1000:8.3f}ms)"
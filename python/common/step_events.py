@@ -0,0 +1,67 @@
+# Represents a batch of step events, received via the step events
+# notification. Each event describes a single full step, allowing to
+# reconstruct the exact velocity profile.
+
+from __future__ import annotations
+
+import logging
+from typing import List
+
+from common.probe_info import ProbeInfo
+
+logger = logging.getLogger(__name__)
+
+
+class StepEvent:
+
+    def __init__(self, seq_number: int, timestamp_secs: float, increment: int,
+                 step_secs: float, max_current_amps: float):
+        self.seq_number = seq_number
+        # Time of the end of the step.
+        self.timestamp_secs = timestamp_secs
+        # Change in the full steps count, +1 or -1.
+        self.increment = increment
+        # Step duration.
+        self.step_secs = step_secs
+        self.max_current_amps = max_current_amps
+
+    def __str__(self):
+        return f"#{self.seq_number} TS:{self.timestamp_secs:9.5f}, {self.increment:+d}," \
+            f" {self.step_secs * 1000:8.3f}ms, {self.max_current_amps:4.2f}A"
+
+
+class StepEvents:
+
+    def __init__(self, first_seq_number: int, events: List[StepEvent]):
+        # Events have consecutive sequence numbers, starting from this one.
+        self.first_seq_number = first_seq_number
+        self.events = events
+
+    @classmethod
+    def decode(cls, data: bytearray, probe_info: ProbeInfo) -> (StepEvents | None):
+        if len(data) < 6:
+            logger.error(f"Invalid step events data length {len(data)}.")
+            return None
+        format = data[0]
+        if format != 0x50:
+            logger.error(f"Unexpected step events format {format}.")
+            return None
+        first_seq_number = int.from_bytes(data[1:5], byteorder='big', signed=False)
+        count = data[5]
+        if len(data) != 6 + count * 12:
+            logger.error(f"Invalid step events data length {len(data)} for {count} events.")
+            return None
+        events = []
+        for i in range(count):
+            offset = 6 + i * 12
+            ticks = int.from_bytes(data[offset:offset + 6], byteorder='big', signed=False)
+            increment = int.from_bytes(data[offset + 6:offset + 7], byteorder='big', signed=True)
+            ticks_in_step = int.from_bytes(data[offset + 7:offset + 10], byteorder='big',
+                                           signed=False)
+            max_current = int.from_bytes(data[offset + 10:offset + 12], byteorder='big',
+                                         signed=False)
+            events.append(
+                StepEvent(first_seq_number + i, ticks / probe_info.time_ticks_per_sec(),
+                          increment, ticks_in_step / probe_info.time_ticks_per_sec(),
+                          max_current / probe_info.current_ticks_per_amp()))
+        return StepEvents(first_seq_number, events)
@@ -0,0 +1,100 @@
+# Represents fetched step quantiles by speed bucket. Each bucket has the
+# quantiles of its steps' durations and peak currents, which show the
+# jitter that the histograms average out. The device returns the buckets
+# in pages, one page per read.
+
+from __future__ import annotations
+
+import logging
+from typing import List
+from common.probe_info import ProbeInfo
+
+logger = logging.getLogger(__name__)
+
+
+def _uint16(data: bytearray, offset: int) -> int:
+    return int.from_bytes(data[offset:offset + 2], byteorder='big', signed=False)
+
+
+class StepQuantilesPage:
+
+    def __init__(self, has_more: bool, num_buckets: int, per_mille: List[int], first_bucket: int,
+                 ticks_in_step: List[List[int]], peak_current: List[List[int]]):
+        self.has_more = has_more
+        # Total buckets.
+        self.num_buckets = num_buckets
+        # The quantiles, e.g. [500, 900, 990] for p50, p90, p99.
+        self.per_mille = per_mille
+        self.first_bucket = first_bucket
+        # Per bucket of the page, per quantile. In ADC ticks and ADC counts,
+        # all zero if the bucket has no steps.
+        self.ticks_in_step = ticks_in_step
+        self.peak_current = peak_current
+
+    @classmethod
+    def decode(cls, data: bytearray) -> (StepQuantilesPage | None):
+        if len(data) < 6:
+            logger.error(f"Invalid step quantiles data length {len(data)}.")
+            return None
+        format = data[0]
+        if format != 0xa0:
+            logger.error(f"Unexpected step quantiles format {format}.")
+            return None
+        has_more = (data[1] & 0x01) != 0
+        num_buckets = data[2]
+        num_quantiles = data[3]
+        header_len = 6 + 2 * num_quantiles
+        if len(data) < header_len:
+            logger.error(f"Invalid step quantiles data length {len(data)}.")
+            return None
+        per_mille = [_uint16(data, 4 + 2 * i) for i in range(num_quantiles)]
+        first_bucket = data[header_len - 2]
+        page_buckets = data[header_len - 1]
+        if (len(data) != header_len + 4 * num_quantiles * page_buckets or
+                first_bucket + page_buckets > num_buckets):
+            logger.error(f"Invalid step quantiles page, length {len(data)}, "
+                         f"buckets {first_bucket}+{page_buckets}.")
+            return None
+        ticks_in_step = []
+        peak_current = []
+        offset = header_len
+        for i in range(page_buckets):
+            ticks_in_step.append([_uint16(data, offset + 2 * j) for j in range(num_quantiles)])
+            offset += 2 * num_quantiles
+            peak_current.append([_uint16(data, offset + 2 * j) for j in range(num_quantiles)])
+            offset += 2 * num_quantiles
+        return StepQuantilesPage(has_more, num_buckets, per_mille, first_bucket, ticks_in_step,
+                                 peak_current)
+
+
+class StepQuantiles:
+
+    def __init__(self, per_mille: List[int], step_secs: List[List[float]],
+                 peak_amps: List[List[float]]):
+        # The quantiles, e.g. [500, 900, 990] for p50, p90, p99.
+        self.per_mille = per_mille
+        # Per histogram bucket, per quantile. Step durations in seconds and
+        # peak currents in amps, all zero if the bucket has no steps.
+        self.step_secs = step_secs
+        self.peak_amps = peak_amps
+
+    # Assembles the pages of all the buckets, in order from the first one.
+    @classmethod
+    def from_pages(cls, pages: List[StepQuantilesPage],
+                   probe_info: ProbeInfo) -> (StepQuantiles | None):
+        if not pages or pages[0].first_bucket != 0 or pages[-1].has_more:
+            logger.error(f"Incomplete step quantiles pages.")
+            return None
+        ticks_in_step = []
+        peak_current = []
+        for page in pages:
+            if page.first_bucket != len(ticks_in_step):
+                logger.error(f"Inconsistent step quantiles pages.")
+                return None
+            ticks_in_step.extend(page.ticks_in_step)
+            peak_current.extend(page.peak_current)
+        ticks_per_sec = probe_info.time_ticks_per_sec()
+        ticks_per_amp = probe_info.current_ticks_per_amp()
+        step_secs = [[t / ticks_per_sec for t in bucket] for bucket in ticks_in_step]
+        peak_amps = [[c / ticks_per_amp for c in bucket] for bucket in peak_current]
+        return StepQuantiles(pages[0].per_mille, step_secs, peak_amps)
@@ -12,8 +12,9 @@ logger = logging.getLogger(__name__)
 
 class TimeHistogram:
 
-    def __init__(self, bucket_width: int, buckets: List[float]):
-        self.__bucket_width: int = bucket_width
+    def __init__(self, bucket_edges: List[float], buckets: List[float]):
+        # len(buckets) + 1 edges, in units/sec.
+        self.__bucket_edges: List[float] = bucket_edges
         self.__buckets: List[float] = buckets
 
     @classmethod
@@ -33,19 +34,19 @@ class TimeHistogram:
             time_percents = time_mils / 10.0
             buckets.append(time_percents)
 
-        return TimeHistogram(probe_info.histogram_bucket_steps_per_sec() / steps_per_unit, buckets)
+        bucket_edges = [
+            e / steps_per_unit for e in probe_info.histogram_bucket_edges(len(buckets))
+        ]
+        return TimeHistogram(bucket_edges, buckets)
 
     def centers(self) -> List[float]:
-        w = self.__bucket_width
-        v = w / 2
-        result = []
-        for i in range(len(self.__buckets)):
-            result.append(v)
-            v += w
-        return result
+        e = self.__bucket_edges
+        return [(e[i] + e[i + 1]) / 2 for i in range(len(self.__buckets))]
 
     def heights(self) -> List[float]:
         return self.__buckets
 
-    def bucket_width(self) -> int:
-        return self.__bucket_width
+    # Bucket widths may differ, depending on the layout.
+    def bucket_widths(self) -> List[float]:
+        e = self.__bucket_edges
+        return [e[i + 1] - e[i] for i in range(len(self.__buckets))]
@@ -0,0 +1,88 @@
+# Represents a block of the compressed waveform stream, received via the
+# waveform notification. Each sample is a pair of ADC readings, encoded as
+# zigzag varint deltas from the previous sample in the block.
+
+from __future__ import annotations
+
+import logging
+from typing import List, Tuple
+
+from common.probe_info import ProbeInfo
+
+logger = logging.getLogger(__name__)
+
+
+# Decodes a zigzag varint at the given offset. Returns the value and the
+# offset of the next byte, or None if the data is truncated.
+def parse_zigzag_varint(data: bytearray, offset: int) -> (Tuple[int, int] | None):
+    result = 0
+    shift = 0
+    while offset < len(data):
+        b = data[offset]
+        offset += 1
+        result |= (b & 0x7f) << shift
+        if not (b & 0x80):
+            return (result >> 1) ^ -(result & 1), offset
+        shift += 7
+    return None
+
+
+class WaveformBlock:
+
+    def __init__(self, seq_number: int, dropped_blocks: int, start_time_secs: float,
+                 decimation: int, sample_period_secs: float, amps_a: List[float],
+                 amps_b: List[float]):
+        # Consecutive blocks have consecutive sequence numbers, unless
+        # blocks were dropped.
+        self.seq_number = seq_number
+        # Number of blocks that the device dropped since boot.
+        self.dropped_blocks = dropped_blocks
+        # The time of the first sample.
+        self.start_time_secs = start_time_secs
+        # The device keeps one of every decimation ADC samples.
+        self.decimation = decimation
+        self.sample_period_secs = sample_period_secs
+        self.amps_a = amps_a
+        self.amps_b = amps_b
+
+    def __str__(self):
+        return f"#{self.seq_number} TS:{self.start_time_secs:9.5f}, {len(self.amps_a)} samples" \
+            f" (1/{self.decimation}), dropped {self.dropped_blocks}"
+
+    @classmethod
+    def decode(cls, data: bytearray, probe_info: ProbeInfo) -> (WaveformBlock | None):
+        if len(data) < 18:
+            logger.error(f"Invalid waveform data length {len(data)}.")
+            return None
+        format = data[0]
+        if format != 0x80:
+            logger.error(f"Unexpected waveform format {format}.")
+            return None
+        seq_number = int.from_bytes(data[1:5], byteorder='big', signed=False)
+        dropped_blocks = int.from_bytes(data[5:9], byteorder='big', signed=False)
+        ticks = int.from_bytes(data[9:15], byteorder='big', signed=False)
+        decimation = data[15]
+        num_samples = int.from_bytes(data[16:18], byteorder='big', signed=False)
+        amps_per_tick = 1.0 / probe_info.current_ticks_per_amp()
+        amps_a = []
+        amps_b = []
+        v1 = 0
+        v2 = 0
+        offset = 18
+        for _ in range(num_samples):
+            parsed1 = parse_zigzag_varint(data, offset)
+            parsed2 = parse_zigzag_varint(data, parsed1[1]) if parsed1 else None
+            if not parsed2:
+                logger.error(f"Truncated waveform block #{seq_number}.")
+                return None
+            v1 += parsed1[0]
+            v2 += parsed2[0]
+            offset = parsed2[1]
+            amps_a.append(v1 * amps_per_tick)
+            amps_b.append(v2 * amps_per_tick)
+        if offset != len(data):
+            logger.error(f"Extra bytes in waveform block #{seq_number}.")
+            return None
+        ticks_per_sec = probe_info.time_ticks_per_sec()
+        return WaveformBlock(seq_number, dropped_blocks, ticks / ticks_per_sec, decimation,
+                             decimation / ticks_per_sec, amps_a, amps_b)
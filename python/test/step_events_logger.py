@@ -0,0 +1,64 @@
+# Logs every step reported by the device, as CSV. Requires a firmware
+# with the step events characteristic.
+
+import argparse
+import asyncio
+import logging
+import signal
+import sys
+import atexit
+
+# A workaround to avoid auto formatting.
+if True:
+    sys.path.append("..")
+    from common import connections
+    from common.step_events import StepEvents
+    from common.probe import Probe
+
+# Allows to stop the program by typing ctrl-c.
+signal.signal(signal.SIGINT, lambda number, frame: sys.exit())
+
+# Command line flags.
+parser = argparse.ArgumentParser()
+parser.add_argument("--device", dest="device", default=None, help="The device name or address")
+args = parser.parse_args()
+
+logging.basicConfig(level=logging.INFO)
+
+# Global variables
+probe = None
+main_event_loop = asyncio.new_event_loop()
+next_seq_number = None
+total_dropped = 0
+
+
+def step_events_callback_handler(step_events: StepEvents):
+    """ An handler that is called on incoming step event batches """
+    global next_seq_number, total_dropped
+    if next_seq_number is None:
+        print(f"Seq,T[secs],Increment,Duration[ms],Peak[Amps]", flush=True)
+    elif step_events.first_seq_number != next_seq_number:
+        dropped = (step_events.first_seq_number - next_seq_number) & 0xffffffff
+        total_dropped += dropped
+        logging.warning(f"{dropped} step events dropped ({total_dropped} total).")
+    for event in step_events.events:
+        print(
+            f"{event.seq_number},{event.timestamp_secs:.5f},{event.increment},"
+            f"{event.step_secs * 1000:.3f},{event.max_current_amps:.2f}",
+            flush=True)
+    next_seq_number = (step_events.first_seq_number + len(step_events.events)) & 0xffffffff
+
+
+async def init():
+    """ Connects and initialize the device."""
+    global probe
+    # Connect to device.
+    probe = await connections.connect_to_probe(args.device)
+    assert (probe)
+    atexit.register(connections.atexit_handler, _probe=probe, _event_loop=main_event_loop)
+    if not await probe.set_step_events_notifications(step_events_callback_handler):
+        sys.exit(1)
+
+
+main_event_loop.run_until_complete(init())
+main_event_loop.run_forever()